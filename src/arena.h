@@ -0,0 +1,99 @@
+#ifndef BLIBS_ARENA_H
+#define BLIBS_ARENA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
+#include <vector>
+
+// A memory resource for scratch data that all dies together. Allocation bumps
+// a pointer through a list of chunks and deallocation does nothing; reset()
+// then hands all of it back at once. Unlike std::pmr::monotonic_buffer_resource
+// the chunks are kept across a reset, merged into one big enough for
+// everything used so far, so a job repeated on similar input reaches a point
+// where it no longer touches the heap at all.
+//
+// Not thread safe: use one arena per thread.
+class Arena : public std::pmr::memory_resource {
+public:
+    explicit Arena(size_t initial_bytes = 64 * 1024) : next_size(initial_bytes) {}
+
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+
+    // Release everything allocated so far, keeping the memory for reuse.
+    void reset() {
+        if (chunks.size() > 1) {
+            size_t total = 0;
+            for (const auto &chunk : chunks)
+                total += chunk.size;
+            chunks.clear();
+            add_chunk(total);
+        }
+        current = 0;
+        used = 0;
+    }
+
+    // Bytes of memory the arena holds, used or not.
+    size_t capacity() const {
+        size_t total = 0;
+        for (const auto &chunk : chunks)
+            total += chunk.size;
+        return total;
+    }
+
+    // Chunks allocated from the heap over the arena's lifetime.
+    size_t chunk_allocations() const { return allocations; }
+
+private:
+    struct Chunk {
+        std::unique_ptr<std::byte[]> data;
+        size_t size;
+    };
+
+    void add_chunk(size_t size) {
+        chunks.push_back({std::make_unique<std::byte[]>(size), size});
+        ++allocations;
+        next_size = size * 2;
+    }
+
+    void *do_allocate(size_t bytes, size_t alignment) override {
+        while (true) {
+            if (current < chunks.size()) {
+                Chunk &chunk = chunks[current];
+                auto base = reinterpret_cast<uintptr_t>(chunk.data.get());
+                size_t start = (base + used + alignment - 1) & ~(alignment - 1);
+                if (start + bytes <= base + chunk.size) {
+                    used = start + bytes - base;
+                    return reinterpret_cast<void *>(start);
+                }
+                if (current + 1 < chunks.size()) {
+                    ++current;
+                    used = 0;
+                    continue;
+                }
+            }
+            size_t size = next_size;
+            while (size < bytes + alignment)
+                size *= 2;
+            add_chunk(size);
+            current = chunks.size() - 1;
+            used = 0;
+        }
+    }
+
+    void do_deallocate(void *, size_t, size_t) override {}
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+        return this == &other;
+    }
+
+    std::vector<Chunk> chunks;
+    size_t current = 0; // The chunk being allocated from
+    size_t used = 0;    // Bytes of it already handed out
+    size_t next_size;
+    size_t allocations = 0;
+};
+
+#endif //BLIBS_ARENA_H
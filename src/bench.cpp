@@ -0,0 +1,666 @@
+//
+// Conversion benchmark. Generates a seeded corpus of document types and times
+// each stage of the converter on them, reporting throughput, allocations and
+// peak heap use. Results can be written as JSON and compared against an
+// earlier run to catch regressions. Then converts adversarial inputs at two
+// sizes in linear mode and fails if time per byte grows with the size.
+//
+// mdc_bench [--size mb] [--seed n] [--min-time seconds] [--json out.json]
+//           [--baseline old.json] [--threshold percent]
+//           [--linear-limit growth]
+//
+#include "markdown.h"
+#include "simd_scan.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <new>
+#include <random>
+#include <regex>
+#include <string>
+#include <vector>
+
+#ifdef BLIBS_SIMD_SCAN_X86
+#include <x86intrin.h>
+#endif
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+// --- Heap accounting ---
+//
+// Every allocation goes through these, so a stage's allocation count and the
+// most heap it held at once can be read around it.
+
+namespace Heap {
+  size_t allocations = 0;
+  size_t live = 0;
+  size_t peak = 0;
+
+  inline size_t usable(void *p, size_t requested) {
+#if defined(__GLIBC__)
+    (void)requested;
+    return malloc_usable_size(p);
+#else
+    (void)p;
+    return requested;
+#endif
+  }
+} // namespace Heap
+
+void *operator new(size_t size) {
+  void *p = std::malloc(size ? size : 1);
+  if (!p)
+    throw std::bad_alloc();
+  ++Heap::allocations;
+  Heap::live += Heap::usable(p, size);
+  Heap::peak = std::max(Heap::peak, Heap::live);
+  return p;
+}
+
+void operator delete(void *p) noexcept {
+  if (!p)
+    return;
+  Heap::live -= Heap::usable(p, 0);
+  std::free(p);
+}
+
+void operator delete(void *p, size_t) noexcept { operator delete(p); }
+
+// std::pmr's default resource allocates through the aligned forms
+void *operator new(size_t size, std::align_val_t align) {
+  size_t alignment = std::max((size_t)align, sizeof(void *));
+  void *p = std::aligned_alloc(alignment, (size + alignment - 1) /
+                                              alignment * alignment);
+  if (!p)
+    throw std::bad_alloc();
+  ++Heap::allocations;
+  Heap::live += Heap::usable(p, size);
+  Heap::peak = std::max(Heap::peak, Heap::live);
+  return p;
+}
+
+void operator delete(void *p, std::align_val_t) noexcept { operator delete(p); }
+void operator delete(void *p, size_t, std::align_val_t) noexcept {
+  operator delete(p);
+}
+
+// --- Corpus ---
+
+// Documents of about size bytes, the same for the same seed.
+struct Corpus {
+  std::mt19937_64 rng;
+
+  explicit Corpus(uint64_t seed) : rng(seed) {}
+
+  size_t pick(size_t n) { return (size_t)(rng() % n); }
+
+  std::string words(size_t count) {
+    static const char *list[] = {"the",      "converter", "reads", "plain",
+                                 "text",     "quickly",   "while", "most",
+                                 "document", "bytes",     "need",  "nothing",
+                                 "markdown", "output",    "of",    "a"};
+    std::string out;
+    for (size_t i = 0; i < count; ++i) {
+      if (i)
+        out += ' ';
+      out += list[pick(16)];
+    }
+    return out;
+  }
+
+  std::string prose(size_t size) {
+    std::string out;
+    for (size_t n = 0; out.size() < size; ++n) {
+      out += "## Section " + std::to_string(n) + "\n\n";
+      for (size_t line = 0, lines = 3 + pick(6); line < lines; ++line) {
+        out += words(10 + pick(20));
+        if (pick(4) == 0)
+          out += " with **" + words(1) + "** and *" + words(2) + "*";
+        out += ".\n";
+      }
+      out += '\n';
+    }
+    return out;
+  }
+
+  std::string lists(size_t size) {
+    std::string out;
+    while (out.size() < size) {
+      bool ordered = pick(2);
+      for (size_t i = 1, items = 2 + pick(12); i <= items; ++i) {
+        out += ordered ? std::to_string(i) + ". " : "- ";
+        out += words(2 + pick(8));
+        out += '\n';
+      }
+      out += '\n';
+    }
+    return out;
+  }
+
+  std::string links(size_t size) {
+    std::string out;
+    for (size_t n = 0; out.size() < size; ++n) {
+      std::string id = std::to_string(n);
+      out += words(1 + pick(3)) + " [" + words(1 + pick(2)) +
+             "](https://example.com/" + id + ") ";
+      if (pick(3) == 0)
+        out += "![" + words(2) + "](img/" + id + ".png) ";
+      if (pick(5) == 0)
+        out += "[![badge](b/" + id + ".svg)](https://ci/" + id + ") ";
+      if (pick(4) == 0)
+        out += '\n';
+    }
+    return out;
+  }
+
+  std::string footnotes(size_t size) {
+    std::string out;
+    for (size_t n = 1; out.size() < size; ++n) {
+      out += words(8 + pick(10)) + "[^" + std::to_string(n) + "]";
+      if (pick(2))
+        out += " and " + words(3) + "[^" + std::to_string(1 + pick(n)) + "]";
+      out += ".\n";
+      if (pick(3) == 0)
+        out += "[^" + std::to_string(n) + "]: " + words(5 + pick(10)) + "\n";
+    }
+    return out;
+  }
+
+  // Reference links to definitions gathered at the bottom, as generated
+  // docs and wikis write them; about one label in eight is never defined.
+  std::string references(size_t size) {
+    std::string out, definitions;
+    for (size_t n = 0; out.size() + definitions.size() < size; ++n) {
+      std::string id = "Ref" + std::to_string(n);
+      out += words(3 + pick(6)) + " [" + words(1 + pick(2)) + "][" + id + "]";
+      out += pick(4) ? " " : ".\n";
+      if (pick(8))
+        definitions += "[" + id + "]: https://example.com/" +
+                       std::to_string(n) + "\n";
+    }
+    return out + "\n\n" + definitions;
+  }
+
+  // A data export: long pipe tables, a link here and there, and large
+  // fenced code blocks full of characters that would be markup outside one.
+  std::string exports(size_t size) {
+    std::string out;
+    for (size_t n = 0; out.size() < size; ++n) {
+      out += "## Export " + std::to_string(n) + "\n\n";
+      out += "| id | name | count | share | source |\n";
+      out += "|---:|:-----|------:|:-----:|--------|\n";
+      for (size_t row = 0, rows = 500 + pick(1500); row < rows; ++row) {
+        out += "| " + std::to_string(row) + " | " + words(1 + pick(3)) +
+               " | " + std::to_string(pick(100000)) + " | " +
+               std::to_string(pick(100)) + "% | ";
+        out += pick(10) ? words(1) : "[log](https://ci/" +
+                                         std::to_string(row) + ")";
+        out += " |\n";
+      }
+      out += "\n```json\n";
+      for (size_t line = 0, lines = 200 + pick(800); line < lines; ++line)
+        out += "  {\"id\": " + std::to_string(line) + ", \"tags\": [\"*" +
+               words(1) + "*\"], \"expr\": \"a < b && [c](d)\"},\n";
+      out += "```\n\n";
+    }
+    return out;
+  }
+
+  // Unmatched brackets, long star runs and emphasis that never closes: the
+  // inputs that make backtracking parsers go quadratic.
+  std::string nesting(size_t size) {
+    std::string out;
+    while (out.size() < size) {
+      switch (pick(5)) {
+      case 0:
+        out += std::string(50 + pick(200), '[') + words(3);
+        break;
+      case 1:
+        for (size_t i = 0, n = 20 + pick(80); i < n; ++i)
+          out += "![";
+        break;
+      case 2:
+        out += std::string(1 + pick(40), '*') + words(2);
+        break;
+      case 3:
+        for (size_t i = 0, n = 10 + pick(30); i < n; ++i)
+          out += "[*a ![b](";
+        break;
+      default:
+        out += "*" + words(2) + " **" + words(1) + " [" + words(1) + "](";
+      }
+      out += pick(3) ? " " : "\n";
+    }
+    return out;
+  }
+
+  // One hostile pattern repeated to size bytes, on lines of line bytes that
+  // each end in tail.
+  std::string adversarial(const std::string &pattern, const std::string &tail,
+                          size_t size, size_t line) {
+    std::string out;
+    while (out.size() < size) {
+      for (size_t n = 0; n < line && out.size() < size; n += pattern.size())
+        out += pattern;
+      out += tail + '\n';
+    }
+    return out;
+  }
+};
+
+// --- Measurement ---
+
+struct Result {
+  std::string document;
+  std::string stage;
+  size_t bytes = 0;
+  double mb_per_s = 0;
+  double ns_per_byte = 0;
+  double bytes_per_cycle = 0; // TSC cycles; 0 where there is no TSC
+  size_t allocations = 0;
+  size_t peak_bytes = 0; // Most heap held at once beyond what was held before
+};
+
+unsigned long long cycles() {
+#ifdef BLIBS_SIMD_SCAN_X86
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+// Runs f until min_seconds have passed and keeps the fastest run. The heap
+// figures come from the first run.
+template <class F>
+Result measure(const std::string &document, const std::string &stage,
+               size_t bytes, double min_seconds, F &&f) {
+  Result r{document, stage, bytes};
+  double best_seconds = 1e30;
+  double best_cycles = 0;
+  double total = 0;
+  for (int run = 0; run == 0 || total < min_seconds; ++run) {
+    size_t allocations = Heap::allocations;
+    size_t live = Heap::live;
+    Heap::peak = live;
+    auto start = std::chrono::steady_clock::now();
+    auto start_cycles = cycles();
+    f();
+    auto end_cycles = cycles();
+    double seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+    if (run == 0) {
+      r.allocations = Heap::allocations - allocations;
+      r.peak_bytes = Heap::peak - live;
+    }
+    total += seconds;
+    if (seconds < best_seconds) {
+      best_seconds = seconds;
+      best_cycles = (double)(end_cycles - start_cycles);
+    }
+  }
+  r.mb_per_s = bytes / best_seconds / 1e6;
+  r.ns_per_byte = best_seconds * 1e9 / bytes;
+  r.bytes_per_cycle = best_cycles > 0 ? bytes / best_cycles : 0;
+  return r;
+}
+
+// Visits every special character, the way the inline scanner does.
+size_t count_specials(SimdScan::FindFunction find, std::string_view text,
+                      const SimdScan::ByteSet &set) {
+  size_t hits = 0;
+  for (size_t pos = 0; pos < text.size(); ++pos) {
+    pos += find(text.data() + pos, text.size() - pos, set);
+    hits += pos < text.size();
+  }
+  return hits;
+}
+
+// Plain text the long way round, as with only an HTML back-end: the page
+// with its tags dropped and the entities the writer uses decoded.
+void strip_html(std::string_view html, std::string &out) {
+  static const SimdScan::ByteSet special("<&");
+  static const std::pair<std::string_view, std::string_view> entities[] = {
+      {"&amp;", "&"},   {"&lt;", "<"},   {"&gt;", ">"},
+      {"&quot;", "\""}, {"&#39;", "'"}, {"&#8617;", "\u21a9"}};
+  out.clear();
+  size_t pos = 0;
+  while (pos < html.size()) {
+    size_t stop = std::min(special.find(html, pos), html.size());
+    out.append(html.data() + pos, stop - pos);
+    if (stop == html.size())
+      break;
+    if (html[stop] == '<') {
+      pos = std::min(html.find('>', stop), html.size() - 1) + 1;
+      continue;
+    }
+    pos = stop + 1;
+    out += '&';
+    for (const auto &[entity, text] : entities) {
+      if (html.substr(stop, entity.size()) == entity) {
+        out.back() = text[0];
+        out.append(text.substr(1));
+        pos = stop + entity.size();
+        break;
+      }
+    }
+  }
+}
+
+// The stages of a conversion, run one by one over text.
+void run_stages(const std::string &name, const std::string &text,
+                double min_seconds, std::vector<Result> &results) {
+  volatile size_t sink = 0;
+  auto add = [&](const std::string &stage, auto &&f) {
+    results.push_back(measure(name, stage, text.size(), min_seconds, f));
+  };
+
+  // Escaping the whole document, against copying it
+  std::string copy;
+  add("copy", [&] {
+    copy.assign(text);
+    sink = copy.size();
+  });
+  add("escape_text", [&] {
+    copy.clear();
+    append_escaped(copy, text, ESCAPE_TEXT);
+    sink = copy.size();
+  });
+  add("escape_attr", [&] {
+    copy.clear();
+    append_escaped(copy, text, ESCAPE_ATTRIBUTE);
+    sink = copy.size();
+  });
+
+  SimdScan::ByteSet specials("*[]!()\n<&");
+  add("scan_scalar", [&] {
+    sink = count_specials(SimdScan::find_scalar, text, specials);
+  });
+  add("scan", [&] {
+    sink = count_specials(SimdScan::best_find(), text, specials);
+  });
+
+  // Splitting into lines and classifying each: the block pass on its own
+  add("blocks", [&] {
+    size_t n = 0;
+    for_each_line(text, [&](std::string_view line) {
+      FootnoteDefinition def;
+      n += match_footnote_definition(line, def) ? 1 : classify_line(line).kind;
+    });
+    sink = n;
+  });
+
+  // The block pass with the inline content of every block parsed as it goes,
+  // and the footnotes collected and added at the end
+  MarkdownAst ast;
+  add("parse", [&] {
+    parse_markdown(text, ast);
+    sink = ast.nodes.size();
+  });
+
+  // Writing the tree out: inline markup, paragraphs, lists, the footnotes
+  add("render", [&] { sink = render_html(ast).size(); });
+
+  // The same tree as plain text and for a terminal. Then plain text from
+  // the Markdown, straight from the tree against stripping the HTML
+  std::string plain, page;
+  add("render_text", [&] {
+    render_text(ast, plain);
+    sink = plain.size();
+  });
+  add("render_ansi", [&] {
+    render_ansi(ast, plain);
+    sink = plain.size();
+  });
+  add("to_text", [&] {
+    parse_markdown(text, ast);
+    render_text(ast, plain);
+    sink = plain.size();
+  });
+  add("html_to_text", [&] {
+    convert_markdown_to_html(text, page);
+    strip_html(page, plain);
+    sink = plain.size();
+  });
+
+  add("convert", [&] { sink = convert_markdown_to_html(text).size(); });
+
+  // The same again reusing the output and a scratch arena. Once the arena
+  // has grown and merged its chunks, this should allocate nothing
+  Arena arena;
+  std::string html;
+  auto convert_reused = [&] {
+    arena.reset();
+    convert_markdown_to_html(text, html, {.scratch = &arena});
+    sink = html.size();
+  };
+  convert_reused();
+  convert_reused();
+  add("convert_reused", convert_reused);
+
+  // A converter with only headings, lists and links compiled in, against
+  // one with everything. The difference is what the other checks cost
+  Converter<> full;
+  Converter<Features::Headings | Features::Lists | Features::Links> minimal;
+  for (int run = 0; run < 2; ++run) {
+    full.convert(text);
+    minimal.convert(text);
+  }
+  add("convert_full", [&] { sink = full.convert(text).size(); });
+  add("convert_min", [&] { sink = minimal.convert(text).size(); });
+
+  // Streaming with the index gathered on the side, against streaming alone
+  // and gathering the index alone, as mdc --index-only does
+  HtmlSink append = [&](std::string_view piece) { html += piece; };
+  add("stream", [&] {
+    arena.reset();
+    html.clear();
+    MarkdownStream stream(append, {.scratch = &arena});
+    stream.write(text);
+    stream.finish();
+    sink = html.size();
+  });
+  DocumentIndex index;
+  add("stream_index", [&] {
+    arena.reset();
+    html.clear();
+    MarkdownStream stream(append, {.scratch = &arena, .index = &index});
+    stream.write(text);
+    stream.finish();
+    sink = html.size() + index.links.size();
+  });
+  add("index_only", [&] {
+    arena.reset();
+    index_markdown(text, index, {.scratch = &arena});
+    sink = index.links.size();
+  });
+  (void)sink;
+}
+
+// Inputs built to find superlinear paths, each as a pattern, the text that
+// ends every line and the length of the lines it is repeated on. A line of
+// size 0 is the whole document. The last ones mix reference and inline
+// links, where a match that loses to the other kind must still be reused.
+struct AdversarialInput {
+  const char *pattern;
+  const char *tail;
+  size_t line;
+};
+
+const AdversarialInput adversarial_patterns[] = {
+    {"[", "", 0},          {"![", "", 0},       {"*", "", 0},
+    {"**a ", "", 0},       {"[a](", "", 0},     {"[a](b", "", 0},
+    {"[^1", "", 0},        {"*[**[*![", "", 0}, {"[a]", "", 0},
+    {"a ", "", 1 << 20},   {"[", "", 4096},     {"[^1]: a", "", 64},
+    {"[a][b] ", "[x](y)", 0}, {"[a]]", "[x](y)", 0},
+    {"[!^]()", "[x][y]", 0},  {"[a][b](", ")", 0},
+};
+
+// Converts each adversarial input at two sizes in linear mode and reports
+// any whose time per byte grows by more than limit from the small one to the
+// one 8 times larger. A quadratic path grows about 8 times; falling out of
+// the caches alone can cost 2 to 3. Returns the number of such inputs.
+int check_linear(size_t size, double min_seconds, double limit) {
+  ConvertOptions options{.limits = {.linear = true, .max_nesting = 32}};
+  Corpus corpus(0);
+  int failures = 0;
+  std::printf("\n%-16s %8s %12s %12s %8s\n", "adversarial", "line",
+              "ns/byte", "ns/byte x8", "growth");
+  for (const auto &[pattern, tail, line] : adversarial_patterns) {
+    std::string name = std::string(pattern) + tail;
+    double ns_per_byte[2];
+    for (int i = 0; i < 2; ++i) {
+      size_t bytes = i ? size : size / 8;
+      std::string text =
+          corpus.adversarial(pattern, tail, bytes, line ? line : bytes);
+      volatile size_t sink = 0;
+      ns_per_byte[i] = measure("adversarial", name, text.size(),
+                               min_seconds / 4, [&] {
+                                 sink = convert_markdown_to_html(text, options)
+                                            .size();
+                               })
+                           .ns_per_byte;
+      (void)sink;
+    }
+    double growth = ns_per_byte[1] / ns_per_byte[0];
+    bool failed = growth > limit;
+    failures += failed;
+    std::printf("%-16s %8zu %12.3f %12.3f %7.2fx%s\n", name.c_str(), line,
+                ns_per_byte[0], ns_per_byte[1], growth,
+                failed ? "  SUPERLINEAR" : "");
+  }
+  return failures;
+}
+
+// --- Output ---
+
+void write_json(std::ostream &out, const std::vector<Result> &results,
+                uint64_t seed) {
+  out << "{\n  \"seed\": " << seed << ",\n  \"results\": [\n";
+  for (size_t i = 0; i < results.size(); ++i) {
+    const Result &r = results[i];
+    char line[512];
+    std::snprintf(line, sizeof(line),
+                  "    {\"document\": \"%s\", \"stage\": \"%s\", "
+                  "\"bytes\": %zu, \"mb_per_s\": %.3f, \"ns_per_byte\": %.4f, "
+                  "\"bytes_per_cycle\": %.4f, \"allocations\": %zu, "
+                  "\"peak_bytes\": %zu}%s\n",
+                  r.document.c_str(), r.stage.c_str(), r.bytes, r.mb_per_s,
+                  r.ns_per_byte, r.bytes_per_cycle, r.allocations,
+                  r.peak_bytes, i + 1 < results.size() ? "," : "");
+    out << line;
+  }
+  out << "  ]\n}\n";
+}
+
+// Reads back the throughput of each document and stage from a file written
+// by write_json.
+std::map<std::string, double> read_baseline(const std::string &path) {
+  std::map<std::string, double> baseline;
+  std::ifstream in(path);
+  std::regex entry(
+      R"re("document": "([^"]*)", "stage": "([^"]*)".*"mb_per_s": ([0-9.eE+-]+))re");
+  std::string line;
+  std::smatch match;
+  while (std::getline(in, line)) {
+    if (std::regex_search(line, match, entry))
+      baseline[match[1].str() + "/" + match[2].str()] =
+          std::strtod(match[3].str().c_str(), nullptr);
+  }
+  return baseline;
+}
+
+int main(int argc, char *argv[]) {
+  double size_mb = 4;
+  uint64_t seed = 1;
+  double min_seconds = 0.3;
+  double threshold = 10;
+  double linear_limit = 3;
+  std::string json_path;
+  std::string baseline_path;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string flag = argv[i];
+    std::string value = argv[i + 1];
+    if (flag == "--size")
+      size_mb = std::strtod(value.c_str(), nullptr);
+    else if (flag == "--seed")
+      seed = std::strtoull(value.c_str(), nullptr, 10);
+    else if (flag == "--min-time")
+      min_seconds = std::strtod(value.c_str(), nullptr);
+    else if (flag == "--json")
+      json_path = value;
+    else if (flag == "--baseline")
+      baseline_path = value;
+    else if (flag == "--threshold")
+      threshold = std::strtod(value.c_str(), nullptr);
+    else if (flag == "--linear-limit")
+      linear_limit = std::strtod(value.c_str(), nullptr);
+    else {
+      std::fprintf(stderr, "mdc_bench: unknown flag %s\n", flag.c_str());
+      return 2;
+    }
+  }
+
+  auto size = (size_t)(size_mb * 1e6);
+  Corpus corpus(seed);
+  std::vector<std::pair<std::string, std::string>> documents = {
+      {"prose", corpus.prose(size)},         {"lists", corpus.lists(size)},
+      {"links", corpus.links(size)},         {"footnotes", corpus.footnotes(size)},
+      {"nesting", corpus.nesting(size)},
+      {"references", corpus.references(size)},
+      {"exports", corpus.exports(size)},
+  };
+
+  std::vector<Result> results;
+  std::printf("%-10s %-12s %10s %10s %11s %12s %12s\n", "document", "stage",
+              "MB/s", "ns/byte", "bytes/cyc", "allocations", "peak bytes");
+  for (const auto &[name, text] : documents) {
+    size_t first = results.size();
+    run_stages(name, text, min_seconds, results);
+    for (size_t i = first; i < results.size(); ++i) {
+      const Result &r = results[i];
+      std::printf("%-10s %-12s %10.1f %10.3f %11.3f %12zu %12zu\n",
+                  r.document.c_str(), r.stage.c_str(), r.mb_per_s,
+                  r.ns_per_byte, r.bytes_per_cycle, r.allocations,
+                  r.peak_bytes);
+    }
+  }
+
+  if (!json_path.empty()) {
+    std::ofstream out(json_path);
+    write_json(out, results, seed);
+  }
+
+  if (int superlinear = check_linear(size, min_seconds, linear_limit)) {
+    std::printf("%d adversarial inputs grew beyond %.1fx per byte\n",
+                superlinear, linear_limit);
+    return 1;
+  }
+
+  if (baseline_path.empty())
+    return 0;
+  auto baseline = read_baseline(baseline_path);
+  if (baseline.empty()) {
+    std::fprintf(stderr, "mdc_bench: no results in %s\n",
+                 baseline_path.c_str());
+    return 2;
+  }
+  int regressions = 0;
+  for (const Result &r : results) {
+    auto it = baseline.find(r.document + "/" + r.stage);
+    if (it == baseline.end() || it->second <= 0)
+      continue;
+    double change = (r.mb_per_s / it->second - 1) * 100;
+    if (change < -threshold) {
+      std::printf("REGRESSION %s/%s: %.1f MB/s, baseline %.1f MB/s (%+.1f%%)\n",
+                  r.document.c_str(), r.stage.c_str(), r.mb_per_s, it->second,
+                  change);
+      ++regressions;
+    }
+  }
+  std::printf("%d regressions beyond %.1f%% against %s\n", regressions,
+              threshold, baseline_path.c_str());
+  return regressions ? 1 : 0;
+}
@@ -1,228 +1,4362 @@
 #pragma once
+#include "arena.h"
+#include "simd_scan.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstring>
+#include <deque>
 #include <functional> // For std::function
 #include <iostream>
 #include <map>
+#include <memory>
+#include <memory_resource>
+#include <optional>
 #include <regex>
 #include <sstream>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+// Selects the implementation used for inline Markdown. The scanner is a
+// single linear pass; the regex engine is the original rule-by-rule pipeline
+// and is kept so the two can be compared. Only the scanner escapes the text
+// it writes out; the regex engine passes raw HTML through as it always did.
+enum InlineEngine {
+  INLINE_SCANNER,
+  INLINE_REGEX,
+};
+
+// The syntax a converter understands, combined with '|' as the argument of
+// Converter<...>. Syntax left out is compiled out of the block and inline
+// passes rather than checked for at run time, and comes out as plain text.
+namespace Features {
+  enum : unsigned {
+    Headings = 1 << 0,
+    Lists = 1 << 1,
+    Links = 1 << 2,
+    Images = 1 << 3,
+    Emphasis = 1 << 4,
+    Footnotes = 1 << 5,
+    CodeBlocks = 1 << 6,
+    Blockquotes = 1 << 7,
+    Tables = 1 << 8,
+    All = (1 << 9) - 1,
+  };
+
+  constexpr bool enabled(unsigned features, unsigned feature) {
+    return (features & feature) != 0;
+  }
+} // namespace Features
+
 // Define a struct to hold a regex and its replacement logic
 struct InlineRule {
   std::regex pattern;
-  // A lambda function that takes a std::smatch and returns the replacement
+  // A lambda function that takes a std::cmatch and returns the replacement
   // string
-  std::function<std::string(const std::smatch &)> replacement_formatter;
+  std::function<std::string(const std::cmatch &)> replacement_formatter;
+  // First character of every match. The scanner only tries the rule where
+  // this character appears.
+  char trigger = 0;
+  // Reported in ConvertStats::rule_matches.
+  const char *name = "custom";
 };
 
-// Helper function to process inline Markdown (images, links, bold, italic,
-// inline footnotes)
-std::string process_inline_markdown(std::string text) {
-  // Define the order of inline processing.
-  // Order matters: More specific patterns (like images, inline footnotes)
-  // should generally come before more general ones (like links, bold, italic).
-  std::vector<InlineRule> rules = {
-      // Rule for Inline Footnote References: [^N] -> <sup><a href="#fnN"
-      // id="fnrefN">N</a></sup>
-      {std::regex(R"(\[\^(\d+)\])"),
-       [](const std::smatch &match) {
-         std::string num = match[1].str();
-         return "<sup><a href=\"#fn" + num + "\" id=\"fnref" + num + "\">" +
-                num + "</a></sup>";
-       }},
-      // Rule for Images: ![alt text](url) -> <img src="url" alt="alt text">
-      {std::regex(R"(!\[(.*?)\]\((.+?)\))"),
-       [](const std::smatch &match) {
-         std::string alt = match[1].str();
-         std::string url = match[2].str();
-         return "<img src=\"" + url + "\" alt=\"" + alt + "\">";
-       }},
-      // Rule for Links: [link text](url) -> <a href="url">link text</a>
-      {std::regex(R"(\[(.+?)\]\((.+?)\))"),
-       [](const std::smatch &match) {
-         std::string text = match[1].str();
-         std::string url = match[2].str();
-         return "<a href=\"" + url + "\">" + text + "</a>";
-       }},
-      // Rule for Bold: **text** -> <strong>text</strong>
-      // Note: For bold/italic with regex, ensure non-greedy matching.
-      // Also, manually doing find/replace like before can sometimes be simpler
-      // for these.
-      // The regex `\*\*([^\*]+?)\*\*` is problematic if `*` can be inside.
-      // A more robust regex for **bold** would be `\*\*([^\*]+)\*\*` or more
-      // complex to handle nesting/escapes.
-      // For simple cases:
-      {std::regex(
-           R"(\*\*([^\*]+?)\*\*)"), // Matches **text** but not **text*more**
-       [](const std::smatch &match) {
-         return "<strong>" + match[1].str() + "</strong>";
-       }},
-      // Rule for Italic: *text* -> <em>text</em>
-      {std::regex(R"(\*([^\*]+?)\*)"), // Matches *text* but not *text**more*
-       [](const std::smatch &match) {
-         return "<em>" + match[1].str() + "</em>";
-       }}};
+// The inline rules, compiled once. A table is immutable once built, so a
+// single instance can be shared by any number of conversions and threads.
+// Custom rules are tried before the built-in ones: by the scanner at each
+// occurrence of their trigger character, and by the regex engine as extra
+// passes ahead of the built-in passes.
+class InlineRuleTable {
+public:
+  InlineRuleTable() {
+    // Order matters: More specific patterns (like images, inline footnotes)
+    // should generally come before more general ones (like links, bold,
+    // italic).
+    builtin = {
+        // Rule for Inline Footnote References: [^N] -> <sup><a href="#fnN"
+        // id="fnrefN">N</a></sup>
+        {std::regex(R"(\[\^(\d+)\])", std::regex::optimize),
+         [](const std::cmatch &match) {
+           std::string num = match[1].str();
+           return "<sup><a href=\"#fn" + num + "\" id=\"fnref" + num + "\">" +
+                  num + "</a></sup>";
+         },
+         '[', "footnote_ref"},
+        // Rule for Images: ![alt text](url) -> <img src="url" alt="alt text">
+        {std::regex(R"(!\[(.*?)\]\((.+?)\))", std::regex::optimize),
+         [](const std::cmatch &match) {
+           std::string alt = match[1].str();
+           std::string url = match[2].str();
+           return "<img src=\"" + url + "\" alt=\"" + alt + "\">";
+         },
+         '!', "image"},
+        // Rule for Links: [link text](url) -> <a href="url">link text</a>
+        {std::regex(R"(\[(.+?)\]\((.+?)\))", std::regex::optimize),
+         [](const std::cmatch &match) {
+           std::string text = match[1].str();
+           std::string url = match[2].str();
+           return "<a href=\"" + url + "\">" + text + "</a>";
+         },
+         '[', "link"},
+        // Rule for Bold: **text** -> <strong>text</strong>
+        // Matches **text** but not **text*more**
+        {std::regex(R"(\*\*([^\*]+?)\*\*)", std::regex::optimize),
+         [](const std::cmatch &match) {
+           return "<strong>" + match[1].str() + "</strong>";
+         },
+         '*', "strong"},
+        // Rule for Italic: *text* -> <em>text</em>
+        // Matches *text* but not *text**more*
+        {std::regex(R"(\*([^\*]+?)\*)", std::regex::optimize),
+         [](const std::cmatch &match) {
+           return "<em>" + match[1].str() + "</em>";
+         },
+         '*', "emphasis"}};
+    for (auto &rule : builtin)
+      special.add(rule.trigger);
+  }
 
-  // Apply each rule sequentially
-  for (const auto &rule : rules) {
-    std::string current_text = "";
-    auto words_begin =
-        std::sregex_iterator(text.begin(), text.end(), rule.pattern);
-    auto words_end = std::sregex_iterator();
+  // Register a custom rule. pattern is compiled here, once; a match must
+  // start with trigger.
+  void add_rule(char trigger, const std::string &pattern,
+                std::function<std::string(const std::cmatch &)> formatter) {
+    custom.push_back(
+        {std::regex(pattern, std::regex::optimize), std::move(formatter),
+         trigger});
+    special.add(trigger);
+    has_custom_trigger[(unsigned char)trigger] = true;
+  }
+
+  const std::vector<InlineRule> &builtin_rules() const { return builtin; }
+  const std::vector<InlineRule> &custom_rules() const { return custom; }
+
+  // True if the scanner has to stop at c.
+  bool is_special(char c) const { return special.contains(c); }
+  // The first character at or after pos that the scanner has to stop at, or
+  // npos.
+  size_t find_special(std::string_view text, size_t pos, size_t end) const {
+    return special.find(text, pos, end);
+  }
+  bool has_custom(char c) const {
+    return has_custom_trigger[(unsigned char)c];
+  }
+
+private:
+  std::vector<InlineRule> builtin;
+  std::vector<InlineRule> custom;
+  SimdScan::ByteSet special;
+  bool has_custom_trigger[256] = {};
+};
+
+// The shared table with only the built-in rules.
+inline const InlineRuleTable &default_inline_rules() {
+  static const InlineRuleTable table;
+  return table;
+}
+
+// --- Instrumentation ---
+//
+// Point ConvertOptions::stats at a ConvertStats to have a conversion record
+// where its time goes. Without one, every hook is a single null check.
+
+// One timed phase of a conversion.
+struct PhaseRecord {
+  const char *name = "";
+  uint64_t start_ns = 0; // On the steady clock
+  uint64_t duration_ns = 0;
+  size_t bytes_in = 0;
+  size_t bytes_out = 0;
+  size_t allocations = 0; // Counted if ConvertStats::allocation_count is set
+  size_t thread = 0;      // Hash of the thread that ran it
+};
+
+struct ConvertStats {
+  std::vector<PhaseRecord> phases;
+  // Matches of each inline rule by InlineRule::name. The scanner reports
+  // the built-in names too, so the engines can be compared.
+  std::map<std::string, size_t> rule_matches;
+  size_t largest_block = 0; // In bytes, split as by is_block_boundary()
+  // Allocations made so far by the calling thread. The library has no way
+  // to count them itself, so the host can provide this, e.g. from its
+  // operator new.
+  size_t (*allocation_count)() = nullptr;
+
+  static uint64_t now_ns() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+  // Add the numbers of another conversion to these.
+  void merge(const ConvertStats &other) {
+    phases.insert(phases.end(), other.phases.begin(), other.phases.end());
+    for (const auto &[rule, count] : other.rule_matches)
+      rule_matches[rule] += count;
+    largest_block = std::max(largest_block, other.largest_block);
+  }
+};
+
+// Times one phase into stats, if there are stats.
+class PhaseTimer {
+public:
+  PhaseTimer(ConvertStats *stats, const char *name, size_t bytes_in)
+      : stats(stats) {
+    if (!stats)
+      return;
+    record.name = name;
+    record.bytes_in = bytes_in;
+    record.thread = std::hash<std::thread::id>()(std::this_thread::get_id());
+    if (stats->allocation_count)
+      record.allocations = stats->allocation_count();
+    record.start_ns = ConvertStats::now_ns();
+  }
+
+  // End the phase, having produced bytes_out.
+  void stop(size_t bytes_out) {
+    if (!stats)
+      return;
+    record.duration_ns = ConvertStats::now_ns() - record.start_ns;
+    record.bytes_out = bytes_out;
+    if (stats->allocation_count)
+      record.allocations = stats->allocation_count() - record.allocations;
+    stats->phases.push_back(record);
+    stats = nullptr;
+  }
+
+private:
+  ConvertStats *stats;
+  PhaseRecord record;
+};
 
-    size_t last_pos = 0;
-    for (std::sregex_iterator i = words_begin; i != words_end; ++i) {
-      std::smatch match = *i;
-      current_text += text.substr(last_pos, match.position() - last_pos);
-      current_text +=
-          rule.replacement_formatter(match); // Use the formatter lambda
-      last_pos = match.position() + match.length();
+// Adds up a phase that runs in many short pieces, such as once per block,
+// and records it as one phase from its first start.
+class PhaseTotal {
+public:
+  void start(ConvertStats *stats) {
+    if (!stats)
+      return;
+    mark_ns = ConvertStats::now_ns();
+    if (!record.start_ns) {
+      record.start_ns = mark_ns;
+      record.thread = std::hash<std::thread::id>()(std::this_thread::get_id());
     }
-    current_text += text.substr(last_pos); // Add remaining text
-    text = current_text;                   // Update text for the next rule
+    if (stats->allocation_count)
+      mark_allocations = stats->allocation_count();
   }
 
-  return text;
+  void stop(ConvertStats *stats, size_t bytes_in, size_t bytes_out) {
+    if (!stats)
+      return;
+    record.duration_ns += ConvertStats::now_ns() - mark_ns;
+    record.bytes_in += bytes_in;
+    record.bytes_out += bytes_out;
+    if (stats->allocation_count)
+      record.allocations += stats->allocation_count() - mark_allocations;
+  }
+
+  void report(ConvertStats *stats, const char *name) {
+    if (!stats || !record.start_ns)
+      return;
+    record.name = name;
+    stats->phases.push_back(record);
+    record = {};
+  }
+
+private:
+  PhaseRecord record;
+  uint64_t mark_ns = 0;
+  size_t mark_allocations = 0;
+};
+
+// --- Limits ---
+//
+// For converting untrusted input. The scanner engine runs in time linear in
+// the input: every byte is looked at a bounded number of times, nothing
+// recurses more than one level, a link search is reused by every later '['
+// that would repeat it and a failed image match holds for the rest of its
+// line. Only custom rules, which are
+// std::regex searches, and the regex engine fall outside that, and linear
+// mode leaves both out. The limits bound the rest: input past max_input is
+// refused with ConvertLimitError, and anything past the other limits is
+// written as escaped text with no markup.
+
+// Quotes nest no deeper than this without a max_nesting, as writing out the
+// tree recurses once per level. Markers past it are text.
+constexpr size_t default_max_quote_depth = 100;
+
+struct ConvertLimits {
+  bool linear = false;      // Scanner only, custom inline rules not applied
+  size_t max_input = 0;     // Bytes of Markdown; 0 is no limit for each
+  size_t max_line = 0;      // Longer lines become a paragraph of plain text
+  size_t max_nesting = 0;   // Deeper quotes, links and emphasis are text
+  size_t max_footnotes = 0; // Later definitions become plain text
+
+  // True if the conversion has to go through the scanner to enforce these.
+  bool active() const {
+    return linear || max_input || max_line || max_nesting || max_footnotes;
+  }
+};
+
+struct ConvertLimitError : std::length_error {
+  using std::length_error::length_error;
+};
+
+inline void check_input_size(size_t size, const ConvertLimits &limits) {
+  if (limits.max_input && size > limits.max_input)
+    throw ConvertLimitError("Markdown input of " + std::to_string(size) +
+                            " bytes is over the limit of " +
+                            std::to_string(limits.max_input));
 }
 
-// Rest of the convert_markdown_to_html function remains the same
-std::string convert_markdown_to_html(const std::string &markdownContent) {
-  // --- Footnote Extraction and Storage ---
-  std::map<std::string, std::string> footnotes;
-  std::string contentWithoutFootnoteDefs;
+// --- Escaping ---
+//
+// Source text is escaped as it is written out, so no markup in a document
+// reaches the page as HTML. The escaping depends on where the text goes.
+// Element content only needs '&', '<' and '>' replaced. Attribute values,
+// always double quoted here, also need the quotes. JSON strings, for the
+// document index, need quotes, backslashes and control characters escaped
+// instead. Text for a terminal has its control characters replaced, so a
+// document cannot send escape sequences of its own. Runs of clean text are
+// found a vector at a time and copied in bulk, so escaping typical text costs
+// about as much as copying it.
 
-  std::regex footnote_def_regex(R"(^\[\^(\d+)\]:\s*(.*)$)");
+enum EscapeContext {
+  ESCAPE_TEXT,      // Element content
+  ESCAPE_ATTRIBUTE, // A quoted attribute value, such as a link's URL
+  ESCAPE_JSON,      // The inside of a JSON string
+  ESCAPE_TERMINAL,  // Text written to a terminal
+};
 
-  std::istringstream initialIss(markdownContent);
-  std::string line;
+inline const SimdScan::ByteSet &escaped_bytes(EscapeContext context) {
+  static const SimdScan::ByteSet text("&<>");
+  static const SimdScan::ByteSet attribute("&<>\"'");
+  static const SimdScan::ByteSet json = [] {
+    SimdScan::ByteSet set("\"\\");
+    for (char c = 0; c < 0x20; ++c)
+      set.add(c);
+    return set;
+  }();
+  // C0 controls but tab, DEL, and the lead byte of the UTF-8 C1 controls
+  static const SimdScan::ByteSet terminal = [] {
+    SimdScan::ByteSet set("\x7f\xc2");
+    for (char c = 0; c < 0x20; ++c)
+      if (c != '\t')
+        set.add(c);
+    return set;
+  }();
+  return context == ESCAPE_TEXT        ? text
+         : context == ESCAPE_ATTRIBUTE ? attribute
+         : context == ESCAPE_JSON      ? json
+                                       : terminal;
+}
 
-  while (std::getline(initialIss, line)) {
-    std::smatch matches;
-    if (std::regex_match(line, matches, footnote_def_regex)) {
-      footnotes[matches[1].str()] = matches[2].str();
-    } else {
-      contentWithoutFootnoteDefs += line + "\n";
+// Append text to out with the characters that are special in context
+// replaced by entities, for JSON by backslash escapes and for a terminal by
+// '?'.
+inline void append_escaped(std::string &out, std::string_view text,
+                           EscapeContext context) {
+  const SimdScan::ByteSet &special = escaped_bytes(context);
+  size_t pos = 0;
+  while (true) {
+    size_t stop = special.find(text, pos);
+    if (stop == std::string_view::npos) {
+      out.append(text.data() + pos, text.size() - pos);
+      return;
+    }
+    out.append(text.data() + pos, stop - pos);
+    if (context == ESCAPE_TERMINAL) {
+      // U+0080 to U+009F are C1 controls, which some terminals act on
+      unsigned char next =
+          stop + 1 < text.size() ? (unsigned char)text[stop + 1] : 0;
+      bool c1 = text[stop] == '\xc2' && next >= 0x80 && next <= 0x9f;
+      out += text[stop] == '\xc2' && !c1 ? '\xc2' : '?';
+      pos = stop + 1 + c1;
+      continue;
     }
+    if (context == ESCAPE_JSON) {
+      char c = text[stop];
+      if (c == '"' || c == '\\') {
+        out += '\\';
+        out += c;
+      } else {
+        static const char hex[] = "0123456789abcdef";
+        out += "\\u00";
+        out += hex[c >> 4];
+        out += hex[c & 0xf];
+      }
+      pos = stop + 1;
+      continue;
+    }
+    switch (text[stop]) {
+    case '&':
+      out += "&amp;";
+      break;
+    case '<':
+      out += "&lt;";
+      break;
+    case '>':
+      out += "&gt;";
+      break;
+    case '"':
+      out += "&quot;";
+      break;
+    default:
+      out += "&#39;";
+    }
+    pos = stop + 1;
   }
+}
 
-  // --- Heading, List, and General Content Processing ---
-  std::string processedContent;
-  std::istringstream iss(contentWithoutFootnoteDefs);
+// --- Definitions ---
+//
+// Link reference definitions ("[id]: url") and footnote definitions
+// ("[^N]: text") are gathered by the block pass into a DefinitionIndex: a
+// flat, open addressing hash table of views into the source. A reference is
+// resolved with a single short probe however many definitions a document
+// has, and the whole table is one allocation, which an Arena can hold. Labels
+// match regardless of ASCII case, as in CommonMark.
 
-  bool inUnorderedList = false;
-  bool inOrderedList = false;
+enum DefinitionKind : unsigned char {
+  DEFINITION_LINK,
+  DEFINITION_FOOTNOTE,
+};
 
-  std::regex ordered_list_item_regex(R"(^(\d+)\.\s(.+)$)");
+// Orders footnote numbers by value, so 2 comes before 10. Numbers of equal
+// value, such as 1 and 01, are ordered by their text.
+constexpr bool footnote_number_less(std::string_view a, std::string_view b) {
+  size_t a_zeros = std::min(a.find_first_not_of('0'), a.size());
+  size_t b_zeros = std::min(b.find_first_not_of('0'), b.size());
+  if (a.size() - a_zeros != b.size() - b_zeros)
+    return a.size() - a_zeros < b.size() - b_zeros;
+  int order = a.substr(a_zeros).compare(b.substr(b_zeros));
+  return order != 0 ? order < 0 : a < b;
+}
 
-  while (std::getline(iss, line)) {
-    // --- Close any open lists if the current line is a block element ---
-    if (line.rfind("# ", 0) == 0 || line.rfind("## ", 0) == 0 ||
-        line.rfind("### ", 0) == 0) {
-      if (inUnorderedList) {
-        processedContent += "</ul>\n";
-        inUnorderedList = false;
+static_assert(footnote_number_less("2", "10"));
+static_assert(!footnote_number_less("10", "2"));
+static_assert(footnote_number_less("01", "1") &&
+              !footnote_number_less("1", "01"));
+static_assert(footnote_number_less("0", "1"));
+
+struct FootnoteNumberLess {
+  bool operator()(std::string_view a, std::string_view b) const {
+    return footnote_number_less(a, b);
+  }
+};
+
+class DefinitionIndex {
+public:
+  explicit DefinitionIndex(
+      std::pmr::memory_resource *memory = std::pmr::get_default_resource())
+      : slots(memory) {}
+
+  // Add a definition of key. If key already has one of this kind, it is
+  // kept, or replaced if replace is set. Returns true if key was new.
+  bool insert(DefinitionKind kind, std::string_view key, std::string_view value,
+              bool replace) {
+    if ((used + 1) * 2 > slots.size())
+      grow();
+    uint64_t hash = hash_key(kind, key);
+    Slot &slot = slots[find_slot(kind, key, hash)];
+    if (slot.used) {
+      if (replace)
+        slot.value = value;
+      return false;
+    }
+    slot = {.hash = hash, .key = key, .value = value, .kind = kind,
+            .used = true};
+    ++used;
+    ++counts[kind];
+    return true;
+  }
+
+  // The definition of key, or nullptr if there is none.
+  const std::string_view *find(DefinitionKind kind,
+                               std::string_view key) const {
+    if (slots.empty())
+      return nullptr;
+    const Slot &slot = slots[find_slot(kind, key, hash_key(kind, key))];
+    return slot.used ? &slot.value : nullptr;
+  }
+
+  size_t size(DefinitionKind kind) const { return counts[kind]; }
+
+  // Make room for count more definitions, so that adding them never grows
+  // the table part way through.
+  void reserve(size_t count) {
+    size_t size = std::max<size_t>(16, slots.size());
+    while ((used + count) * 2 > size)
+      size *= 2;
+    if (size != slots.size())
+      rehash(size);
+  }
+
+  // Start loading the slot key would be looked for in. Over a large table
+  // nearly every insert() or find() misses the cache; prefetching a few keys
+  // ahead of a loop over many lets those misses overlap.
+  void prefetch(DefinitionKind kind, std::string_view key) const {
+#if defined(__GNUC__)
+    if (!slots.empty())
+      __builtin_prefetch(&slots[hash_key(kind, key) & (slots.size() - 1)]);
+#else
+    (void)kind;
+    (void)key;
+#endif
+  }
+
+  // Calls f(key, value) for every definition of kind, in no particular order.
+  template <class F> void for_each(DefinitionKind kind, F &&f) const {
+    for (const Slot &slot : slots)
+      if (slot.used && slot.kind == kind)
+        f(slot.key, slot.value);
+  }
+
+  // Remove every definition of kind.
+  void erase(DefinitionKind kind) {
+    if (!counts[kind])
+      return;
+    std::pmr::vector<Slot> old(slots.size(), slots.get_allocator());
+    old.swap(slots);
+    used -= counts[kind];
+    counts[kind] = 0;
+    for (const Slot &slot : old)
+      if (slot.used && slot.kind != kind)
+        slots[find_slot(slot.kind, slot.key, slot.hash)] = slot;
+  }
+
+  // Remove everything, keeping the table for reuse.
+  void clear() {
+    for (Slot &slot : slots)
+      slot.used = false;
+    used = 0;
+    counts[DEFINITION_LINK] = counts[DEFINITION_FOOTNOTE] = 0;
+  }
+
+private:
+  struct Slot {
+    uint64_t hash = 0;
+    std::string_view key;
+    std::string_view value;
+    DefinitionKind kind = DEFINITION_LINK;
+    bool used = false;
+  };
+
+  static char fold(char c) { return c >= 'A' && c <= 'Z' ? c + 32 : c; }
+
+  // FNV-1a over the case folded key, with the high bits mixed into the low
+  // ones that pick the slot.
+  static uint64_t hash_key(DefinitionKind kind, std::string_view key) {
+    uint64_t hash = 14695981039346656037ull ^ kind;
+    for (char c : key) {
+      hash ^= (unsigned char)fold(c);
+      hash *= 1099511628211ull;
+    }
+    return hash ^ (hash >> 29);
+  }
+
+  static bool same_key(std::string_view a, std::string_view b) {
+    if (a.size() != b.size())
+      return false;
+    for (size_t i = 0; i < a.size(); ++i)
+      if (fold(a[i]) != fold(b[i]))
+        return false;
+    return true;
+  }
+
+  // The slot holding key, or the empty one where it would go. The table is
+  // at most half full, so linear probing stays short.
+  size_t find_slot(DefinitionKind kind, std::string_view key,
+                   uint64_t hash) const {
+    size_t mask = slots.size() - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+      const Slot &slot = slots[i];
+      if (!slot.used || (slot.hash == hash && slot.kind == kind &&
+                         same_key(slot.key, key)))
+        return i;
+    }
+  }
+
+  void grow() { rehash(std::max<size_t>(16, slots.size() * 2)); }
+
+  void rehash(size_t size) {
+    std::pmr::vector<Slot> old(size, slots.get_allocator());
+    old.swap(slots);
+    for (const Slot &slot : old)
+      if (slot.used)
+        slots[find_slot(slot.kind, slot.key, slot.hash)] = slot;
+  }
+
+  std::pmr::vector<Slot> slots; // A power of two in size
+  size_t used = 0;
+  size_t counts[2] = {};
+};
+
+// --- Syntax tree ---
+//
+// parse_markdown() turns a document into a flat array of nodes linked by
+// index, and a renderer then walks that array. Nodes do not own any text:
+// they refer back into the source through offset/length spans, so the source
+// must outlive the tree. Being one contiguous vector, a tree costs a single
+// allocation however many nodes it holds and can be cleared and reused, or
+// placed in an Arena or other memory resource along with the parser's scratch
+// data.
+
+enum NodeType : unsigned char {
+  NODE_DOCUMENT,
+  NODE_HEADING, // level: 1 to 3, offset: the start of its line
+  NODE_PARAGRAPH,
+  NODE_UNORDERED_LIST,
+  NODE_ORDERED_LIST,
+  NODE_LIST_ITEM,
+  NODE_FOOTNOTES,     // The footnote section, last child of the document
+  NODE_FOOTNOTE_DEF,  // span: the number
+  NODE_TEXT,          // span: the text
+  NODE_STRONG,
+  NODE_EMPHASIS,
+  NODE_LINK,          // url: the target
+  NODE_IMAGE,         // span: the alt text, url: the source
+  NODE_FOOTNOTE_REF,  // span: the number
+  NODE_CUSTOM,        // offset: index into MarkdownAst::replacements
+  NODE_ESCAPED_TEXT,  // span: a line past the limits, taken as plain text
+  NODE_LINK_REF,      // url: the label, resolved through the definitions
+  NODE_CODE_BLOCK,    // url: the info string, children: a NODE_TEXT per line
+  NODE_BLOCKQUOTE,
+  NODE_TABLE,         // children: the header row, then the body rows
+  NODE_TABLE_ROW,     // level: 1 for the header row
+  NODE_TABLE_CELL,    // level: a TableAlign, plus CELL_HEADER in the header
+};
+
+// The alignment of a table's column, the level of each of its cells.
+enum TableAlign : unsigned char {
+  ALIGN_NONE,
+  ALIGN_LEFT,
+  ALIGN_CENTER,
+  ALIGN_RIGHT,
+  CELL_HEADER = 4,
+};
+
+// The level of a code block or table that a MarkdownStream writes out in
+// pieces, so that a long one is never held whole.
+enum BlockPiece : unsigned char {
+  PIECE_CONTINUED = 1,  // Its start went out with an earlier piece
+  PIECE_UNFINISHED = 2, // More pieces follow, so its end is left off
+};
+
+struct AstNode {
+  NodeType type = NODE_TEXT;
+  unsigned char level = 0;
+  // Child and sibling links. Node 0 is the document, which is never a child,
+  // so 0 also means "none".
+  uint32_t first_child = 0;
+  uint32_t last_child = 0;
+  uint32_t next_sibling = 0;
+  uint32_t length = 0;
+  uint32_t url_length = 0;
+  size_t offset = 0;
+  size_t url_offset = 0;
+};
+
+struct MarkdownAst {
+  MarkdownAst() = default;
+  explicit MarkdownAst(std::pmr::memory_resource *memory)
+      : nodes(memory), definitions(memory) {}
+
+  std::string_view source;
+  std::pmr::vector<AstNode> nodes;       // nodes[0] is the document
+  std::vector<std::string> replacements; // Output of custom inline rules
+  DefinitionIndex definitions;           // Link and footnote definitions
+
+  // Empty the tree, keeping its storage, and start on a new source.
+  void reset(std::string_view new_source) {
+    source = new_source;
+    nodes.clear();
+    replacements.clear();
+    definitions.clear();
+    nodes.push_back({.type = NODE_DOCUMENT});
+  }
+
+  // Append a node as the last child of parent and return its index.
+  uint32_t add(uint32_t parent, const AstNode &node) {
+    auto index = (uint32_t)nodes.size();
+    nodes.push_back(node);
+    AstNode &p = nodes[parent];
+    if (p.last_child)
+      nodes[p.last_child].next_sibling = index;
+    else
+      p.first_child = index;
+    p.last_child = index;
+    return index;
+  }
+
+  // The offset of a view into source.
+  size_t offset_of(std::string_view part) const {
+    return (size_t)(part.data() - source.data());
+  }
+
+  std::string_view text(const AstNode &node) const {
+    return source.substr(node.offset, node.length);
+  }
+  std::string_view url(const AstNode &node) const {
+    return source.substr(node.url_offset, node.url_length);
+  }
+};
+
+// Single pass inline scanner.
+//
+// The text is read once, left to right, and split into tokens: plain text
+// spans, runs of '*', footnote references, images, links and reference links
+// [text][label]. Emphasis is then resolved over the list of star runs (the
+// delimiter stack) and the tokens are written out. The rules are the same as
+// the regex pipeline below:
+//   - [^N] footnote references take precedence over everything else,
+//   - images ![alt](url) are matched before links [text](url), and of a link
+//     and a reference link starting at the same '[', the one ending first
+//     wins,
+//   - brackets never span a line, and link text may hold images, footnote
+//     references and emphasis but no further links,
+//   - **bold** pairs two adjacent star runs, then *italic* pairs whatever stars
+//     are left, so emphasis may span lines just like the regex version.
+//     Unlike the regex version, emphasis never straddles a link boundary.
+// Image alt text and URLs are copied verbatim rather than being re-scanned
+// for emphasis. Custom rules from the InlineRuleTable are tried first, at
+// each occurrence of their trigger character. A BasicScanner<F> only stops at
+// the characters of the syntax in F and of the custom rules.
+namespace InlineScanner {
+
+  constexpr size_t npos = std::string_view::npos;
+
+  struct Token {
+    enum Kind : unsigned char {
+      TEXT,
+      STARS,
+      FOOTNOTE_REF,
+      IMAGE,
+      LINK_OPEN,
+      LINK_CLOSE,
+      CUSTOM,
+    };
+    Kind kind;
+    // STARS only, filled in by resolve_emphasis().
+    bool close_strong = false;
+    bool close_em = false;
+    bool open_em = false;
+    bool open_strong = false;
+    // LINK_OPEN and LINK_CLOSE only: of a [text][label] reference link.
+    bool reference = false;
+    // TEXT, STARS and FOOTNOTE_REF (the digits): source span. IMAGE: alt text.
+    // LINK_OPEN: the '['. LINK_CLOSE: the "](url)" or "][label]".
+    // CUSTOM: index of the replacement in Scanner::replacements.
+    size_t begin = 0;
+    size_t length = 0;
+    // IMAGE and LINK_OPEN: the URL, or a reference link's label.
+    size_t url_begin = 0;
+    size_t url_length = 0;
+  };
+
+  // Location of a matched [..](..), ![..](..) or [..][..] construct.
+  struct BracketMatch {
+    size_t close = 0; // The ']' that ends the text
+    size_t url_begin = 0;
+    size_t url_end = 0; // The ')' that ends the URL, or ']' the label
+    bool reference = false;
+  };
+
+  // The last search for a link or a reference link, which started at the
+  // '[' at from. Any later '[' before until, one short of the ']' it found
+  // or the end of the line if there was none, finds that same ']', so the
+  // search is reused for it, whether it matched or not.
+  struct LinkScan {
+    size_t from = npos;
+    size_t until = 0;
+    bool found = false;
+    BracketMatch match;
+
+    bool covers(size_t pos) const { return pos >= from && pos < until; }
+  };
+
+  inline const SimdScan::ByteSet &line_ends() {
+    static const SimdScan::ByteSet set("\n\r");
+    return set;
+  }
+
+  template <unsigned F> class BasicScanner {
+  public:
+    explicit BasicScanner(
+        const InlineRuleTable &table = default_inline_rules(),
+        std::pmr::memory_resource *memory = std::pmr::get_default_resource(),
+        const ConvertLimits &limits = {})
+        : tokens(memory), rules(&table), limits(limits) {
+      if constexpr (F != Features::All) {
+        for (int c = 0; c < 256; ++c)
+          if (table.has_custom((char)c))
+            special.add((char)c);
+        if (enabled(Features::Emphasis))
+          special.add('*');
+        if (enabled(Features::Links) || enabled(Features::Footnotes))
+          special.add('[');
+        if (enabled(Features::Images))
+          special.add('!');
       }
-      if (inOrderedList) {
-        processedContent += "</ol>\n";
-        inOrderedList = false;
+    }
+
+    // Convert text and append the HTML to out. The token buffers are kept, so
+    // a scanner reused for many short texts stops allocating.
+    void process(std::string_view text, std::string &out) {
+      reset(text);
+      tokenize(0, text.size(), true);
+      resolve_emphasis();
+      render(out);
+    }
+
+    // Parse text, a view into ast.source, into inline nodes under parent.
+    void parse(std::string_view text, MarkdownAst &ast, uint32_t parent) {
+      reset(text);
+      tokenize(0, text.size(), true);
+      resolve_emphasis();
+      build(ast, parent);
+    }
+
+    // Parse only what an index reads: footnote references, images and links
+    // with all of their text. The text and emphasis around them are left
+    // out of the tree.
+    void parse_references(std::string_view text, MarkdownAst &ast,
+                          uint32_t parent) {
+      reset(text);
+      references_only = true;
+      tokenize(0, text.size(), true);
+      references_only = false;
+      resolve_emphasis();
+      build(ast, parent);
+    }
+
+    void reset(std::string_view text) {
+      src = text;
+      tokens.clear();
+      replacements.clear();
+      eol_from = npos;
+      image_fail_from = npos;
+      paren_from = npos;
+      link_scan.from = npos;
+      reference_scan.from = npos;
+    }
+
+    // Split src[begin, end) into tokens. allow_links is false inside link
+    // text, which never holds a nested link.
+    void tokenize(size_t begin, size_t end, bool allow_links) {
+      size_t pos = begin;
+      size_t text_start = begin;
+      bool outside = references_only && allow_links; // Of any link text
+      auto flush_text = [&](size_t from, size_t to) {
+        if (!outside)
+          this->flush_text(from, to);
+      };
+      while (pos < end) {
+        // Plain text is skipped a vector at a time
+        pos = find_special(pos, end);
+        if (pos == npos)
+          break;
+        char c = src[pos];
+        if (!limits.linear && rules->has_custom(c)) {
+          size_t match_end = match_custom(pos, end);
+          if (match_end != npos) {
+            flush_text(text_start, pos);
+            tokens.push_back({.kind = Token::CUSTOM,
+                              .begin = replacements.size() - 1});
+            pos = text_start = match_end;
+            continue;
+          }
+        }
+        if (enabled(Features::Emphasis) && c == '*' && outside) {
+          ++pos;
+          continue;
+        }
+        if (enabled(Features::Emphasis) && c == '*') {
+          size_t run_end = pos;
+          while (run_end < end && src[run_end] == '*')
+            ++run_end;
+          flush_text(text_start, pos);
+          tokens.push_back({.kind = Token::STARS,
+                            .begin = pos,
+                            .length = run_end - pos});
+          pos = text_start = run_end;
+          continue;
+        }
+        if (c == '[') {
+          size_t fn_end = enabled(Features::Footnotes)
+                              ? match_footnote_ref(pos, end)
+                              : npos;
+          if (fn_end != npos) {
+            flush_text(text_start, pos);
+            tokens.push_back({.kind = Token::FOOTNOTE_REF,
+                              .begin = pos + 2,
+                              .length = fn_end - pos - 3});
+            pos = text_start = fn_end;
+            continue;
+          }
+          BracketMatch link;
+          if (enabled(Features::Links) && allow_links &&
+              match_any_link(pos, link)) {
+            flush_text(text_start, pos);
+            tokens.push_back({.kind = Token::LINK_OPEN,
+                              .reference = link.reference,
+                              .begin = pos,
+                              .length = 1,
+                              .url_begin = link.url_begin,
+                              .url_length = link.url_end - link.url_begin});
+            tokenize(pos + 1, link.close, false);
+            tokens.push_back({.kind = Token::LINK_CLOSE,
+                              .reference = link.reference,
+                              .begin = link.close,
+                              .length = link.url_end + 1 - link.close});
+            pos = text_start = link.url_end + 1;
+            continue;
+          }
+          ++pos;
+          continue;
+        }
+        if (!enabled(Features::Images) || c != '!') {
+          ++pos;
+          continue;
+        }
+        BracketMatch image;
+        if (pos + 1 < end && src[pos + 1] == '[' && match_image(pos, image)) {
+          flush_text(text_start, pos);
+          tokens.push_back({.kind = Token::IMAGE,
+                            .begin = pos + 2,
+                            .length = image.close - pos - 2,
+                            .url_begin = image.url_begin,
+                            .url_length = image.url_end - image.url_begin});
+          pos = text_start = image.url_end + 1;
+          continue;
+        }
+        ++pos;
       }
-      if (line.rfind("# ", 0) == 0)
-        processedContent += "<h1>" + line.substr(2) + "</h1>\n";
-      else if (line.rfind("## ", 0) == 0)
-        processedContent += "<h2>" + line.substr(3) + "</h2>\n";
-      else if (line.rfind("### ", 0) == 0)
-        processedContent += "<h3>" + line.substr(4) + "</h3>\n";
+      flush_text(text_start, end);
     }
-    // --- Ordered List Conversion ---
-    else if (std::regex_match(line, ordered_list_item_regex)) {
-      std::smatch ol_matches;
-      std::regex_match(line, ol_matches, ordered_list_item_regex);
 
-      if (inUnorderedList) {
-        processedContent += "</ul>\n";
-        inUnorderedList = false;
+    // Pair up the star runs. Bold first: the last two stars of a run open and
+    // the first two stars of the very next run close, as the text between two
+    // runs never holds a '*'. Italic then does the same with single stars over
+    // the runs that still have stars left. Link text is paired on its own, so
+    // emphasis always nests inside or around a link.
+    void resolve_emphasis() {
+      if constexpr (!enabled(Features::Emphasis))
+        return;
+      Token *open = nullptr;
+      Token *outer_open = nullptr;
+      for (auto &tok : tokens) {
+        if (tok.kind == Token::LINK_OPEN || tok.kind == Token::LINK_CLOSE) {
+          std::swap(open, outer_open);
+          if (tok.kind == Token::LINK_OPEN)
+            open = nullptr;
+          continue;
+        }
+        if (tok.kind != Token::STARS)
+          continue;
+        size_t left = tok.length;
+        if (open && left >= 2) {
+          open->open_strong = true;
+          tok.close_strong = true;
+          left -= 2;
+        }
+        open = left >= 2 ? &tok : nullptr;
       }
-      if (!inOrderedList) {
-        processedContent += "<ol>\n";
-        inOrderedList = true;
+      open = outer_open = nullptr;
+      for (auto &tok : tokens) {
+        if (tok.kind == Token::LINK_OPEN || tok.kind == Token::LINK_CLOSE) {
+          std::swap(open, outer_open);
+          if (tok.kind == Token::LINK_OPEN)
+            open = nullptr;
+          continue;
+        }
+        if (tok.kind != Token::STARS)
+          continue;
+        size_t left = stars_left(tok);
+        if (left == 0)
+          continue;
+        if (open) {
+          open->open_em = true;
+          tok.close_em = true;
+          left -= 1;
+        }
+        open = left >= 1 ? &tok : nullptr;
       }
-      processedContent += "<li>" + ol_matches[2].str() + "</li>\n";
     }
-    // --- Unordered List Conversion ---
-    else if (line.rfind("* ", 0) == 0 || line.rfind("- ", 0) == 0 ||
-             line.rfind("+ ", 0) == 0) {
-      if (inOrderedList) {
-        processedContent += "</ol>\n";
-        inOrderedList = false;
+
+    // Add the tokens to the tree as children of parent. src must be a view
+    // into ast.source.
+    void build(MarkdownAst &ast, uint32_t parent) const {
+      size_t base = ast.offset_of(src);
+      size_t first_replacement = ast.replacements.size();
+      for (auto &replacement : replacements)
+        ast.replacements.push_back(replacement);
+      // Open STRONG, EMPHASIS and LINK nodes; parent is at the bottom
+      uint32_t stack[8] = {parent};
+      size_t depth = 1;
+      auto add = [&](AstNode node) {
+        return ast.add(stack[depth - 1], node);
+      };
+      auto text = [&](size_t begin, size_t length) {
+        if (length)
+          add({.type = NODE_TEXT,
+               .length = (uint32_t)length,
+               .offset = base + begin});
+      };
+      // Markup opened past max_nesting is kept as text, and so is its
+      // closing half. Each type is open at most once, so a flag is enough.
+      bool literal_em = false, literal_strong = false, literal_link = false;
+      auto too_deep = [&] {
+        return limits.max_nesting && depth > limits.max_nesting;
+      };
+      auto open = [&](NodeType type, bool &literal, size_t begin,
+                      size_t length) {
+        literal = too_deep();
+        if (literal)
+          text(begin, length);
+        else
+          stack[depth++] = add({.type = type});
+      };
+      auto close = [&](NodeType type, bool &literal, size_t begin,
+                       size_t length) {
+        if (literal)
+          text(begin, length);
+        else if (depth > 1 && ast.nodes[stack[depth - 1]].type == type)
+          --depth;
+        literal = false;
+      };
+      for (const auto &tok : tokens) {
+        switch (tok.kind) {
+        case Token::TEXT:
+          text(tok.begin, tok.length);
+          break;
+        case Token::STARS: {
+          size_t at = tok.begin;
+          if (tok.close_strong)
+            close(NODE_STRONG, literal_strong, at, 2);
+          at += 2 * tok.close_strong;
+          if (tok.close_em)
+            close(NODE_EMPHASIS, literal_em, at, 1);
+          at += tok.close_em;
+          size_t plain = stars_left(tok) - tok.close_em - tok.open_em;
+          text(at, plain);
+          at += plain;
+          // Emphasis nests at most link > em > strong deep
+          if (tok.open_em)
+            open(NODE_EMPHASIS, literal_em, at, 1);
+          at += tok.open_em;
+          if (tok.open_strong)
+            open(NODE_STRONG, literal_strong, at, 2);
+          break;
+        }
+        case Token::FOOTNOTE_REF:
+          add({.type = NODE_FOOTNOTE_REF,
+               .length = (uint32_t)tok.length,
+               .offset = base + tok.begin});
+          break;
+        case Token::IMAGE:
+          add({.type = NODE_IMAGE,
+               .length = (uint32_t)tok.length,
+               .url_length = (uint32_t)tok.url_length,
+               .offset = base + tok.begin,
+               .url_offset = base + tok.url_begin});
+          break;
+        case Token::LINK_OPEN:
+          literal_link = too_deep();
+          if (literal_link)
+            text(tok.begin, tok.length);
+          else
+            stack[depth++] =
+                add({.type = tok.reference ? NODE_LINK_REF : NODE_LINK,
+                     .url_length = (uint32_t)tok.url_length,
+                     .url_offset = base + tok.url_begin});
+          break;
+        case Token::LINK_CLOSE:
+          if (literal_link) {
+            text(tok.begin, tok.length);
+            literal_link = false;
+            break;
+          }
+          while (depth > 1 && ast.nodes[stack[depth - 1]].type != NODE_LINK &&
+                 ast.nodes[stack[depth - 1]].type != NODE_LINK_REF)
+            --depth;
+          if (depth > 1)
+            --depth;
+          break;
+        case Token::CUSTOM:
+          add({.type = NODE_CUSTOM, .offset = first_replacement + tok.begin});
+          break;
+        }
       }
-      if (!inUnorderedList) {
-        processedContent += "<ul>\n";
-        inUnorderedList = true;
+    }
+
+    void render(std::string &out) const {
+      for (const auto &tok : tokens) {
+        switch (tok.kind) {
+        case Token::TEXT:
+          append_escaped(out, src.substr(tok.begin, tok.length), ESCAPE_TEXT);
+          break;
+        case Token::STARS: {
+          size_t literal = stars_left(tok) - tok.close_em - tok.open_em;
+          if (tok.close_strong)
+            out += "</strong>";
+          if (tok.close_em)
+            out += "</em>";
+          out.append(literal, '*');
+          if (tok.open_em)
+            out += "<em>";
+          if (tok.open_strong)
+            out += "<strong>";
+          break;
+        }
+        case Token::FOOTNOTE_REF: {
+          auto num = src.substr(tok.begin, tok.length);
+          out += "<sup><a href=\"#fn";
+          out += num;
+          out += "\" id=\"fnref";
+          out += num;
+          out += "\">";
+          out += num;
+          out += "</a></sup>";
+          break;
+        }
+        case Token::IMAGE:
+          out += "<img src=\"";
+          append_escaped(out, src.substr(tok.url_begin, tok.url_length),
+                         ESCAPE_ATTRIBUTE);
+          out += "\" alt=\"";
+          append_escaped(out, src.substr(tok.begin, tok.length),
+                         ESCAPE_ATTRIBUTE);
+          out += "\">";
+          break;
+        case Token::LINK_OPEN:
+          // Without a tree there are no definitions to resolve a reference
+          if (tok.reference) {
+            out += '[';
+            break;
+          }
+          out += "<a href=\"";
+          append_escaped(out, src.substr(tok.url_begin, tok.url_length),
+                         ESCAPE_ATTRIBUTE);
+          out += "\">";
+          break;
+        case Token::LINK_CLOSE:
+          if (tok.reference)
+            append_escaped(out, src.substr(tok.begin, tok.length), ESCAPE_TEXT);
+          else
+            out += "</a>";
+          break;
+        case Token::CUSTOM:
+          out += replacements[tok.begin];
+          break;
+        }
       }
-      processedContent += "<li>" + line.substr(2) + "</li>\n";
     }
-    // --- General Content ---
-    else {
-      if (inUnorderedList) {
-        processedContent += "</ul>\n";
-        inUnorderedList = false;
+
+    std::pmr::vector<Token> tokens;
+    std::vector<std::string> replacements;
+
+  private:
+    static constexpr bool enabled(unsigned feature) {
+      return Features::enabled(F, feature);
+    }
+
+    size_t find_special(size_t pos, size_t end) const {
+      if constexpr (F == Features::All)
+        return rules->find_special(src, pos, end);
+      else
+        return special.find(src, pos, end);
+    }
+
+    static size_t stars_left(const Token &tok) {
+      return tok.length - 2 * tok.close_strong - 2 * tok.open_strong;
+    }
+
+    void flush_text(size_t begin, size_t end) {
+      if (end > begin)
+        tokens.push_back(
+            {.kind = Token::TEXT, .begin = begin, .length = end - begin});
+    }
+
+    // Try the custom rules for src[pos]; returns the end of the match and
+    // stores the replacement, or npos.
+    size_t match_custom(size_t pos, size_t end) {
+      auto flags = std::regex_constants::match_continuous;
+      if (pos > 0)
+        flags |= std::regex_constants::match_prev_avail;
+      std::cmatch match;
+      for (const auto &rule : rules->custom_rules()) {
+        if (rule.trigger != src[pos])
+          continue;
+        if (std::regex_search(src.data() + pos, src.data() + end, match,
+                              rule.pattern, flags) &&
+            match.length() > 0) {
+          replacements.push_back(rule.replacement_formatter(match));
+          return pos + match.length();
+        }
       }
-      if (inOrderedList) {
-        processedContent += "</ol>\n";
-        inOrderedList = false;
+      return npos;
+    }
+
+    size_t line_end(size_t pos) {
+      if (pos < eol_from || pos > eol) {
+        eol_from = pos;
+        eol = line_ends().find(src, pos);
+        if (eol == npos)
+          eol = src.size();
       }
-      processedContent += line + "\n";
+      return eol;
     }
-  }
-  if (inUnorderedList) {
-    processedContent += "</ul>\n";
-  }
-  if (inOrderedList) {
-    processedContent += "</ol>\n";
-  }
 
-  std::string htmlContent = processedContent;
+    // [^N] starting at pos; returns one past the ']' or npos.
+    size_t match_footnote_ref(size_t pos, size_t end) const {
+      if (pos + 3 >= end || src[pos + 1] != '^')
+        return npos;
+      size_t i = pos + 2;
+      while (i < end && src[i] >= '0' && src[i] <= '9')
+        ++i;
+      if (i == pos + 2 || i >= end || src[i] != ']')
+        return npos;
+      return i + 1;
+    }
 
-  // --- Apply Inline Markdown to the main content ---
-  htmlContent = process_inline_markdown(htmlContent);
+    // True if the ']' at pos ends a [^N] footnote reference. Those are
+    // replaced before images and links are looked for, so their ']' never
+    // closes anything else.
+    bool closes_footnote(size_t pos) const {
+      size_t i = pos;
+      while (i > 0 && src[i - 1] >= '0' && src[i - 1] <= '9')
+        --i;
+      return i != pos && i >= 2 && src[i - 1] == '^' && src[i - 2] == '[';
+    }
 
-  // --- Paragraph wrapping ---
-  std::istringstream paragraphIss(htmlContent);
-  std::string finalHtmlMainContent = "";
-  std::string currentLine;
-  while (std::getline(paragraphIss, currentLine)) {
-    if (currentLine.empty())
-      continue;
-    if (currentLine.rfind("<h1>", 0) != 0 &&
-        currentLine.rfind("<h2>", 0) != 0 &&
-        currentLine.rfind("<h3>", 0) != 0 &&
-        currentLine.rfind("<ul>", 0) != 0 &&
-        currentLine.rfind("</ul>", 0) != 0 &&
-        currentLine.rfind("<li>", 0) != 0 &&
-        currentLine.rfind("<ol>", 0) != 0) {
-      finalHtmlMainContent += "<p>" + currentLine + "</p>\n";
-    } else {
-      finalHtmlMainContent += currentLine + "\n";
+    // First ']' followed by after at or after min_close, searching from
+    // 'from' up to the end of the line. Link text treats complete images as
+    // opaque.
+    size_t find_close(size_t from, size_t min_close, size_t eol_pos,
+                      bool skip_images, char after = '(') {
+      static const SimdScan::ByteSet stops("]!");
+      for (size_t k = from; k + 1 < eol_pos; ++k) {
+        k = stops.find(src, k, eol_pos - 1);
+        if (k == npos)
+          break;
+        char c = src[k];
+        if (c == ']') {
+          if (src[k + 1] == after && k >= min_close &&
+              !(enabled(Features::Footnotes) && closes_footnote(k)))
+            return k;
+        } else if (enabled(Features::Images) && skip_images && c == '!' &&
+                   src[k + 1] == '[') {
+          BracketMatch image;
+          if (match_image(k, image))
+            k = image.url_end;
+        }
+      }
+      return npos;
     }
-  }
 
-  // --- Append Footnotes Section ---
-  if (!footnotes.empty()) {
-    finalHtmlMainContent += "<div class=\"footnotes\">\n";
-    finalHtmlMainContent += "<hr>\n";
-    finalHtmlMainContent += "<ol>\n";
-    for (const auto &pair : footnotes) {
-      std::string fn_num = pair.first;
-      std::string fn_content = pair.second;
-      std::string processed_fn_content = process_inline_markdown(fn_content);
-      finalHtmlMainContent +=
-          "<li id=\"fn" + fn_num + "\">" + processed_fn_content +
-          " <a href=\"#fnref" + fn_num +
-          "\" class=\"footnote-backref\">&#8617;</a></li>\n";
+    // First ')' at or after from on the line, or npos. The last answer holds
+    // for every search starting between where it started and the ')', so
+    // many links sharing one far ')' look for it once.
+    size_t find_paren(size_t from, size_t eol_pos) {
+      if (from < paren_from || from > paren_at) {
+        paren_from = from;
+        paren_at = std::min(src.substr(0, eol_pos).find(')', from), eol_pos);
+      }
+      return paren_at < eol_pos ? paren_at : npos;
     }
-    finalHtmlMainContent += "</ol>\n";
-    finalHtmlMainContent += "</div>\n";
+
+    // The "(url)" after the ']' at close: at least one character, up to the
+    // first ')' on the line.
+    bool match_url(size_t close, size_t eol_pos, BracketMatch &m) {
+      size_t url = close + 2;
+      if (url >= eol_pos)
+        return false;
+      size_t k = find_paren(url + 1, eol_pos);
+      if (k == npos)
+        return false;
+      m.close = close;
+      m.url_begin = url;
+      m.url_end = k;
+      return true;
+    }
+
+    // ![alt](url) at pos. A failed attempt also rules out every later image
+    // on the same line, which keeps runs of '![' linear.
+    bool match_image(size_t pos, BracketMatch &m) {
+      if (pos >= image_fail_from && pos < image_fail_eol)
+        return false;
+      if (enabled(Features::Footnotes) &&
+          match_footnote_ref(pos + 1, src.size()) != npos)
+        return false;
+      size_t eol_pos = line_end(pos);
+      size_t close = find_close(pos + 2, pos + 2, eol_pos, false);
+      if (close != npos && match_url(close, eol_pos, m))
+        return true;
+      image_fail_from = pos;
+      image_fail_eol = eol_pos;
+      return false;
+    }
+
+    // [text](url) at pos, with at least one character of text.
+    bool match_link(size_t pos, BracketMatch &m) {
+      if (!link_scan.covers(pos)) {
+        size_t eol_pos = line_end(pos);
+        size_t close = find_close(pos + 1, pos + 2, eol_pos, true);
+        link_scan.found =
+            close != npos && match_url(close, eol_pos, link_scan.match);
+        link_scan.from = pos;
+        link_scan.until = link_scan.found ? close - 1 : eol_pos;
+      }
+      m = link_scan.match;
+      return link_scan.found;
+    }
+
+    // [text][label] at pos, with at least one character of each and no
+    // bracket in the label.
+    bool match_reference(size_t pos, BracketMatch &m) {
+      if (!reference_scan.covers(pos)) {
+        size_t eol_pos = line_end(pos);
+        size_t close = find_close(pos + 1, pos + 2, eol_pos, true, '[');
+        reference_scan.found = false;
+        if (close != npos) {
+          size_t label = close + 2;
+          size_t end = src.substr(0, eol_pos).find_first_of("[]", label);
+          if (end != npos && src[end] == ']' && end > label) {
+            reference_scan.match = {.close = close, .url_begin = label,
+                                    .url_end = end, .reference = true};
+            reference_scan.found = true;
+          }
+        }
+        reference_scan.from = pos;
+        reference_scan.until = close == npos ? eol_pos : close - 1;
+      }
+      m = reference_scan.match;
+      return reference_scan.found;
+    }
+
+    // A link or a reference link at pos, whichever ends first.
+    bool match_any_link(size_t pos, BracketMatch &m) {
+      BracketMatch reference;
+      bool is_link = match_link(pos, m);
+      if (!match_reference(pos, reference) ||
+          (is_link && m.close < reference.close))
+        return is_link;
+      m = reference;
+      return true;
+    }
+
+    const InlineRuleTable *rules;
+    ConvertLimits limits;
+    bool references_only = false; // In parse_references()
+    SimdScan::ByteSet special; // Unless F is All, where the rules' set is
+    std::string_view src;
+    size_t eol_from = npos;
+    size_t eol = 0;
+    size_t image_fail_from = npos;
+    size_t image_fail_eol = 0;
+    size_t paren_from = npos;
+    size_t paren_at = 0;
+    LinkScan link_scan;
+    LinkScan reference_scan;
+  };
+
+  using Scanner = BasicScanner<Features::All>;
+
+  inline std::string process(std::string_view text,
+                             const InlineRuleTable &rules) {
+    Scanner scanner(rules);
+    scanner.tokens.reserve(text.size() / 16 + 1);
+    std::string out;
+    out.reserve(text.size() + text.size() / 8);
+    scanner.process(text, out);
+    return out;
   }
 
-  return finalHtmlMainContent;
+} // namespace InlineScanner
+
+// Apply one rule over the whole text, as a single regex pass.
+inline void apply_inline_rule(const InlineRule &rule, std::string &text,
+                              ConvertStats *stats = nullptr) {
+  std::string current_text = "";
+  auto words_begin = std::cregex_iterator(
+      text.data(), text.data() + text.size(), rule.pattern);
+  auto words_end = std::cregex_iterator();
+
+  size_t last_pos = 0;
+  size_t matches = 0;
+  for (std::cregex_iterator i = words_begin; i != words_end; ++i, ++matches) {
+    const std::cmatch &match = *i;
+    current_text.append(text, last_pos, match.position() - last_pos);
+    current_text +=
+        rule.replacement_formatter(match); // Use the formatter lambda
+    last_pos = match.position() + match.length();
+  }
+  if (stats && matches)
+    stats->rule_matches[rule.name] += matches;
+  current_text.append(text, last_pos); // Add remaining text
+  text = std::move(current_text);      // Update text for the next rule
+}
+
+// Helper function to process inline Markdown (images, links, bold, italic,
+// inline footnotes) with the original regex pipeline.
+inline std::string process_inline_markdown_regex(
+    std::string text, const InlineRuleTable &rules = default_inline_rules(),
+    ConvertStats *stats = nullptr) {
+  // Apply each rule sequentially
+  for (const auto &rule : rules.custom_rules())
+    apply_inline_rule(rule, text, stats);
+  for (const auto &rule : rules.builtin_rules())
+    apply_inline_rule(rule, text, stats);
+  return text;
+}
+
+// Helper function to process inline Markdown (images, links, bold, italic,
+// inline footnotes)
+inline std::string
+process_inline_markdown(std::string text, InlineEngine engine = INLINE_SCANNER,
+                        const InlineRuleTable &rules = default_inline_rules()) {
+  if (engine == INLINE_REGEX)
+    return process_inline_markdown_regex(std::move(text), rules);
+  return InlineScanner::process(text, rules);
+}
+
+// Block level patterns. These are fixed, so rather than compiling a regex on
+// every conversion they are matched by hand; each function documents the
+// regex it stands for and is checked at compile time below.
+
+// Matches a line against ^\[\^(\d+)\]:\s*(.*)$ and stores the two groups.
+struct FootnoteDefinition {
+  std::string_view number;
+  std::string_view content;
+};
+
+constexpr bool is_regex_space(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' ||
+         c == '\r';
+}
+
+constexpr bool is_digit(char c) { return c >= '0' && c <= '9'; }
+
+constexpr bool match_footnote_definition(std::string_view line,
+                                         FootnoteDefinition &out) {
+  if (line.size() < 5 || line[0] != '[' || line[1] != '^')
+    return false;
+  size_t i = 2;
+  while (i < line.size() && is_digit(line[i]))
+    ++i;
+  if (i == 2 || i + 1 >= line.size() || line[i] != ']' || line[i + 1] != ':')
+    return false;
+  size_t number_end = i;
+  i += 2;
+  while (i < line.size() && is_regex_space(line[i]))
+    ++i;
+  // '.' does not match a line terminator
+  for (size_t k = i; k < line.size(); ++k)
+    if (line[k] == '\n' || line[k] == '\r')
+      return false;
+  out.number = line.substr(2, number_end - 2);
+  out.content = line.substr(i);
+  return true;
 }
+
+// Matches a line against ^\[([^\]\[^][^\]\[]*)\]:[ \t]*(\S+) and stores
+// the label and the URL. Whatever follows the URL, such as a title, is
+// ignored.
+struct LinkDefinition {
+  std::string_view label;
+  std::string_view url;
+};
+
+constexpr bool match_link_definition(std::string_view line,
+                                     LinkDefinition &out) {
+  if (line.size() < 5 || line[0] != '[' || line[1] == '^' || line[1] == ']')
+    return false;
+  size_t close = line.find_first_of("[]", 1);
+  if (close == std::string_view::npos || line[close] != ']' ||
+      close + 1 >= line.size() || line[close + 1] != ':')
+    return false;
+  size_t i = close + 2;
+  while (i < line.size() && (line[i] == ' ' || line[i] == '\t'))
+    ++i;
+  size_t end = i;
+  while (end < line.size() && !is_regex_space(line[end]))
+    ++end;
+  if (end == i)
+    return false;
+  out.label = line.substr(1, close - 1);
+  out.url = line.substr(i, end - i);
+  return true;
+}
+
+// Matches a line against ^(\d+)\.\s(.+)$ and stores the item text.
+constexpr bool match_ordered_list_item(std::string_view line,
+                                       std::string_view &item) {
+  size_t i = 0;
+  while (i < line.size() && is_digit(line[i]))
+    ++i;
+  if (i == 0 || i + 2 >= line.size() || line[i] != '.' ||
+      !is_regex_space(line[i + 1]))
+    return false;
+  for (size_t k = i + 2; k < line.size(); ++k)
+    if (line[k] == '\n' || line[k] == '\r')
+      return false;
+  item = line.substr(i + 2);
+  return true;
+}
+
+// Matches the opening fence of a code block, ^(`{3,}|~{3,})\s*(.*)$ where
+// after backticks the info string may not hold a '`', and stores the fence
+// and the info string with the spaces around it trimmed.
+struct CodeFence {
+  char marker = 0;
+  size_t length = 0; // 0 for no fence
+  std::string_view info;
+};
+
+constexpr bool match_code_fence(std::string_view line, CodeFence &out) {
+  if (line.empty() || (line[0] != '`' && line[0] != '~'))
+    return false;
+  size_t length = std::min(line.find_first_not_of(line[0]), line.size());
+  if (length < 3)
+    return false;
+  size_t i = length;
+  while (i < line.size() && is_regex_space(line[i]))
+    ++i;
+  size_t end = line.size();
+  while (end > i && is_regex_space(line[end - 1]))
+    --end;
+  std::string_view info = line.substr(i, end - i);
+  if (line[0] == '`' && info.find('`') != std::string_view::npos)
+    return false;
+  out = {line[0], length, info};
+  return true;
+}
+
+// True if line closes a code block opened by fence: a run of at least as
+// many of the same marker, then nothing but spaces.
+constexpr bool closes_code_fence(std::string_view line,
+                                 const CodeFence &fence) {
+  size_t i = 0;
+  while (i < line.size() && line[i] == fence.marker)
+    ++i;
+  if (i < fence.length)
+    return false;
+  for (; i < line.size(); ++i)
+    if (!is_regex_space(line[i]))
+      return false;
+  return true;
+}
+
+constexpr std::string_view trim_spaces(std::string_view text) {
+  while (!text.empty() && (text.front() == ' ' || text.front() == '\t'))
+    text.remove_prefix(1);
+  while (!text.empty() && (text.back() == ' ' || text.back() == '\t'))
+    text.remove_suffix(1);
+  return text;
+}
+
+// Calls f with each cell of a table row, trimmed, and returns how many
+// there were. The row is split on '|', less one at either end. There are no
+// backslash escapes, so a cell cannot hold a '|'.
+template <class F>
+constexpr size_t for_each_table_cell(std::string_view row, F &&f) {
+  row = trim_spaces(row);
+  if (row.starts_with('|'))
+    row.remove_prefix(1);
+  if (row.ends_with('|'))
+    row.remove_suffix(1);
+  size_t count = 0;
+  while (true) {
+    size_t bar = row.find('|');
+    f(trim_spaces(row.substr(0, bar)));
+    ++count;
+    if (bar == std::string_view::npos)
+      return count;
+    row.remove_prefix(bar + 1);
+  }
+}
+
+// The alignment a cell of a delimiter row sets for its column, from the
+// ':' on either side of its dashes, or -1 if it is not such a cell.
+constexpr int table_alignment(std::string_view cell) {
+  bool left = cell.starts_with(':');
+  bool right = cell.size() > 1 && cell.ends_with(':');
+  std::string_view dashes = cell.substr(left, cell.size() - left - right);
+  if (dashes.empty() || dashes.find_first_not_of('-') != std::string_view::npos)
+    return -1;
+  return left && right ? ALIGN_CENTER
+         : left        ? ALIGN_LEFT
+         : right       ? ALIGN_RIGHT
+                       : ALIGN_NONE;
+}
+
+// Matches the delimiter row under a table's header, such as |:--|:-:|--:|,
+// calls f with the alignment of each column and returns how many there
+// are, or 0 if line is not one. It needs a '|' even for one column.
+template <class F>
+constexpr size_t match_table_delimiter(std::string_view line, F &&f) {
+  if (line.find('|') == std::string_view::npos)
+    return 0;
+  bool valid = true;
+  size_t count = for_each_table_cell(line, [&](std::string_view cell) {
+    valid = valid && table_alignment(cell) >= 0;
+  });
+  if (!valid)
+    return 0;
+  for_each_table_cell(line, [&](std::string_view cell) {
+    f((TableAlign)table_alignment(cell));
+  });
+  return count;
+}
+
+namespace BlockPatternChecks {
+  constexpr bool footnote(std::string_view line, std::string_view number,
+                          std::string_view content) {
+    FootnoteDefinition def;
+    return match_footnote_definition(line, def) && def.number == number &&
+           def.content == content;
+  }
+  constexpr bool ordered(std::string_view line, std::string_view expected) {
+    std::string_view item;
+    return match_ordered_list_item(line, item) && item == expected;
+  }
+  constexpr bool not_footnote(std::string_view line) {
+    FootnoteDefinition def;
+    return !match_footnote_definition(line, def);
+  }
+  constexpr bool not_ordered(std::string_view line) {
+    std::string_view item;
+    return !match_ordered_list_item(line, item);
+  }
+  constexpr bool link(std::string_view line, std::string_view label,
+                      std::string_view url) {
+    LinkDefinition def;
+    return match_link_definition(line, def) && def.label == label &&
+           def.url == url;
+  }
+  constexpr bool not_link(std::string_view line) {
+    LinkDefinition def;
+    return !match_link_definition(line, def);
+  }
+  constexpr bool fence(std::string_view line, size_t length,
+                       std::string_view info) {
+    CodeFence fence;
+    return match_code_fence(line, fence) && fence.length == length &&
+           fence.info == info;
+  }
+  constexpr bool not_fence(std::string_view line) {
+    CodeFence fence;
+    return !match_code_fence(line, fence);
+  }
+  constexpr bool closes(std::string_view open, std::string_view line) {
+    CodeFence fence;
+    return match_code_fence(open, fence) && closes_code_fence(line, fence);
+  }
+  constexpr size_t cells(std::string_view row) {
+    return for_each_table_cell(row, [](std::string_view) {});
+  }
+  constexpr bool delimiter(std::string_view line, std::string_view expected) {
+    char aligns[8] = {};
+    size_t count = 0;
+    size_t columns = match_table_delimiter(line, [&](TableAlign align) {
+      if (count < 8)
+        aligns[count++] = "nlcr"[align];
+    });
+    return columns == expected.size() &&
+           std::string_view(aligns, count) == expected;
+  }
+
+  static_assert(footnote("[^1]: Note", "1", "Note"));
+  static_assert(footnote("[^12]:Note", "12", "Note"));
+  static_assert(footnote("[^3]:   ", "3", ""));
+  static_assert(not_footnote("[^]: Note"));
+  static_assert(not_footnote("[^a]: Note"));
+  static_assert(not_footnote("[^1] Note"));
+  static_assert(not_footnote("[^1]: Note\r"));
+  static_assert(ordered("1. Item", "Item"));
+  static_assert(ordered("10.\t Item", " Item"));
+  static_assert(not_ordered("1.Item"));
+  static_assert(not_ordered("1. "));
+  static_assert(not_ordered(". Item"));
+  static_assert(link("[id]: http://x/y", "id", "http://x/y"));
+  static_assert(link("[Some Label]:\t/a \"Title\"", "Some Label", "/a"));
+  static_assert(not_link("[^1]: Note"));
+  static_assert(not_link("[]: /a"));
+  static_assert(not_link("[a[b]: /a"));
+  static_assert(not_link("[id] /a"));
+  static_assert(not_link("[id]:   "));
+  static_assert(fence("```", 3, ""));
+  static_assert(fence("~~~~ c++ \r", 4, "c++"));
+  static_assert(not_fence("``"));
+  static_assert(not_fence("``` a`b"));
+  static_assert(closes("```", "````  "));
+  static_assert(!closes("````", "```"));
+  static_assert(!closes("```", "~~~"));
+  static_assert(!closes("```", "``` x"));
+  static_assert(cells("| a | b |") == 2 && cells("a|b|c") == 3);
+  static_assert(cells("|") == 1 && cells("a") == 1);
+  static_assert(delimiter("|:--|:-:|--:|---|", "lcrn"));
+  static_assert(delimiter("- | :-", "nl"));
+  static_assert(delimiter("---", ""));
+  static_assert(delimiter("|-|x|", ""));
+  static_assert(delimiter("|:|", ""));
+} // namespace BlockPatternChecks
+
+// How the block pass treats a line of Markdown.
+enum LineKind {
+  LINE_TEXT,
+  LINE_HEADING,
+  LINE_ORDERED_ITEM,
+  LINE_UNORDERED_ITEM,
+  LINE_QUOTE, // One level of it; the content may be quoted again
+  LINE_FENCE, // The opening fence of a code block
+};
+
+struct BlockLine {
+  LineKind kind = LINE_TEXT;
+  int level = 0;            // Heading level, 1 to 3, or the fence's length
+  std::string_view content; // The line without its block marker, or the
+                            // fence's info string
+};
+
+// Only the blocks in F are recognised; any other line is text.
+template <unsigned F = Features::All>
+constexpr BlockLine classify_line(std::string_view line) {
+  if constexpr (Features::enabled(F, Features::Headings)) {
+    if (line.starts_with("# "))
+      return {LINE_HEADING, 1, line.substr(2)};
+    if (line.starts_with("## "))
+      return {LINE_HEADING, 2, line.substr(3)};
+    if (line.starts_with("### "))
+      return {LINE_HEADING, 3, line.substr(4)};
+  }
+  if constexpr (Features::enabled(F, Features::Lists)) {
+    if (std::string_view item; match_ordered_list_item(line, item))
+      return {LINE_ORDERED_ITEM, 0, item};
+    if (line.starts_with("* ") || line.starts_with("- ") ||
+        line.starts_with("+ "))
+      return {LINE_UNORDERED_ITEM, 0, line.substr(2)};
+  }
+  if constexpr (Features::enabled(F, Features::Blockquotes)) {
+    if (line.starts_with('>'))
+      return {LINE_QUOTE, 0, line.substr(line.starts_with("> ") ? 2 : 1)};
+  }
+  if constexpr (Features::enabled(F, Features::CodeBlocks)) {
+    if (CodeFence fence; match_code_fence(line, fence))
+      return {LINE_FENCE, (int)fence.length, fence.info};
+  }
+  return {LINE_TEXT, 0, line};
+}
+
+// Lines of converted HTML that are not wrapped in a paragraph.
+constexpr bool is_block_html(std::string_view html) {
+  return html.starts_with("<h1>") || html.starts_with("<h2>") ||
+         html.starts_with("<h3>") || html.starts_with("<ul>") ||
+         html.starts_with("</ul>") || html.starts_with("<li>") ||
+         html.starts_with("<ol>") || html.starts_with("</ol>");
+}
+
+// Bumped whenever the HTML produced for some input changes. mdc keys its
+// output cache on it.
+constexpr int markdown_converter_version = 4;
+
+struct DocumentIndex;
+
+// Options for convert_markdown_to_html.
+struct ConvertOptions {
+  InlineEngine engine = INLINE_SCANNER;
+  // Compiled inline rules; nullptr means default_inline_rules().
+  const InlineRuleTable *rules = nullptr;
+  // Where to record phase timings and rule matches; nullptr records nothing.
+  ConvertStats *stats = nullptr;
+  // Where the tree, tokens and footnote index are allocated; nullptr means
+  // the heap. With an Arena reset between documents, and an output string
+  // kept from one document to the next, a conversion stops allocating.
+  // convert_markdown_parallel spreads a document over threads and ignores it.
+  std::pmr::memory_resource *scratch = nullptr;
+  // Bounds for untrusted input. Any of them selects the scanner engine.
+  ConvertLimits limits;
+  // Where to gather the headings, links and footnote references while
+  // converting; nullptr gathers nothing. convert_markdown_parallel ignores
+  // it.
+  DocumentIndex *index = nullptr;
+};
+
+// Bytes of HTML to reserve for a document of source_size bytes: tags add a
+// little to most text, so this is enough for typical documents without a
+// reallocation and not much more.
+constexpr size_t estimate_html_size(size_t source_size) {
+  return source_size + source_size / 4 + 256;
+}
+
+
+// Calls f for each line of text, split on '\n' like std::getline: the
+// newline is not part of the line, and a final line needs no newline.
+template <class F> void for_each_line(std::string_view text, F &&f) {
+  while (!text.empty()) {
+    size_t newline = text.find('\n');
+    if (newline == std::string_view::npos) {
+      f(text);
+      return;
+    }
+    f(text.substr(0, newline));
+    text.remove_prefix(newline + 1);
+  }
+}
+
+// The original conversion, used for INLINE_REGEX: the block pass builds HTML
+// text, the regex rules run over all of it and the paragraph pass then wraps
+// the resulting lines.
+inline std::string
+convert_markdown_to_html_regex(const std::string &markdownContent,
+                               const InlineRuleTable &rules,
+                               ConvertStats *stats = nullptr) {
+  // --- Footnote Extraction and Storage ---
+  PhaseTimer extraction(stats, "footnote extraction", markdownContent.size());
+  std::map<std::string, std::string, FootnoteNumberLess> footnotes;
+  std::string contentWithoutFootnoteDefs;
+  contentWithoutFootnoteDefs.reserve(markdownContent.size() + 1);
+
+  for_each_line(markdownContent, [&](std::string_view line) {
+    FootnoteDefinition def;
+    if (match_footnote_definition(line, def)) {
+      footnotes[std::string(def.number)] = def.content;
+    } else {
+      contentWithoutFootnoteDefs += line;
+      contentWithoutFootnoteDefs += '\n';
+    }
+  });
+
+  extraction.stop(contentWithoutFootnoteDefs.size());
+
+  // --- Heading, List, and General Content Processing ---
+  PhaseTimer block_pass(stats, "block pass", contentWithoutFootnoteDefs.size());
+  std::string processedContent;
+  processedContent.reserve(estimate_html_size(contentWithoutFootnoteDefs.size()));
+  std::istringstream iss(contentWithoutFootnoteDefs);
+  std::string line;
+
+  bool inUnorderedList = false;
+  bool inOrderedList = false;
+
+  while (std::getline(iss, line)) {
+    BlockLine block = classify_line(line);
+    // --- Close any open lists if the current line is a block element ---
+    if (block.kind == LINE_HEADING) {
+      if (inUnorderedList) {
+        processedContent += "</ul>\n";
+        inUnorderedList = false;
+      }
+      if (inOrderedList) {
+        processedContent += "</ol>\n";
+        inOrderedList = false;
+      }
+      processedContent += "<h";
+      processedContent += (char)('0' + block.level);
+      processedContent += '>';
+      processedContent += block.content;
+      processedContent += "</h";
+      processedContent += (char)('0' + block.level);
+      processedContent += ">\n";
+    }
+    // --- Ordered List Conversion ---
+    else if (block.kind == LINE_ORDERED_ITEM) {
+      if (inUnorderedList) {
+        processedContent += "</ul>\n";
+        inUnorderedList = false;
+      }
+      if (!inOrderedList) {
+        processedContent += "<ol>\n";
+        inOrderedList = true;
+      }
+      processedContent += "<li>";
+      processedContent += block.content;
+      processedContent += "</li>\n";
+    }
+    // --- Unordered List Conversion ---
+    else if (block.kind == LINE_UNORDERED_ITEM) {
+      if (inOrderedList) {
+        processedContent += "</ol>\n";
+        inOrderedList = false;
+      }
+      if (!inUnorderedList) {
+        processedContent += "<ul>\n";
+        inUnorderedList = true;
+      }
+      processedContent += "<li>";
+      processedContent += block.content;
+      processedContent += "</li>\n";
+    }
+    // --- General Content ---
+    else {
+      if (inUnorderedList) {
+        processedContent += "</ul>\n";
+        inUnorderedList = false;
+      }
+      if (inOrderedList) {
+        processedContent += "</ol>\n";
+        inOrderedList = false;
+      }
+      processedContent += line;
+      processedContent += '\n';
+    }
+  }
+  if (inUnorderedList) {
+    processedContent += "</ul>\n";
+  }
+  if (inOrderedList) {
+    processedContent += "</ol>\n";
+  }
+
+  block_pass.stop(processedContent.size());
+
+  std::string htmlContent = std::move(processedContent);
+
+  // --- Apply Inline Markdown to the main content ---
+  PhaseTimer inline_pass(stats, "inline pass", htmlContent.size());
+  htmlContent = process_inline_markdown_regex(htmlContent, rules, stats);
+  inline_pass.stop(htmlContent.size());
+
+  // --- Paragraph wrapping ---
+  PhaseTimer wrap(stats, "paragraph wrap", htmlContent.size());
+  std::istringstream paragraphIss(htmlContent);
+  std::string finalHtmlMainContent;
+  finalHtmlMainContent.reserve(htmlContent.size() + htmlContent.size() / 8);
+  std::string currentLine;
+  while (std::getline(paragraphIss, currentLine)) {
+    if (currentLine.empty())
+      continue;
+    if (!is_block_html(currentLine)) {
+      finalHtmlMainContent += "<p>";
+      finalHtmlMainContent += currentLine;
+      finalHtmlMainContent += "</p>\n";
+    } else {
+      finalHtmlMainContent += currentLine;
+      finalHtmlMainContent += '\n';
+    }
+  }
+
+  wrap.stop(finalHtmlMainContent.size());
+
+  // --- Append Footnotes Section ---
+  PhaseTimer footnote_render(stats, "footnote render", 0);
+  size_t main_size = finalHtmlMainContent.size();
+  if (!footnotes.empty()) {
+    finalHtmlMainContent += "<div class=\"footnotes\">\n";
+    finalHtmlMainContent += "<hr>\n";
+    finalHtmlMainContent += "<ol>\n";
+    for (const auto &pair : footnotes) {
+      const std::string &fn_num = pair.first;
+      finalHtmlMainContent += "<li id=\"fn";
+      finalHtmlMainContent += fn_num;
+      finalHtmlMainContent += "\">";
+      finalHtmlMainContent +=
+          process_inline_markdown_regex(pair.second, rules, stats);
+      finalHtmlMainContent += " <a href=\"#fnref";
+      finalHtmlMainContent += fn_num;
+      finalHtmlMainContent += "\" class=\"footnote-backref\">&#8617;</a></li>\n";
+    }
+    finalHtmlMainContent += "</ol>\n";
+    finalHtmlMainContent += "</div>\n";
+  }
+  footnote_render.stop(finalHtmlMainContent.size() - main_size);
+
+  return finalHtmlMainContent;
+}
+
+// Follows the code blocks through lines fed in order, for the passes that
+// look at lines without parsing them. Lines past max_line are plain text and
+// open no code block, as in the parser.
+class FenceTracker {
+public:
+  explicit FenceTracker(size_t max_line = 0) : max_line(max_line) {}
+
+  // Add the next line; true if it is in a code block or one of its fences.
+  bool add(std::string_view line) {
+    if (fence.length) {
+      if (closes_code_fence(line, fence))
+        fence = {};
+      return true;
+    }
+    return (!max_line || line.size() <= max_line) &&
+           match_code_fence(line, fence);
+  }
+
+  // True if the lines so far leave a code block open.
+  bool in_code() const { return fence.length != 0; }
+
+private:
+  CodeFence fence;
+  size_t max_line;
+};
+
+// True if a new block can start at line_start, the start of a line, without
+// changing the output: the line is a heading, a code fence or a paragraph,
+// or follows a blank line. Each of those closes any open list, block quote or
+// table, the state the block parser carries from one line to the next. Code
+// blocks are the exception: in_code says whether the lines before leave one
+// open, and then no line is a boundary until it is closed. A footnote or link
+// definition leaves the list or table open, so it is not a boundary by
+// itself, and neither is a line with a '|' under another, definitions
+// aside, as it may be a table row.
+inline bool is_block_boundary(std::string_view source, size_t line_start,
+                              bool in_code) {
+  if (in_code)
+    return false;
+  if (line_start == 0)
+    return true;
+  if (line_start == 1 || source[line_start - 2] == '\n')
+    return true; // After a blank line
+  size_t end = source.find('\n', line_start);
+  std::string_view line = source.substr(
+      line_start,
+      end == std::string_view::npos ? std::string_view::npos
+                                    : end - line_start);
+  FootnoteDefinition def;
+  LinkDefinition link;
+  if (line.empty() || match_footnote_definition(line, def) ||
+      match_link_definition(line, link))
+    return false;
+  LineKind kind = classify_line(line).kind;
+  if (kind == LINE_HEADING || kind == LINE_FENCE)
+    return true;
+  if (kind != LINE_TEXT)
+    return false;
+  if (line.find('|') == std::string_view::npos)
+    return true;
+  // Look at the line above, past any definitions, which leave a table open
+  size_t above_end = line_start - 1;
+  while (true) {
+    size_t above = source.rfind('\n', above_end - 1) + 1; // npos + 1 is 0
+    std::string_view text = source.substr(above, above_end - above);
+    if (!match_footnote_definition(text, def) &&
+        !match_link_definition(text, link))
+      return text.find('|') == std::string_view::npos;
+    if (above < 2)
+      return true;
+    above_end = above - 1;
+  }
+}
+
+// Splits source into pieces of at least min_size bytes that convert on their
+// own, each ending at a block boundary. A document without one stays whole.
+// Every line is looked at, to follow the code blocks, which lines past
+// max_line do not open.
+inline std::vector<std::string_view>
+split_markdown_blocks(std::string_view source, size_t min_size,
+                      size_t max_line = 0) {
+  std::vector<std::string_view> pieces;
+  FenceTracker fences(max_line);
+  size_t start = 0;
+  size_t line = 0;
+  min_size = std::max<size_t>(min_size, 1);
+  while (true) {
+    size_t end = source.find('\n', line);
+    if (end == std::string_view::npos)
+      break;
+    fences.add(source.substr(line, end - line));
+    line = end + 1;
+    if (line < source.size() && line - start >= min_size &&
+        is_block_boundary(source, line, fences.in_code())) {
+      pieces.push_back(source.substr(start, line - start));
+      start = line;
+    }
+  }
+  if (start < source.size())
+    pieces.push_back(source.substr(start));
+  return pieces;
+}
+
+// Single pass block parser. Lines are fed in order; each one is classified,
+// attached to the tree and has its inline content parsed straight away.
+// Definitions are only recorded in ast.definitions: link definitions for the
+// renderer to resolve references with, and footnote definitions for finish()
+// to add, in numeric order, under a NODE_FOOTNOTES node once the whole
+// document has been seen.
+//
+// The lines of a code block are taken as they are: no inline parsing, no
+// definitions. Block quotes nest and hold headings, lists, tables and
+// paragraphs. A table is a paragraph line with a '|' in it followed by a
+// delimiter row with as many cells, and its rows are the lines with a '|'
+// after that.
+// A BasicMarkdownParser<F> only looks for the syntax in F.
+template <unsigned F> class BasicMarkdownParser {
+public:
+  explicit BasicMarkdownParser(
+      MarkdownAst &ast, const InlineRuleTable &rules = default_inline_rules(),
+      std::pmr::memory_resource *memory = std::pmr::get_default_resource(),
+      const ConvertLimits &limits = {})
+      : ast(ast), scanner(rules, memory, limits), quotes(memory),
+        columns(memory), memory(memory), limits(limits) {}
+
+  // Add the next line, which must be a view into ast.source.
+  void add_line(std::string_view line) {
+    if (code) {
+      add_code_line(line);
+      return;
+    }
+    if (over_long(line)) {
+      add_plain_text(line);
+      return;
+    }
+    FootnoteDefinition def;
+    if (Features::enabled(F, Features::Footnotes) &&
+        match_footnote_definition(line, def)) {
+      DefinitionIndex &defs = ast.definitions;
+      if (limits.max_footnotes &&
+          defs.size(DEFINITION_FOOTNOTE) >= limits.max_footnotes &&
+          !defs.find(DEFINITION_FOOTNOTE, def.number))
+        add_plain_text(line);
+      else
+        defs.insert(DEFINITION_FOOTNOTE, def.number, def.content, true);
+      return;
+    }
+    // The first definition of a label is the one that counts
+    LinkDefinition link;
+    if (Features::enabled(F, Features::Links) &&
+        match_link_definition(line, link)) {
+      ast.definitions.insert(DEFINITION_LINK, link.label, link.url, false);
+      return;
+    }
+    BlockLine block = classify_line<F>(line);
+    if (block.kind == LINE_FENCE) {
+      close_blocks();
+      fence = {line[0], (size_t)block.level, block.content};
+      code = ast.add(0, {.type = NODE_CODE_BLOCK,
+                         .url_length = (uint32_t)block.content.size(),
+                         .url_offset = ast.offset_of(block.content)});
+      return;
+    }
+    // Take off the quote markers, opening or closing quotes to match
+    std::string_view content = line;
+    size_t depth = 0;
+    size_t max_depth =
+        limits.max_nesting ? limits.max_nesting : default_max_quote_depth;
+    while (block.kind == LINE_QUOTE && depth < max_depth) {
+      ++depth;
+      content = block.content;
+      block = classify_line<F>(content);
+    }
+    if (depth != quotes.size()) {
+      list = 0;
+      table = 0;
+      maybe_header = {};
+      quotes.resize(std::min(depth, quotes.size()));
+      while (quotes.size() < depth)
+        quotes.push_back(ast.add(container(), {.type = NODE_BLOCKQUOTE}));
+    }
+    if constexpr (Features::enabled(F, Features::Tables)) {
+      bool row = is_table_row(block);
+      if (table && row) {
+        add_table_row(content, 0);
+        return;
+      }
+      table = 0;
+      if (maybe_header.paragraph && row && start_table(content))
+        return;
+    }
+    maybe_header = {};
+    switch (block.kind) {
+    case LINE_HEADING: {
+      list = 0;
+      uint32_t heading =
+          ast.add(container(), {.type = NODE_HEADING,
+                                .level = (unsigned char)block.level,
+                                .offset = ast.offset_of(line)});
+      scanner.parse(block.content, ast, heading);
+      break;
+    }
+    case LINE_ORDERED_ITEM:
+    case LINE_UNORDERED_ITEM: {
+      NodeType type = list_type(block.kind);
+      if (!list || ast.nodes[list].type != type)
+        list = ast.add(container(), {.type = type});
+      uint32_t item = ast.add(list, {.type = NODE_LIST_ITEM});
+      parse_inline(block.content, item);
+      break;
+    }
+    default: {
+      // Text, or a quote or fence where none can start
+      list = 0;
+      if (content.empty())
+        break;
+      uint32_t paragraph = ast.add(container(), {.type = NODE_PARAGRAPH});
+      parse_inline(content, paragraph);
+      if (is_table_row(block))
+        maybe_header = {paragraph, ast.offset_of(content), content.size()};
+      break;
+    }
+    }
+  }
+
+  // True if line would be added to the last block rather than start a new
+  // one: a line of an open code block, quote or table, the delimiter row of
+  // a table's header or an item for the open list.
+  bool continues_block(std::string_view line) const {
+    if (code)
+      return true;
+    if (over_long(line))
+      return false;
+    BlockLine block = classify_line<F>(line);
+    if (!quotes.empty())
+      return block.kind == LINE_QUOTE;
+    if (table)
+      return is_table_row(block);
+    if (maybe_header.paragraph)
+      return is_table_row(block) && header_columns() ==
+                                        match_table_delimiter(
+                                            line, [](TableAlign) {});
+    return list &&
+           (block.kind == LINE_ORDERED_ITEM ||
+            block.kind == LINE_UNORDERED_ITEM) &&
+           ast.nodes[list].type == list_type(block.kind);
+  }
+
+  // True if line, starting a block, may be followed by more of it: it opens
+  // a list, quote or code block, or may be the header of a table.
+  bool opens_block(std::string_view line) const {
+    if (over_long(line))
+      return false;
+    BlockLine block = classify_line<F>(line);
+    return block.kind == LINE_TEXT ? is_table_row(block)
+                                   : block.kind != LINE_HEADING;
+  }
+
+  // True if the lines so far leave a code block open.
+  bool in_code_block() const { return code != 0; }
+
+  // True if a table is open, or the last line may be the header of one.
+  bool in_table() const { return table || maybe_header.paragraph; }
+
+  // Build only as much of the inline content as an IndexBuilder reads: all
+  // of a heading, but only the references, images and links elsewhere.
+  // Emphasis past max_nesting keeps links in it as text, so with a limit
+  // everything is still parsed.
+  void set_index_only(bool on) { index_only = on && !limits.max_nesting; }
+
+  // Close every open block, for when the tree is emptied between blocks.
+  void close_blocks() {
+    list = 0;
+    quotes.clear();
+    table = 0;
+    maybe_header = {};
+    fence = {};
+    code = 0;
+  }
+
+  // For a stream writing a long code block or table in pieces: if the open
+  // block is one, outside any quote, mark it unfinished so that it renders
+  // without its end and return true. The tree can then be rendered and
+  // emptied, and resume_block() carries on from there.
+  bool suspend_block() {
+    uint32_t node = code;
+    if (!node && table && quotes.empty()) {
+      // Once the body has started, so the piece leaves a <tbody> open
+      uint32_t last = ast.nodes[table].last_child;
+      if (last && !ast.nodes[last].level)
+        node = table;
+    }
+    if (!node)
+      return false;
+    ast.nodes[node].level |= PIECE_UNFINISHED;
+    return true;
+  }
+
+  // Carry on the block suspend_block() marked, in the emptied tree, as a
+  // piece whose start has already been written.
+  void resume_block() {
+    if (code)
+      code = ast.add(0, {.type = NODE_CODE_BLOCK, .level = PIECE_CONTINUED});
+    else
+      table = ast.add(0, {.type = NODE_TABLE, .level = PIECE_CONTINUED});
+  }
+
+  // True if line is past max_line, and so is added as plain text.
+  bool over_long(std::string_view line) const {
+    return limits.max_line && line.size() > limits.max_line;
+  }
+
+  // Add line as a paragraph of escaped text, with no markup: what a line
+  // past one of the limits becomes.
+  void add_plain_text(std::string_view line) {
+    close_blocks();
+    uint32_t paragraph = ast.add(0, {.type = NODE_PARAGRAPH});
+    ast.add(paragraph, {.type = NODE_ESCAPED_TEXT,
+                        .length = (uint32_t)line.size(),
+                        .offset = ast.offset_of(line)});
+  }
+
+  // Parse the footnote definition def, found in line, on its own into note,
+  // which is emptied: a NODE_FOOTNOTE_DEF with the content under it, as in
+  // the section finish() adds. For an index only stream, which indexes each
+  // definition as it comes rather than collecting them.
+  void parse_footnote(std::string_view line, const FootnoteDefinition &def,
+                      MarkdownAst &note) {
+    note.reset(line);
+    uint32_t node = note.add(0, {.type = NODE_FOOTNOTE_DEF,
+                                 .length = (uint32_t)def.number.size(),
+                                 .offset = note.offset_of(def.number)});
+    if (index_only)
+      scanner.parse_references(def.content, note, node);
+    else
+      scanner.parse(def.content, note, node);
+  }
+
+  // End of the document: add the footnote section, and remove the footnote
+  // definitions it was made from. A later definition of a number replaces
+  // an earlier one.
+  void finish() {
+    close_blocks();
+    if (!ast.definitions.size(DEFINITION_FOOTNOTE))
+      return;
+    std::pmr::vector<std::pair<std::string_view, std::string_view>> notes(
+        memory);
+    notes.reserve(ast.definitions.size(DEFINITION_FOOTNOTE));
+    ast.definitions.for_each(
+        DEFINITION_FOOTNOTE,
+        [&](std::string_view number, std::string_view content) {
+          notes.emplace_back(number, content);
+        });
+    std::sort(notes.begin(), notes.end(), [](const auto &a, const auto &b) {
+      return footnote_number_less(a.first, b.first);
+    });
+    uint32_t section = ast.add(0, {.type = NODE_FOOTNOTES});
+    for (const auto &[number, content] : notes) {
+      uint32_t def = ast.add(section, {.type = NODE_FOOTNOTE_DEF,
+                                       .length = (uint32_t)number.size(),
+                                       .offset = ast.offset_of(number)});
+      parse_inline(content, def);
+    }
+    ast.definitions.erase(DEFINITION_FOOTNOTE);
+  }
+
+private:
+  static NodeType list_type(LineKind kind) {
+    return kind == LINE_ORDERED_ITEM ? NODE_ORDERED_LIST : NODE_UNORDERED_LIST;
+  }
+
+  // True if a line of this kind, with a '|' in it, may be a row of a table.
+  static bool is_table_row(const BlockLine &block) {
+    return Features::enabled(F, Features::Tables) &&
+           block.kind == LINE_TEXT &&
+           block.content.find('|') != std::string_view::npos;
+  }
+
+  // The block new lines go into: the innermost open quote, or the document.
+  uint32_t container() const { return quotes.empty() ? 0 : quotes.back(); }
+
+  void add_code_line(std::string_view line) {
+    if (closes_code_fence(line, fence)) {
+      fence = {};
+      code = 0;
+      return;
+    }
+    ast.add(code, {.type = NODE_TEXT,
+                   .length = (uint32_t)line.size(),
+                   .offset = ast.offset_of(line)});
+  }
+
+  size_t header_columns() const {
+    return for_each_table_cell(
+        ast.source.substr(maybe_header.offset, maybe_header.length),
+        [](std::string_view) {});
+  }
+
+  // Make the possible header a table if row is a delimiter row for it.
+  bool start_table(std::string_view row) {
+    size_t count = header_columns();
+    columns.clear();
+    if (match_table_delimiter(row, [&](TableAlign align) {
+          columns.push_back(align);
+        }) != count)
+      return false;
+    // It is the last block, so the nodes after it are its inline content
+    table = maybe_header.paragraph;
+    ast.nodes.resize(table + 1);
+    AstNode &node = ast.nodes[table];
+    node.type = NODE_TABLE;
+    node.first_child = node.last_child = 0;
+    add_table_row(ast.source.substr(maybe_header.offset, maybe_header.length),
+                  CELL_HEADER);
+    maybe_header = {};
+    return true;
+  }
+
+  // Add a row of the open table, with as many cells as it has columns.
+  void add_table_row(std::string_view text, unsigned char header) {
+    uint32_t row = ast.add(table, {.type = NODE_TABLE_ROW,
+                                   .level = (unsigned char)(header != 0)});
+    size_t column = 0;
+    for_each_table_cell(text, [&](std::string_view content) {
+      if (column == columns.size())
+        return;
+      uint32_t cell = ast.add(
+          row, {.type = NODE_TABLE_CELL,
+                .level = (unsigned char)(columns[column++] | header)});
+      if (!content.empty())
+        parse_inline(content, cell);
+    });
+    for (; column < columns.size(); ++column)
+      ast.add(row, {.type = NODE_TABLE_CELL,
+                    .level = (unsigned char)(columns[column] | header)});
+  }
+
+  void parse_inline(std::string_view text, uint32_t parent) {
+    if (index_only)
+      scanner.parse_references(text, ast, parent);
+    else
+      scanner.parse(text, ast, parent);
+  }
+
+  // A paragraph that a delimiter row on the next line would make the header
+  // of a table, and where its text is in the source.
+  struct PossibleHeader {
+    uint32_t paragraph = 0;
+    size_t offset = 0;
+    size_t length = 0;
+  };
+
+  MarkdownAst &ast;
+  InlineScanner::BasicScanner<F> scanner;
+  uint32_t list = 0;                    // The open list, if any
+  std::pmr::vector<uint32_t> quotes;    // The open quotes, outermost first
+  uint32_t table = 0;                   // The open table
+  std::pmr::vector<unsigned char> columns; // Its columns' TableAlign
+  PossibleHeader maybe_header;
+  CodeFence fence; // Of the open code block
+  uint32_t code = 0;
+  std::pmr::memory_resource *memory;
+  ConvertLimits limits;
+  bool index_only = false;
+};
+
+using MarkdownParser = BasicMarkdownParser<Features::All>;
+
+inline void record_largest_block(std::string_view source,
+                                 ConvertStats &stats) {
+  for (auto block : split_markdown_blocks(source, 1))
+    stats.largest_block = std::max(stats.largest_block, block.size());
+}
+
+// Count the inline matches in a tree into stats.
+inline void record_inline_matches(const MarkdownAst &ast,
+                                  ConvertStats &stats) {
+  size_t counts[NODE_TABLE_CELL + 1] = {};
+  for (const auto &node : ast.nodes)
+    ++counts[node.type];
+  static const std::pair<NodeType, const char *> rules[] = {
+      {NODE_FOOTNOTE_REF, "footnote_ref"}, {NODE_IMAGE, "image"},
+      {NODE_LINK, "link"},                 {NODE_STRONG, "strong"},
+      {NODE_EMPHASIS, "emphasis"},         {NODE_CUSTOM, "custom"},
+      {NODE_LINK_REF, "link_ref"}};
+  for (auto [type, name] : rules)
+    if (counts[type])
+      stats.rule_matches[name] += counts[type];
+}
+
+// Count the inline matches in a tree, and its largest block, into stats.
+inline void record_tree(const MarkdownAst &ast, ConvertStats &stats) {
+  record_inline_matches(ast, stats);
+  record_largest_block(ast.source, stats);
+}
+
+inline std::pmr::memory_resource *scratch_memory(const ConvertOptions &options) {
+  return options.scratch ? options.scratch : std::pmr::get_default_resource();
+}
+
+// Parse a document into a tree in one pass over its lines, looking for the
+// syntax in F.
+template <unsigned F = Features::All>
+void parse_markdown(std::string_view source, MarkdownAst &ast,
+                    const ConvertOptions &options = {}) {
+  check_input_size(source.size(), options.limits);
+  PhaseTimer timer(options.stats, "parse", source.size());
+  ast.reset(source);
+  ast.nodes.reserve(source.size() / 16 + 1);
+  BasicMarkdownParser<F> parser(
+      ast, options.rules ? *options.rules : default_inline_rules(),
+      scratch_memory(options), options.limits);
+  for_each_line(source, [&](std::string_view line) { parser.add_line(line); });
+  parser.finish();
+  timer.stop(ast.nodes.size() * sizeof(AstNode));
+  if (options.stats)
+    record_tree(ast, *options.stats);
+}
+
+template <unsigned F = Features::All>
+MarkdownAst parse_markdown(std::string_view source,
+                           const ConvertOptions &options = {}) {
+  MarkdownAst ast(scratch_memory(options));
+  parse_markdown<F>(source, ast, options);
+  return ast;
+}
+
+// --- Rendering ---
+//
+// A tree from one parse can be written out in any of several formats. Each
+// back-end derives from BasicRenderer, which walks the tree and calls the
+// back-end's render_node for every node through the derived type (CRTP).
+// The call is resolved at compile time, so there is no virtual call per node
+// and each back-end's switch is inlined into the walk.
+
+// The walk and the lookups every back-end needs. Reference links are
+// resolved through the link definitions of the tree, or of definitions if
+// given.
+template <class Renderer> class BasicRenderer {
+public:
+  explicit BasicRenderer(std::string &out,
+                         const DefinitionIndex *definitions = nullptr)
+      : out(out), definitions(definitions) {}
+
+  void render(const MarkdownAst &ast) { render_children(ast, 0); }
+
+protected:
+  void render_children(const MarkdownAst &ast, uint32_t parent) {
+    Renderer &renderer = static_cast<Renderer &>(*this);
+    for (uint32_t i = ast.nodes[parent].first_child; i;
+         i = ast.nodes[i].next_sibling)
+      renderer.render_node(ast, ast.nodes[i]);
+  }
+
+  void wrap(const MarkdownAst &ast, const AstNode &node, std::string_view open,
+            std::string_view close) {
+    out += open;
+    render_children(ast, index_of(ast, node));
+    out += close;
+  }
+
+  // The URL of a reference link, or null if its label is not defined.
+  const std::string_view *resolve(const MarkdownAst &ast,
+                                  const AstNode &node) const {
+    const DefinitionIndex &links =
+        definitions ? *definitions : ast.definitions;
+    return links.find(DEFINITION_LINK, ast.url(node));
+  }
+
+  static uint32_t index_of(const MarkdownAst &ast, const AstNode &node) {
+    return (uint32_t)(&node - ast.nodes.data());
+  }
+
+  std::string &out;
+  const DefinitionIndex *definitions;
+};
+
+// Writes a tree out as HTML. A reference with no definition is written back
+// as the text it was.
+class HtmlRenderer : public BasicRenderer<HtmlRenderer> {
+public:
+  using BasicRenderer::BasicRenderer;
+
+private:
+  friend BasicRenderer<HtmlRenderer>;
+
+  void render_node(const MarkdownAst &ast, const AstNode &node) {
+    switch (node.type) {
+    case NODE_DOCUMENT:
+      render_children(ast, 0);
+      break;
+    case NODE_HEADING:
+      out += "<h";
+      out += (char)('0' + node.level);
+      out += '>';
+      render_children(ast, index_of(ast, node));
+      out += "</h";
+      out += (char)('0' + node.level);
+      out += ">\n";
+      break;
+    case NODE_PARAGRAPH:
+      wrap(ast, node, "<p>", "</p>\n");
+      break;
+    case NODE_UNORDERED_LIST:
+      wrap(ast, node, "<ul>\n", "</ul>\n");
+      break;
+    case NODE_ORDERED_LIST:
+      wrap(ast, node, "<ol>\n", "</ol>\n");
+      break;
+    case NODE_LIST_ITEM:
+      wrap(ast, node, "<li>", "</li>\n");
+      break;
+    case NODE_CODE_BLOCK:
+      render_code_block(ast, node);
+      break;
+    case NODE_BLOCKQUOTE:
+      wrap(ast, node, "<blockquote>\n", "</blockquote>\n");
+      break;
+    case NODE_TABLE:
+      render_table(ast, node);
+      break;
+    case NODE_TABLE_ROW:
+      wrap(ast, node, "<tr>\n", "</tr>\n");
+      break;
+    case NODE_TABLE_CELL: {
+      static constexpr std::string_view aligns[] = {
+          ">", " align=\"left\">", " align=\"center\">", " align=\"right\">"};
+      bool header = node.level & CELL_HEADER;
+      out += header ? "<th" : "<td";
+      out += aligns[node.level & 3];
+      render_children(ast, index_of(ast, node));
+      out += header ? "</th>\n" : "</td>\n";
+      break;
+    }
+    case NODE_FOOTNOTES:
+      wrap(ast, node, "<div class=\"footnotes\">\n<hr>\n<ol>\n",
+           "</ol>\n</div>\n");
+      break;
+    case NODE_FOOTNOTE_DEF: {
+      auto num = ast.text(node);
+      out += "<li id=\"fn";
+      out += num;
+      out += "\">";
+      render_children(ast, index_of(ast, node));
+      out += " <a href=\"#fnref";
+      out += num;
+      out += "\" class=\"footnote-backref\">&#8617;</a></li>\n";
+      break;
+    }
+    case NODE_TEXT:
+    case NODE_ESCAPED_TEXT:
+      append_escaped(out, ast.text(node), ESCAPE_TEXT);
+      break;
+    case NODE_STRONG:
+      wrap(ast, node, "<strong>", "</strong>");
+      break;
+    case NODE_EMPHASIS:
+      wrap(ast, node, "<em>", "</em>");
+      break;
+    case NODE_LINK:
+      out += "<a href=\"";
+      append_escaped(out, ast.url(node), ESCAPE_ATTRIBUTE);
+      out += "\">";
+      render_children(ast, index_of(ast, node));
+      out += "</a>";
+      break;
+    case NODE_LINK_REF:
+      if (const std::string_view *url = resolve(ast, node)) {
+        out += "<a href=\"";
+        append_escaped(out, *url, ESCAPE_ATTRIBUTE);
+        out += "\">";
+        render_children(ast, index_of(ast, node));
+        out += "</a>";
+      } else {
+        out += '[';
+        render_children(ast, index_of(ast, node));
+        out += "][";
+        append_escaped(out, ast.url(node), ESCAPE_TEXT);
+        out += ']';
+      }
+      break;
+    case NODE_IMAGE:
+      out += "<img src=\"";
+      append_escaped(out, ast.url(node), ESCAPE_ATTRIBUTE);
+      out += "\" alt=\"";
+      append_escaped(out, ast.text(node), ESCAPE_ATTRIBUTE);
+      out += "\">";
+      break;
+    case NODE_FOOTNOTE_REF: {
+      auto num = ast.text(node);
+      out += "<sup><a href=\"#fn";
+      out += num;
+      out += "\" id=\"fnref";
+      out += num;
+      out += "\">";
+      out += num;
+      out += "</a></sup>";
+      break;
+    }
+    case NODE_CUSTOM:
+      out += ast.replacements[node.offset];
+      break;
+    }
+  }
+
+  // The lines are copied, escaped, with no markup. A piece of a block being
+  // streamed leaves off the start or the end that another piece writes.
+  void render_code_block(const MarkdownAst &ast, const AstNode &node) {
+    if (!(node.level & PIECE_CONTINUED)) {
+      out += "<pre><code";
+      if (node.url_length) {
+        // The language is the first word of the info string
+        auto info = ast.url(node);
+        out += " class=\"language-";
+        append_escaped(out, info.substr(0, info.find_first_of(" \t")),
+                       ESCAPE_ATTRIBUTE);
+        out += '"';
+      }
+      out += '>';
+    }
+    for (uint32_t i = node.first_child; i; i = ast.nodes[i].next_sibling) {
+      append_escaped(out, ast.text(ast.nodes[i]), ESCAPE_TEXT);
+      out += '\n';
+    }
+    if (!(node.level & PIECE_UNFINISHED))
+      out += "</code></pre>\n";
+  }
+
+  void render_table(const MarkdownAst &ast, const AstNode &node) {
+    bool body = node.level & PIECE_CONTINUED;
+    if (!body)
+      out += "<table>\n";
+    for (uint32_t i = node.first_child; i; i = ast.nodes[i].next_sibling) {
+      if (ast.nodes[i].level) {
+        out += "<thead>\n";
+        render_node(ast, ast.nodes[i]);
+        out += "</thead>\n";
+        continue;
+      }
+      if (!body)
+        out += "<tbody>\n";
+      body = true;
+      render_node(ast, ast.nodes[i]);
+    }
+    if (node.level & PIECE_UNFINISHED)
+      return;
+    if (body)
+      out += "</tbody>\n";
+    out += "</table>\n";
+  }
+};
+
+// Render a tree into out, replacing its contents but keeping its storage.
+inline void render_html(const MarkdownAst &ast, std::string &out) {
+  out.clear();
+  out.reserve(estimate_html_size(ast.source.size()));
+  HtmlRenderer(out).render(ast);
+}
+
+inline std::string render_html(const MarkdownAst &ast) {
+  std::string out;
+  render_html(ast, out);
+  return out;
+}
+
+// Append the text of some HTML, such as a custom rule's output, to out with
+// its tags left out.
+inline void append_without_tags(std::string &out, std::string_view html) {
+  size_t pos = 0;
+  while (pos < html.size()) {
+    size_t tag = std::min(html.find('<', pos), html.size());
+    out.append(html.data() + pos, tag - pos);
+    pos = std::min(html.find('>', tag), html.size() - 1) + 1;
+  }
+}
+
+// Writes a tree out as plain text, for search indexing, previews and the
+// like: the text of each block on a line of its own, with the markup left
+// out. Links and images become their text, table cells are separated by tabs
+// and footnotes follow as "[N] text". Nothing is escaped.
+class PlainTextRenderer : public BasicRenderer<PlainTextRenderer> {
+public:
+  using BasicRenderer::BasicRenderer;
+
+private:
+  friend BasicRenderer<PlainTextRenderer>;
+
+  void render_node(const MarkdownAst &ast, const AstNode &node) {
+    switch (node.type) {
+    case NODE_DOCUMENT:
+    case NODE_UNORDERED_LIST:
+    case NODE_ORDERED_LIST:
+    case NODE_BLOCKQUOTE:
+    case NODE_TABLE:
+    case NODE_FOOTNOTES:
+    case NODE_STRONG:
+    case NODE_EMPHASIS:
+    case NODE_LINK:
+    case NODE_TABLE_CELL:
+      render_children(ast, index_of(ast, node));
+      break;
+    case NODE_HEADING:
+    case NODE_PARAGRAPH:
+    case NODE_LIST_ITEM:
+      wrap(ast, node, "", "\n");
+      break;
+    case NODE_CODE_BLOCK:
+      for (uint32_t i = node.first_child; i; i = ast.nodes[i].next_sibling) {
+        out += ast.text(ast.nodes[i]);
+        out += '\n';
+      }
+      break;
+    case NODE_TABLE_ROW:
+      for (uint32_t i = node.first_child; i; i = ast.nodes[i].next_sibling) {
+        if (i != node.first_child)
+          out += '\t';
+        render_children(ast, i);
+      }
+      out += '\n';
+      break;
+    case NODE_FOOTNOTE_DEF:
+      out += '[';
+      out += ast.text(node);
+      wrap(ast, node, "] ", "\n");
+      break;
+    case NODE_TEXT:
+    case NODE_ESCAPED_TEXT:
+    case NODE_IMAGE:
+      out += ast.text(node);
+      break;
+    case NODE_LINK_REF:
+      if (resolve(ast, node)) {
+        render_children(ast, index_of(ast, node));
+      } else {
+        out += '[';
+        render_children(ast, index_of(ast, node));
+        out += "][";
+        out += ast.url(node);
+        out += ']';
+      }
+      break;
+    case NODE_FOOTNOTE_REF:
+      out += '[';
+      out += ast.text(node);
+      out += ']';
+      break;
+    case NODE_CUSTOM:
+      append_without_tags(out, ast.replacements[node.offset]);
+      break;
+    }
+  }
+};
+
+// The number of columns text takes on a terminal: its UTF-8 characters, less
+// any escape sequences. Wide characters are counted as one column.
+inline size_t terminal_width(std::string_view text) {
+  size_t width = 0;
+  for (size_t i = 0; i < text.size(); ++i) {
+    if (text[i] == '\x1b') {
+      i = std::min(text.find('m', i), text.size());
+      continue;
+    }
+    width += ((unsigned char)text[i] & 0xc0) != 0x80;
+  }
+  return width;
+}
+
+// Writes a tree out for a terminal, styled with ANSI escape sequences:
+// headings bold (and underlined at level 1), emphasis italic, links
+// underlined with their URL after them, code indented in color, quotes
+// behind a bar and tables in aligned columns. Blocks are separated by blank
+// lines. Control characters from the document are replaced, so it cannot
+// send the terminal sequences of its own.
+class AnsiRenderer : public BasicRenderer<AnsiRenderer> {
+public:
+  using BasicRenderer::BasicRenderer;
+
+private:
+  friend BasicRenderer<AnsiRenderer>;
+
+  void render_node(const MarkdownAst &ast, const AstNode &node) {
+    switch (node.type) {
+    case NODE_DOCUMENT:
+    case NODE_TABLE_CELL:
+      render_children(ast, index_of(ast, node));
+      break;
+    case NODE_HEADING:
+      begin_block();
+      start_line();
+      wrap(ast, node, node.level == 1 ? "\x1b[1;4m" : "\x1b[1m",
+           "\x1b[22;24m\n");
+      break;
+    case NODE_PARAGRAPH:
+      begin_block();
+      start_line();
+      wrap(ast, node, "", "\n");
+      break;
+    case NODE_UNORDERED_LIST:
+    case NODE_ORDERED_LIST:
+    case NODE_FOOTNOTES:
+      render_list(ast, node);
+      break;
+    case NODE_LIST_ITEM:
+    case NODE_TABLE_ROW:
+      break; // Written by their list or table
+    case NODE_CODE_BLOCK:
+      begin_block();
+      for (uint32_t i = node.first_child; i; i = ast.nodes[i].next_sibling) {
+        start_line();
+        out += "    \x1b[36m";
+        append_escaped(out, ast.text(ast.nodes[i]), ESCAPE_TERMINAL);
+        out += "\x1b[39m\n";
+      }
+      break;
+    case NODE_BLOCKQUOTE: {
+      begin_block();
+      separate = false;
+      size_t outer = prefix.size();
+      prefix += "\x1b[2m│\x1b[22m ";
+      render_children(ast, index_of(ast, node));
+      prefix.resize(outer);
+      break;
+    }
+    case NODE_TABLE:
+      render_table(ast, node);
+      break;
+    case NODE_FOOTNOTE_DEF:
+      out += '[';
+      out += ast.text(node);
+      wrap(ast, node, "] ", "\n");
+      break;
+    case NODE_TEXT:
+    case NODE_ESCAPED_TEXT:
+      append_escaped(out, ast.text(node), ESCAPE_TERMINAL);
+      break;
+    case NODE_STRONG:
+      wrap(ast, node, "\x1b[1m", "\x1b[22m");
+      break;
+    case NODE_EMPHASIS:
+      wrap(ast, node, "\x1b[3m", "\x1b[23m");
+      break;
+    case NODE_LINK:
+      render_link(ast, node, ast.url(node));
+      break;
+    case NODE_LINK_REF:
+      if (const std::string_view *url = resolve(ast, node)) {
+        render_link(ast, node, *url);
+      } else {
+        out += '[';
+        render_children(ast, index_of(ast, node));
+        out += "][";
+        append_escaped(out, ast.url(node), ESCAPE_TERMINAL);
+        out += ']';
+      }
+      break;
+    case NODE_IMAGE:
+      out += "[image: ";
+      append_escaped(out, ast.text(node), ESCAPE_TERMINAL);
+      out += ']';
+      append_url(ast.url(node));
+      break;
+    case NODE_FOOTNOTE_REF:
+      out += "\x1b[2m[";
+      out += ast.text(node);
+      out += "]\x1b[22m";
+      break;
+    case NODE_CUSTOM:
+      append_without_tags(out, ast.replacements[node.offset]);
+      break;
+    }
+  }
+
+  // Every line starts with the bars of the quotes it is in.
+  void start_line() { out += prefix; }
+
+  // A blank line goes between blocks, but not before the first one of the
+  // document or of a quote.
+  void begin_block() {
+    if (separate) {
+      start_line();
+      out += '\n';
+    }
+    separate = true;
+  }
+
+  void render_link(const MarkdownAst &ast, const AstNode &node,
+                   std::string_view url) {
+    wrap(ast, node, "\x1b[4m", "\x1b[24m");
+    append_url(url);
+  }
+
+  void append_url(std::string_view url) {
+    out += " \x1b[34m(";
+    append_escaped(out, url, ESCAPE_TERMINAL);
+    out += ")\x1b[39m";
+  }
+
+  // Bullets, numbers from 1, or for footnotes the number of each.
+  void render_list(const MarkdownAst &ast, const AstNode &node) {
+    begin_block();
+    if (node.type == NODE_FOOTNOTES) {
+      start_line();
+      out += "\x1b[2m────\x1b[22m\n";
+    }
+    size_t number = 0;
+    for (uint32_t i = node.first_child; i; i = ast.nodes[i].next_sibling) {
+      start_line();
+      ++number;
+      if (node.type == NODE_UNORDERED_LIST) {
+        out += "  • ";
+      } else if (node.type == NODE_ORDERED_LIST) {
+        out += "  ";
+        out += std::to_string(number);
+        out += ". ";
+      }
+      if (node.type == NODE_FOOTNOTES)
+        render_node(ast, ast.nodes[i]);
+      else
+        wrap(ast, ast.nodes[i], "", "\n");
+    }
+  }
+
+  // The cells are written one after another into a buffer first, to size
+  // the columns, then each is padded to its column's width as the column is
+  // aligned. The header is bold and underlined with a rule.
+  void render_table(const MarkdownAst &ast, const AstNode &node) {
+    begin_block();
+    std::string cells;
+    AnsiRenderer cell_renderer(cells, definitions);
+    std::vector<size_t> ends;       // Where each cell ends in cells
+    std::vector<size_t> row_ends;   // Where each row ends in ends
+    std::vector<size_t> widths;     // Of each column
+    std::vector<unsigned char> aligns;
+    bool header = false;
+    for (uint32_t r = node.first_child; r; r = ast.nodes[r].next_sibling) {
+      header |= ast.nodes[r].level != 0;
+      size_t column = 0;
+      for (uint32_t c = ast.nodes[r].first_child; c;
+           c = ast.nodes[c].next_sibling, ++column) {
+        size_t start = cells.size();
+        cell_renderer.render_children(ast, c);
+        ends.push_back(cells.size());
+        if (column == widths.size()) {
+          widths.push_back(0);
+          aligns.push_back(ast.nodes[c].level & 3);
+        }
+        widths[column] = std::max(
+            widths[column],
+            terminal_width(std::string_view(cells).substr(start)));
+      }
+      row_ends.push_back(ends.size());
+    }
+    size_t cell = 0, start = 0;
+    for (size_t r = 0; r < row_ends.size(); ++r) {
+      start_line();
+      size_t first = cell;
+      for (; cell < row_ends[r]; start = ends[cell++]) {
+        std::string_view text =
+            std::string_view(cells).substr(start, ends[cell] - start);
+        size_t column = cell - first;
+        size_t pad = widths[column] - terminal_width(text);
+        size_t before = aligns[column] == ALIGN_RIGHT    ? pad
+                        : aligns[column] == ALIGN_CENTER ? pad / 2
+                                                         : 0;
+        if (column)
+          out += "  ";
+        out.append(before, ' ');
+        if (header && r == 0)
+          out += "\x1b[1m";
+        out += text;
+        if (header && r == 0)
+          out += "\x1b[22m";
+        if (cell + 1 < row_ends[r])
+          out.append(pad - before, ' ');
+      }
+      out += '\n';
+      if (header && r == 0) {
+        start_line();
+        for (size_t column = 0; column < widths.size(); ++column) {
+          if (column)
+            out += "  ";
+          for (size_t i = 0; i < widths[column]; ++i)
+            out += "─";
+        }
+        out += '\n';
+      }
+    }
+  }
+
+  std::string prefix;     // The quote bars, written at the start of every line
+  bool separate = false; // Whether a blank line is due before the next block
+};
+
+// Render a tree into out as plain text, replacing its contents.
+inline void render_text(const MarkdownAst &ast, std::string &out) {
+  out.clear();
+  out.reserve(ast.source.size());
+  PlainTextRenderer(out).render(ast);
+}
+
+inline std::string render_text(const MarkdownAst &ast) {
+  std::string out;
+  render_text(ast, out);
+  return out;
+}
+
+// Render a tree into out for a terminal, replacing its contents.
+inline void render_ansi(const MarkdownAst &ast, std::string &out) {
+  out.clear();
+  out.reserve(estimate_html_size(ast.source.size()));
+  AnsiRenderer(out).render(ast);
+}
+
+inline std::string render_ansi(const MarkdownAst &ast) {
+  std::string out;
+  render_ansi(ast, out);
+  return out;
+}
+
+// --- Document index ---
+
+// What a search indexer or link checker needs from a document, gathered from
+// its tree so it does not have to parse the HTML again: the outline, every
+// link and image target and the footnote references, each with its byte
+// offset in the input. The views point into storage the index owns.
+
+struct IndexHeading {
+  unsigned level = 0;
+  std::string_view text;   // Without markup
+  std::string_view anchor; // Unique in the document, made from the text
+  size_t offset = 0;       // Of the start of its line
+};
+
+struct IndexLink {
+  NodeType type = NODE_LINK; // NODE_LINK, NODE_IMAGE or NODE_LINK_REF
+  std::string_view url;      // Empty for a reference to an undefined label
+  std::string_view label;    // Of a reference
+  std::string_view text;     // Link text or alt text, without markup
+  size_t offset = 0;         // Of the URL, or of a reference's label
+};
+
+struct IndexFootnote {
+  std::string_view number;
+  size_t offset = 0;
+  bool defined = false;
+};
+
+struct DocumentIndex {
+  std::vector<IndexHeading> headings;
+  std::vector<IndexLink> links;         // And images, in document order
+  std::vector<IndexFootnote> footnotes; // References, in document order
+
+  // Empty the index, keeping its memory for the next document.
+  void clear() {
+    headings.clear();
+    links.clear();
+    footnotes.clear();
+    strings.reset();
+  }
+
+  // A copy of text that lives until clear().
+  std::string_view keep(std::string_view text) {
+    if (text.empty())
+      return {};
+    auto *copy = static_cast<char *>(strings.allocate(text.size(), 1));
+    std::memcpy(copy, text.data(), text.size());
+    return {copy, text.size()};
+  }
+
+  // The index as a JSON object of three arrays, one entry per line.
+  std::string json() const {
+    std::string out;
+    out.reserve(64 + 96 * (headings.size() + links.size()) +
+                48 * footnotes.size());
+    auto string = [&out](std::string_view key, std::string_view value) {
+      out += key;
+      out += '"';
+      append_escaped(out, value, ESCAPE_JSON);
+      out += '"';
+    };
+    auto number = [&out](std::string_view key, size_t value) {
+      char digits[24];
+      out += key;
+      out.append(digits, std::to_chars(digits, digits + 24, value).ptr);
+    };
+    auto separator = [&out](size_t i) { out += i ? "},\n  {" : "\n  {"; };
+
+    out += "{\"headings\": [";
+    for (size_t i = 0; i < headings.size(); ++i) {
+      separator(i);
+      number("\"level\": ", headings[i].level);
+      string(", \"text\": ", headings[i].text);
+      string(", \"anchor\": ", headings[i].anchor);
+      number(", \"offset\": ", headings[i].offset);
+    }
+    out += headings.empty() ? "],\n\"links\": [" : "}],\n\"links\": [";
+    for (size_t i = 0; i < links.size(); ++i) {
+      const IndexLink &link = links[i];
+      separator(i);
+      out += link.type == NODE_IMAGE ? "\"type\": \"image\""
+                                     : "\"type\": \"link\"";
+      if (link.type == NODE_LINK_REF && link.url.empty())
+        out += ", \"url\": null";
+      else
+        string(", \"url\": ", link.url);
+      if (link.type == NODE_LINK_REF)
+        string(", \"label\": ", link.label);
+      string(", \"text\": ", link.text);
+      number(", \"offset\": ", link.offset);
+    }
+    out += links.empty() ? "],\n\"footnotes\": [" : "}],\n\"footnotes\": [";
+    for (size_t i = 0; i < footnotes.size(); ++i) {
+      separator(i);
+      string("\"number\": ", footnotes[i].number);
+      number(", \"offset\": ", footnotes[i].offset);
+      out += footnotes[i].defined ? ", \"defined\": true"
+                                  : ", \"defined\": false";
+    }
+    out += footnotes.empty() ? "]}\n" : "}]}\n";
+    return out;
+  }
+
+private:
+  Arena strings{16 * 1024};
+};
+
+// An anchor for a heading, made as GitHub makes them: ASCII letters
+// lowercased, spaces turned into '-', other punctuation dropped and any
+// other byte, such as UTF-8, kept.
+inline std::string heading_slug(std::string_view text) {
+  std::string slug;
+  for (char c : text) {
+    if (c >= 'A' && c <= 'Z')
+      slug += (char)(c - 'A' + 'a');
+    else if (c == ' ')
+      slug += '-';
+    else if ((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '-' ||
+             c == '_' || (unsigned char)c >= 0x80)
+      slug += c;
+  }
+  return slug;
+}
+
+// Fills a DocumentIndex from trees added in document order: one for a whole
+// document, or one per block as a stream converts it. References are
+// resolved once every tree has been seen, as their definitions may come
+// last.
+//
+// A footnote definition's entries go after everything else, in the numeric
+// order of the footnote section. They may come as that section, or one
+// definition at a time where they stand in the input, as an index only
+// stream adds them: each is kept aside, and finish() puts the last
+// definition of each number in order.
+class IndexBuilder {
+public:
+  // The definitions finish() looks references up in go in scratch, if
+  // given, as they take far more than the rest.
+  explicit IndexBuilder(DocumentIndex &index,
+                        std::pmr::memory_resource *scratch = nullptr)
+      : index(index), link_definitions(scratch ? scratch : &memory),
+        definitions(scratch ? scratch : &memory) {
+    index.clear();
+  }
+
+  // Add the entries of a tree, walking its nodes, which are stored in
+  // document order. to_input maps an offset in the tree's source to one in
+  // the whole input.
+  template <class ToInput>
+    requires std::is_invocable_r_v<size_t, ToInput, size_t>
+  void add(const MarkdownAst &ast, ToInput &&to_input) {
+    // Once in a footnote definition, every later node is in one too
+    auto *links = &index.links;
+    auto *footnotes = &index.footnotes;
+    for (uint32_t i = 1; i < ast.nodes.size(); ++i) {
+      const AstNode &node = ast.nodes[i];
+      switch (node.type) {
+      case NODE_HEADING:
+        index.headings.push_back({.level = node.level,
+                                  .text = text_of(ast, i),
+                                  .offset = to_input(node.offset)});
+        index.headings.back().anchor =
+            unique_anchor(heading_slug(index.headings.back().text));
+        break;
+      case NODE_LINK:
+        links->push_back({.type = NODE_LINK,
+                          .url = index.keep(ast.url(node)),
+                          .text = text_of(ast, i),
+                          .offset = to_input(node.url_offset)});
+        break;
+      case NODE_LINK_REF:
+        links->push_back({.type = NODE_LINK_REF,
+                          .label = index.keep(ast.url(node)),
+                          .text = text_of(ast, i),
+                          .offset = to_input(node.url_offset)});
+        break;
+      case NODE_IMAGE:
+        links->push_back({.type = NODE_IMAGE,
+                          .url = index.keep(ast.url(node)),
+                          .text = index.keep(ast.text(node)),
+                          .offset = to_input(node.url_offset)});
+        break;
+      case NODE_FOOTNOTE_REF:
+        footnotes->push_back({.number = index.keep(ast.text(node)),
+                              .offset = to_input(node.offset)});
+        break;
+      case NODE_FOOTNOTE_DEF:
+        links = &note_links;
+        footnotes = &note_footnotes;
+        notes.push_back({.number = index.keep(ast.text(node)),
+                         .links = note_links.size(),
+                         .footnotes = note_footnotes.size()});
+        break;
+      default:
+        break;
+      }
+    }
+  }
+
+  // Add a tree whose source starts at offset base in the input.
+  void add(const MarkdownAst &ast, size_t base = 0) {
+    add(ast, [base](size_t offset) { return base + offset; });
+  }
+
+  // Add a link definition for finish() to resolve references with, where
+  // there is no table of them to hand. The first one of a label counts. The
+  // views have to stay valid until finish().
+  void add_definition(std::string_view label, std::string_view url) {
+    link_definitions.emplace_back(label, url);
+  }
+
+  // Put the footnote definitions' entries in order, resolve the references
+  // through the link definitions and mark the footnotes that have a
+  // definition.
+  void finish(const DefinitionIndex &links) {
+    // The footnote numbers defined, each to its last definition's number,
+    // and the link definitions added, added together as the table would
+    // otherwise grow again and again
+    definitions.reserve(notes.size() + link_definitions.size());
+    for (size_t i = 0; i < notes.size(); ++i) {
+      if (i + prefetch_distance < notes.size())
+        definitions.prefetch(DEFINITION_FOOTNOTE,
+                             notes[i + prefetch_distance].number);
+      definitions.insert(DEFINITION_FOOTNOTE, notes[i].number,
+                         notes[i].number, true);
+    }
+    for (size_t i = 0; i < link_definitions.size(); ++i) {
+      if (i + prefetch_distance < link_definitions.size())
+        definitions.prefetch(DEFINITION_LINK,
+                             link_definitions[i + prefetch_distance].first);
+      definitions.insert(DEFINITION_LINK, link_definitions[i].first,
+                         link_definitions[i].second, false);
+    }
+    add_notes();
+
+    auto &all = index.links;
+    for (size_t i = 0; i < all.size(); ++i) {
+      if (i + prefetch_distance < all.size() &&
+          all[i + prefetch_distance].type == NODE_LINK_REF)
+        links.prefetch(DEFINITION_LINK, all[i + prefetch_distance].label);
+      if (all[i].type != NODE_LINK_REF)
+        continue;
+      const std::string_view *url = links.find(DEFINITION_LINK, all[i].label);
+      if (url)
+        all[i].url = index.keep(*url);
+    }
+    auto &footnotes = index.footnotes;
+    for (size_t i = 0; i < footnotes.size(); ++i) {
+      if (i + prefetch_distance < footnotes.size())
+        definitions.prefetch(DEFINITION_FOOTNOTE,
+                             footnotes[i + prefetch_distance].number);
+      footnotes[i].defined =
+          definitions.find(DEFINITION_FOOTNOTE, footnotes[i].number);
+    }
+  }
+
+  // Finish with the link definitions given to add_definition().
+  void finish() { finish(definitions); }
+
+private:
+  // A footnote definition, and where its entries start in note_links and
+  // note_footnotes. They end where the next one's start.
+  struct Note {
+    std::string_view number;
+    size_t links = 0;
+    size_t footnotes = 0;
+  };
+
+  // How many keys ahead of a lookup to prefetch the slot of.
+  static constexpr size_t prefetch_distance = 8;
+
+  // Add the entries of the last definition of each footnote number, in
+  // numeric order. Only definitions with entries need sorting.
+  void add_notes() {
+    std::pmr::vector<uint32_t> order(&memory);
+    for (uint32_t i = 0; i < notes.size(); ++i) {
+      size_t links_end = i + 1 < notes.size() ? notes[i + 1].links
+                                              : note_links.size();
+      size_t footnotes_end = i + 1 < notes.size() ? notes[i + 1].footnotes
+                                                  : note_footnotes.size();
+      if (links_end == notes[i].links && footnotes_end == notes[i].footnotes)
+        continue;
+      const std::string_view *last =
+          definitions.find(DEFINITION_FOOTNOTE, notes[i].number);
+      if (last->data() == notes[i].number.data())
+        order.push_back(i);
+    }
+    std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+      return footnote_number_less(notes[a].number, notes[b].number);
+    });
+    for (uint32_t i : order) {
+      bool last = i + 1 == notes.size();
+      index.links.insert(index.links.end(),
+                         note_links.begin() + notes[i].links,
+                         last ? note_links.end()
+                              : note_links.begin() + notes[i + 1].links);
+      index.footnotes.insert(
+          index.footnotes.end(), note_footnotes.begin() + notes[i].footnotes,
+          last ? note_footnotes.end()
+               : note_footnotes.begin() + notes[i + 1].footnotes);
+    }
+  }
+
+  // The text under a node, with the markup left out and the ends trimmed.
+  std::string_view text_of(const MarkdownAst &ast, uint32_t node) {
+    text.clear();
+    append_text(ast, node);
+    size_t first = std::min(text.find_first_not_of(' '), text.size());
+    size_t last = text.find_last_not_of(' ') + 1;
+    return index.keep(std::string_view(text).substr(first, last - first));
+  }
+
+  void append_text(const MarkdownAst &ast, uint32_t parent) {
+    for (uint32_t i = ast.nodes[parent].first_child; i;
+         i = ast.nodes[i].next_sibling) {
+      const AstNode &node = ast.nodes[i];
+      if (node.type == NODE_TEXT || node.type == NODE_ESCAPED_TEXT ||
+          node.type == NODE_IMAGE)
+        text += ast.text(node);
+      else if (node.type != NODE_FOOTNOTE_REF && node.type != NODE_CUSTOM)
+        append_text(ast, i);
+    }
+  }
+
+  // The slug, or the slug with the first free "-N" added, as GitHub does.
+  std::string_view unique_anchor(std::string slug) {
+    if (slug.empty())
+      slug = "section";
+    std::string anchor = slug;
+    while (occurrences.count(anchor))
+      anchor = slug + "-" + std::to_string(++occurrences.find(slug)->second);
+    std::string_view kept = index.keep(anchor);
+    occurrences.emplace(kept, 0);
+    return kept;
+  }
+
+  DocumentIndex &index;
+  std::string text; // Scratch for text_of
+  // Uses of each anchor, the footnote definitions and the link definitions
+  // added, in memory of their own, so that an entry allocates nothing
+  Arena memory{16 * 1024};
+  std::pmr::unordered_map<std::string_view, size_t> occurrences{&memory};
+  std::pmr::vector<Note> notes{&memory};
+  std::vector<IndexLink> note_links; // Entries in footnote definitions
+  std::vector<IndexFootnote> note_footnotes;
+  std::pmr::vector<std::pair<std::string_view, std::string_view>>
+      link_definitions;
+  DefinitionIndex definitions; // Filled by finish()
+};
+
+// Gather the index of source, rendering no HTML. Defined with the streaming
+// conversion it runs.
+inline void index_markdown(std::string_view source, DocumentIndex &index,
+                           const ConvertOptions &options = {});
+
+inline std::string convert_markdown_to_html_regex(const std::string &source,
+                                                  const ConvertOptions &options) {
+  if (options.stats)
+    record_largest_block(source, *options.stats);
+  return convert_markdown_to_html_regex(
+      source, options.rules ? *options.rules : default_inline_rules(),
+      options.stats);
+}
+
+// Convert source into out with the back-end Renderer (HtmlRenderer,
+// PlainTextRenderer or AnsiRenderer), replacing its contents. The index, if
+// asked for, is gathered from the same tree.
+template <class Renderer, unsigned F = Features::All>
+void convert_markdown(std::string_view source, std::string &out,
+                      const ConvertOptions &options = {}) {
+  MarkdownAst ast(scratch_memory(options));
+  parse_markdown<F>(source, ast, options);
+  if (options.index) {
+    PhaseTimer timer(options.stats, "index", source.size());
+    IndexBuilder builder(*options.index, options.scratch);
+    builder.add(ast);
+    builder.finish(ast.definitions);
+  }
+  PhaseTimer timer(options.stats, "render", source.size());
+  out.clear();
+  out.reserve(estimate_html_size(source.size()));
+  Renderer(out).render(ast);
+  timer.stop(out.size());
+}
+
+// Convert source into out, replacing its contents. Reusing out and giving
+// the options a scratch Arena makes repeated conversions allocation free.
+// With only some Features in F, the engine is always the scanner.
+template <unsigned F = Features::All>
+void convert_markdown_to_html(std::string_view source, std::string &out,
+                              const ConvertOptions &options = {}) {
+  if constexpr (F == Features::All) {
+    if (options.engine == INLINE_REGEX && !options.limits.active()) {
+      // The regex engine builds no tree, so the index takes a parse of its own
+      if (options.index)
+        index_markdown(source, *options.index, options);
+      out = convert_markdown_to_html_regex(std::string(source), options);
+      return;
+    }
+  }
+  convert_markdown<HtmlRenderer, F>(source, out, options);
+}
+
+inline std::string
+convert_markdown_to_html(const std::string &markdownContent,
+                         const ConvertOptions &options) {
+  if (options.engine == INLINE_REGEX && !options.limits.active() &&
+      !options.index)
+    return convert_markdown_to_html_regex(markdownContent, options);
+  std::string html;
+  convert_markdown_to_html(std::string_view(markdownContent), html, options);
+  return html;
+}
+
+inline std::string
+convert_markdown_to_html(const std::string &markdownContent,
+                         InlineEngine engine = INLINE_SCANNER) {
+  return convert_markdown_to_html(markdownContent,
+                                  ConvertOptions{.engine = engine});
+}
+
+// --- Streaming conversion ---
+
+// Receives the HTML produced by a MarkdownStream, piece by piece.
+using HtmlSink = std::function<void(std::string_view)>;
+
+// A sink that writes to a std::ostream.
+inline HtmlSink ostream_sink(std::ostream &os) {
+  return [&os](std::string_view html) {
+    os.write(html.data(), (std::streamsize)html.size());
+  };
+}
+
+// A sink that copies to an output iterator, e.g. std::back_inserter(str).
+template <class OutputIt> HtmlSink output_iterator_sink(OutputIt it) {
+  return [it](std::string_view html) mutable {
+    it = std::copy(html.begin(), html.end(), it);
+  };
+}
+
+// Converts Markdown fed in chunks of any size and hands the HTML to a sink as
+// each block is finished. Only the current partial line, the open block and
+// the definitions are held, so memory is bounded by the largest block rather
+// than the document. Tables and code blocks are not held whole either: a
+// long one goes out in pieces of a few rows or lines. The footnote section is
+// written by finish().
+//
+// The exception is a reference link to a label not yet defined: its block,
+// and every block after it, is held back until the definition turns up, or
+// to the end of the input if it never does. Documents that define their
+// links at the bottom are therefore converted whole before any output.
+//
+// Blocks go through the same MarkdownParser and HtmlRenderer as
+// convert_markdown_to_html, so the output is identical. The inline engine is
+// always the scanner. With options.index, each block is also indexed as it
+// is parsed, and with no sink it is only indexed and never rendered: then
+// lines that cannot hold an entry are skipped, and of the rest only the
+// parts of the tree the index reads are built. Footnote and link definitions
+// are then indexed where they stand rather than kept for the end.
+class MarkdownStream {
+public:
+  explicit MarkdownStream(HtmlSink sink, const ConvertOptions &options = {})
+      : sink(std::move(sink)), ast(scratch_memory(options)),
+        note(scratch_memory(options)),
+        parser(ast, options.rules ? *options.rules : default_inline_rules(),
+               scratch_memory(options), options.limits),
+        stats(options.stats), limits(options.limits),
+        links(scratch_memory(options)) {
+    ast.reset({});
+    if (options.index)
+      indexer.emplace(*options.index, options.scratch);
+    parser.set_index_only(!this->sink);
+  }
+
+  ~MarkdownStream() { finish(); }
+
+  // Push the next chunk of Markdown. Lines may be split across chunks.
+  // Throws ConvertLimitError once the input is over max_input.
+  void write(std::string_view chunk) {
+    input_size += chunk.size();
+    check_input_size(input_size, limits);
+    while (!chunk.empty()) {
+      size_t newline = chunk.find('\n');
+      if (newline == std::string_view::npos) {
+        pending.append(chunk);
+        return;
+      }
+      if (pending.empty()) {
+        // The whole line is in this chunk, no need to copy it
+        process_line(chunk.substr(0, newline));
+      } else {
+        pending.append(chunk.substr(0, newline));
+        process_line(pending);
+        pending.clear();
+      }
+      chunk.remove_prefix(newline + 1);
+    }
+    flush_output(false);
+  }
+
+  // Pass on any HTML held back to batch up small writes.
+  void flush() { flush_output(true); }
+
+  // End of input: converts the last line and open block, then writes the
+  // footnote section. Further writes are ignored.
+  void finish() {
+    if (finished)
+      return;
+    if (!pending.empty()) {
+      process_line(pending);
+      pending.clear();
+    }
+    flush_block();
+    // Whatever is still undefined stays text
+    at_end = true;
+    release_held();
+    // The definitions were kept as lines; parse them as a document of their
+    // own to produce the section
+    ast.reset(footnote_lines);
+    line_starts = std::move(footnote_starts);
+    parse_time.start(stats);
+    for_each_line(footnote_lines,
+                  [&](std::string_view line) { parser.add_line(line); });
+    parser.finish();
+    parse_time.stop(stats, footnote_lines.size(), 0);
+    flush_block();
+    flush_output(true);
+    if (indexer && sink)
+      indexer->finish(links);
+    else if (indexer)
+      indexer->finish();
+    parse_time.report(stats, "parse");
+    render_time.report(stats, "render");
+    index_time.report(stats, "index");
+    finished = true;
+  }
+
+private:
+  void process_line(std::string_view line) {
+    if (finished)
+      return;
+    size_t at = line_offset;
+    line_offset += line.size() + 1;
+    FootnoteDefinition def;
+    LinkDefinition link;
+    bool code = parser.in_code_block();
+    bool plain = !code && parser.over_long(line);
+    // Only indexing: every link, image and footnote reference starts with a
+    // '[' and every heading with a '#', so other lines have nothing to add.
+    // Those that may change how the lines after them parse, code fences and
+    // table rows, are still parsed, and so is any line while a table may be
+    // open, as the line could end it.
+    if (!sink && !code && !parser.in_table() &&
+        (plain || (index_bytes().find(line) == std::string_view::npos &&
+                   classify_line(line).kind != LINE_FENCE)))
+      return;
+    if (!code && !plain && match_link_definition(line, link)) {
+      add_link_definition(line);
+      return;
+    }
+    if (!code && !plain && match_footnote_definition(line, def)) {
+      if (!over_footnote_limit(def.number)) {
+        if (!sink) {
+          index_footnote(line, def, at);
+          return;
+        }
+        footnote_starts.emplace_back(footnote_lines.size(), at);
+        footnote_lines.append(line);
+        footnote_lines += '\n';
+        return;
+      }
+      // Plain text where it stands, as in a whole document
+      flush_block();
+      ast.reset(line);
+      line_starts.emplace_back(0, at);
+      parser.add_plain_text(line);
+      flush_block();
+      return;
+    }
+    bool continues = parser.continues_block(line);
+    if (!continues)
+      flush_block();
+    parse_time.start(stats);
+    block_bytes += line.size() + 1;
+    if (!continues && !parser.opens_block(line)) {
+      // A single line block, parse it where it is
+      ast.reset(line);
+      line_starts.emplace_back(0, at);
+      parser.add_line(line);
+      parse_time.stop(stats, line.size() + 1, 0);
+      flush_block();
+      return;
+    }
+    // A list, quote, table or code block: keep its text until it ends, as
+    // the tree refers into it
+    size_t start = block_text.size();
+    line_starts.emplace_back(start, at);
+    block_text.append(line);
+    ast.source = block_text;
+    parser.add_line(std::string_view(block_text).substr(start));
+    parse_time.stop(stats, line.size() + 1, 0);
+    // Except for a long table or code block, which goes out in pieces
+    if (block_bytes >= flush_threshold && parser.suspend_block())
+      flush_block(false);
+  }
+
+  // The bytes a line needs to have for an index only stream to parse it.
+  static const SimdScan::ByteSet &index_bytes() {
+    static const SimdScan::ByteSet bytes("[#|");
+    return bytes;
+  }
+
+  // Index a footnote definition where it stands, with no section to come.
+  void index_footnote(std::string_view line, const FootnoteDefinition &def,
+                      size_t at) {
+    if (!indexer)
+      return;
+    parse_time.start(stats);
+    parser.parse_footnote(line, def, note);
+    parse_time.stop(stats, line.size() + 1, 0);
+    if (stats)
+      record_inline_matches(note, *stats);
+    index_time.start(stats);
+    indexer->add(note, at);
+    index_time.stop(stats, line.size(), 0);
+  }
+
+  // Record a link definition, first one first, and pass on the blocks held
+  // back for it if it was the last one they needed. Only indexing, nothing is
+  // held back and the index resolves its references itself.
+  void add_link_definition(std::string_view line) {
+    auto *copy = static_cast<char *>(link_lines.allocate(line.size(), 1));
+    std::memcpy(copy, line.data(), line.size());
+    LinkDefinition link;
+    match_link_definition({copy, line.size()}, link);
+    if (!sink) {
+      if (indexer)
+        indexer->add_definition(link.label, link.url);
+      return;
+    }
+    if (!links.insert(DEFINITION_LINK, link.label, link.url, false))
+      return;
+    if (!waiting.empty() && waiting.erase(folded(link.label)) &&
+        waiting.empty())
+      release_held();
+  }
+
+  // Adds the labels of the block's references that have no definition yet
+  // to waiting, and returns true if there were any.
+  bool wait_for_definitions() {
+    bool waits = false;
+    for (const auto &node : ast.nodes) {
+      if (node.type == NODE_LINK_REF &&
+          !links.find(DEFINITION_LINK, ast.url(node))) {
+        waiting.insert(folded(ast.url(node)));
+        waits = true;
+      }
+    }
+    return waits;
+  }
+
+  static std::string folded(std::string_view label) {
+    std::string key(label);
+    for (char &c : key)
+      if (c >= 'A' && c <= 'Z')
+        c += 32;
+    return key;
+  }
+
+  // Render the blocks held back, in order, and forget what they waited for.
+  void release_held() {
+    for (const auto &block : held) {
+      render_time.start(stats);
+      size_t before = out.size();
+      HtmlRenderer(out, &links).render(block.ast);
+      render_time.stop(stats, block.source.size(), out.size() - before);
+      flush_output(false);
+    }
+    held.clear();
+    waiting.clear();
+  }
+
+  // True if a definition of number would be one too many for max_footnotes.
+  bool over_footnote_limit(std::string_view number) {
+    if (!limits.max_footnotes)
+      return false;
+    if (footnote_numbers.count(std::string(number)))
+      return false;
+    if (footnote_numbers.size() >= limits.max_footnotes)
+      return true;
+    footnote_numbers.emplace(number);
+    return false;
+  }
+
+  // The offset in the input of an offset in the tree's source.
+  size_t input_offset(size_t offset) const {
+    auto line = std::upper_bound(
+        line_starts.begin(), line_starts.end(), offset,
+        [](size_t off, const auto &start) { return off < start.first; });
+    if (line == line_starts.begin())
+      return offset;
+    --line;
+    return line->second + (offset - line->first);
+  }
+
+  // Index and render whatever the tree holds and empty it. With close false
+  // the parser's suspended block carries on in the emptied tree.
+  void flush_block(bool close = true) {
+    if (ast.nodes.size() > 1 && stats) {
+      record_inline_matches(ast, *stats);
+      stats->largest_block = std::max(stats->largest_block, block_bytes);
+    }
+    if (ast.nodes.size() > 1 && indexer) {
+      index_time.start(stats);
+      indexer->add(ast, [this](size_t offset) { return input_offset(offset); });
+      index_time.stop(stats, ast.source.size(), 0);
+    }
+    line_starts.clear();
+    if (!sink) {
+      // Only indexing
+    } else if (ast.nodes.size() > 1 && !at_end &&
+               (wait_for_definitions() || !held.empty())) {
+      // Node offsets are relative to the source, so a copy of both stays
+      // valid
+      HeldBlock &block = held.emplace_back();
+      block.source = ast.source;
+      block.ast.nodes.assign(ast.nodes.begin(), ast.nodes.end());
+      block.ast.replacements = ast.replacements;
+      block.ast.source = block.source;
+    } else if (ast.nodes.size() > 1) {
+      render_time.start(stats);
+      size_t before = out.size();
+      HtmlRenderer(out, &links).render(ast);
+      render_time.stop(stats, ast.source.size(), out.size() - before);
+      flush_output(false);
+    }
+    ast.reset({});
+    block_text.clear();
+    block_bytes = 0;
+    if (close)
+      parser.close_blocks();
+    else
+      parser.resume_block();
+  }
+
+  void flush_output(bool force) {
+    if (!sink || out.empty() || (!force && out.size() < flush_threshold))
+      return;
+    sink(out);
+    out.clear();
+  }
+
+  // Output is passed to the sink in pieces of about this size.
+  static constexpr size_t flush_threshold = 16 * 1024;
+
+  // A block waiting for a link definition, with its own copy of the source.
+  struct HeldBlock {
+    std::string source;
+    MarkdownAst ast;
+  };
+
+  HtmlSink sink;
+  MarkdownAst ast;  // The block being converted
+  MarkdownAst note; // A footnote definition, when only indexing
+  MarkdownParser parser;
+  std::string pending;        // Partial line carried over between chunks
+  std::string block_text;     // Source of a multi-line block
+  std::string footnote_lines; // Footnote definitions, until finish()
+  std::string out;            // HTML not yet passed to the sink
+  bool finished = false;
+  ConvertStats *stats;
+  size_t block_bytes = 0; // Source of the open block, newlines included
+  ConvertLimits limits;
+  size_t input_size = 0;
+  std::unordered_set<std::string> footnote_numbers; // Only for max_footnotes
+  DefinitionIndex links;               // Link definitions so far
+  Arena link_lines{16 * 1024};         // The lines they point into
+  std::deque<HeldBlock> held;          // Blocks waiting for definitions
+  std::unordered_set<std::string> waiting; // Their labels, lower case
+  bool at_end = false;                 // No more definitions will come
+  std::optional<IndexBuilder> indexer; // With options.index
+  size_t line_offset = 0;              // In the input, of the next line
+  // Where the lines of the tree, and of the footnote definitions, start in
+  // their source and in the input
+  std::vector<std::pair<size_t, size_t>> line_starts;
+  std::vector<std::pair<size_t, size_t>> footnote_starts;
+  PhaseTotal parse_time;
+  PhaseTotal render_time;
+  PhaseTotal index_time;
+};
+
+inline void index_markdown(std::string_view source, DocumentIndex &index,
+                           const ConvertOptions &options) {
+  ConvertOptions index_options = options;
+  index_options.index = &index;
+  MarkdownStream stream(nullptr, index_options);
+  stream.write(source);
+  stream.finish();
+}
+
+// Pull variant: reads Markdown from in until it is exhausted.
+inline void convert_markdown_stream(std::istream &in, HtmlSink sink,
+                                    const ConvertOptions &options = {}) {
+  MarkdownStream stream(std::move(sink), options);
+  std::vector<char> buffer(64 * 1024);
+  while (in) {
+    in.read(buffer.data(), (std::streamsize)buffer.size());
+    stream.write(std::string_view(buffer.data(), (size_t)in.gcount()));
+  }
+  stream.finish();
+}
+
+inline void convert_markdown_stream(std::istream &in, std::ostream &out,
+                                    const ConvertOptions &options = {}) {
+  convert_markdown_stream(in, ostream_sink(out), options);
+}
+
+// --- Parallel conversion ---
+
+// Converts source on pool, piece_size bytes or so per task, passing the HTML
+// to sink in document order. The link definitions of every piece are
+// gathered first, as a reference may come before its definition. The
+// footnote definitions of every piece are merged and the section is written
+// last, so the output is identical to convert_markdown_to_html. Pieces are
+// converted a batch at a time, so only a few per worker are held in memory at
+// once. The regex engine has no parallel form and converts the whole
+// document serially, as does max_footnotes, which needs the definitions
+// counted in document order.
+inline void convert_markdown_parallel(std::string_view source, HtmlSink sink,
+                                      ThreadPool &pool,
+                                      const ConvertOptions &options = {},
+                                      size_t piece_size = 1 << 20) {
+  check_input_size(source.size(), options.limits);
+  if ((options.engine == INLINE_REGEX && !options.limits.active()) ||
+      options.limits.max_footnotes) {
+    sink(convert_markdown_to_html(std::string(source), options));
+    return;
+  }
+  const InlineRuleTable &rules =
+      options.rules ? *options.rules : default_inline_rules();
+
+  using Definition = std::pair<std::string_view, std::string_view>;
+  struct Piece {
+    std::string_view source;
+    std::string html;
+    std::vector<Definition> footnotes;
+    ConvertStats stats; // Merged into options.stats in document order
+  };
+  std::vector<std::string_view> sources =
+      split_markdown_blocks(source, piece_size, options.limits.max_line);
+
+  // Lines past max_line are plain text, and lines of code blocks are code,
+  // not definitions
+  std::vector<std::vector<LinkDefinition>> piece_links(sources.size());
+  for (size_t i = 0; i < sources.size(); ++i)
+    pool.submit([&, i] {
+      FenceTracker fences(options.limits.max_line);
+      for_each_line(sources[i], [&](std::string_view line) {
+        LinkDefinition link;
+        if (!fences.add(line) &&
+            (!options.limits.max_line ||
+             line.size() <= options.limits.max_line) &&
+            match_link_definition(line, link))
+          piece_links[i].push_back(link);
+      });
+    });
+  pool.wait();
+  DefinitionIndex definitions;
+  for (const auto &links : piece_links)
+    for (const auto &link : links)
+      definitions.insert(DEFINITION_LINK, link.label, link.url, false);
+  piece_links.clear();
+
+  std::vector<Piece> batch(pool.size() * 4);
+
+  for (size_t first = 0; first < sources.size(); first += batch.size()) {
+    size_t count = std::min(batch.size(), sources.size() - first);
+    for (size_t i = 0; i < count; ++i) {
+      Piece &piece = batch[i];
+      piece.source = sources[first + i];
+      ConvertStats *stats = nullptr;
+      if (options.stats) {
+        piece.stats = {};
+        piece.stats.allocation_count = options.stats->allocation_count;
+        stats = &piece.stats;
+      }
+      pool.submit([&piece, &rules, &options, &definitions, stats] {
+        PhaseTimer parse_timer(stats, "parse piece", piece.source.size());
+        MarkdownAst ast;
+        ast.reset(piece.source);
+        ast.nodes.reserve(piece.source.size() / 16 + 1);
+        MarkdownParser parser(ast, rules, std::pmr::get_default_resource(),
+                              options.limits);
+        for_each_line(piece.source,
+                      [&](std::string_view line) { parser.add_line(line); });
+        piece.footnotes.clear();
+        ast.definitions.for_each(DEFINITION_FOOTNOTE,
+                                 [&](std::string_view number,
+                                     std::string_view content) {
+                                   piece.footnotes.emplace_back(number,
+                                                                content);
+                                 });
+        parse_timer.stop(ast.nodes.size() * sizeof(AstNode));
+        if (stats)
+          record_tree(ast, *stats);
+        PhaseTimer render_timer(stats, "render piece", piece.source.size());
+        piece.html.clear();
+        piece.html.reserve(estimate_html_size(piece.source.size()));
+        HtmlRenderer(piece.html, &definitions).render(ast);
+        render_timer.stop(piece.html.size());
+      });
+    }
+    pool.wait();
+    for (size_t i = 0; i < count; ++i) {
+      if (options.stats)
+        options.stats->merge(batch[i].stats);
+      sink(batch[i].html);
+      // In document order, so a repeated number keeps its last definition
+      for (const auto &[number, content] : batch[i].footnotes)
+        definitions.insert(DEFINITION_FOOTNOTE, number, content, true);
+      batch[i].footnotes.clear();
+    }
+  }
+
+  if (!definitions.size(DEFINITION_FOOTNOTE))
+    return;
+  PhaseTimer timer(options.stats, "footnotes", 0);
+  MarkdownAst ast;
+  ast.reset(source);
+  MarkdownParser parser(ast, rules, std::pmr::get_default_resource(),
+                        options.limits);
+  definitions.for_each(DEFINITION_FOOTNOTE, [&](std::string_view number,
+                                                std::string_view content) {
+    ast.definitions.insert(DEFINITION_FOOTNOTE, number, content, true);
+  });
+  parser.finish();
+  std::string html;
+  HtmlRenderer(html, &definitions).render(ast);
+  timer.stop(html.size());
+  if (options.stats)
+    record_inline_matches(ast, *options.stats);
+  sink(html);
+}
+
+inline std::string convert_markdown_parallel(const std::string &markdownContent,
+                                             ThreadPool &pool,
+                                             const ConvertOptions &options = {},
+                                             size_t piece_size = 1 << 20) {
+  std::string out;
+  out.reserve(estimate_html_size(markdownContent.size()));
+  convert_markdown_parallel(markdownContent,
+                            output_iterator_sink(std::back_inserter(out)), pool,
+                            options, piece_size);
+  return out;
+}
+
+// --- Incremental conversion ---
+
+// What an edit changed, for patching a rendered page rather than replacing
+// it: blocks first to first + removed are replaced by the inserted HTML. The
+// views point into the Document and are valid until its next edit.
+struct DocumentPatch {
+  size_t first = 0;
+  size_t removed = 0;
+  std::vector<std::string_view> inserted;
+  bool footnotes_changed = false; // See Document::footnotes_html()
+};
+
+// A document kept open for editing, e.g. behind a live preview. The text is
+// held as blocks that split at block boundaries, so each converts on its own.
+// An edit re-splits only the text around it, up to the first boundary past
+// the edit that was already there, and converts only the blocks it produced.
+// Converted blocks are cached by their text, so a block that reappears (an
+// undo, a paste) is not converted again. The footnote definitions of every
+// block are merged and the section rendered again when they change, so
+// html() is always identical to convert_markdown_to_html(text()). So are
+// the link definitions, and when they change every block with a reference
+// link is rendered again; the patch then spans the blocks that changed.
+//
+// The inline engine is always the scanner.
+class Document {
+public:
+  explicit Document(std::string text = {}, const ConvertOptions &options = {})
+      : rules(options.rules ? options.rules : &default_inline_rules()) {
+    edit(0, 0, text);
+  }
+
+  // Replace length bytes at offset with replacement, as std::string::replace
+  // does, and return the blocks that changed.
+  DocumentPatch edit(size_t offset, size_t length,
+                     std::string_view replacement) {
+    length = std::min(length, source.size() - std::min(offset, source.size()));
+    source.replace(offset, length, replacement);
+    auto delta = (ptrdiff_t)replacement.size() - (ptrdiff_t)length;
+    size_t edit_end = offset + replacement.size();
+
+    // Start a block early: the edit may remove the boundary at the start of
+    // the block it is in
+    size_t first = block_at(offset);
+    if (first > 0)
+      --first;
+    size_t pos = first < blocks.size() ? blocks[first].offset : 0;
+
+    // Split the new text into blocks until a boundary whose lines are both
+    // past the edit, where the old blocks take over again
+    std::vector<Block> added;
+    size_t resume = blocks.size();
+    FenceTracker fences; // Blocks start outside code blocks
+    while (pos < source.size()) {
+      size_t line = pos; // The last line of the block
+      size_t end = source.size();
+      while (true) {
+        size_t next = source.find('\n', line);
+        if (next == std::string::npos)
+          break;
+        fences.add(std::string_view(source).substr(line, next - line));
+        if (++next >= source.size())
+          break;
+        if (is_block_boundary(source, next, fences.in_code())) {
+          end = next;
+          break;
+        }
+        line = next;
+      }
+      added.push_back(make_block(pos, end));
+      pos = end;
+      if (end < source.size() && line > edit_end) {
+        size_t old = block_at(end - delta);
+        if (old < blocks.size() && blocks[old].offset == end - delta) {
+          resume = old;
+          break;
+        }
+      }
+    }
+
+    DocumentPatch patch;
+    bool links_changed = false;
+    for (size_t i = first; i < resume; ++i) {
+      patch.footnotes_changed |= !blocks[i].entry->second.footnotes.empty();
+      links_changed |= !blocks[i].entry->second.links.empty();
+    }
+    for (const auto &block : added) {
+      patch.footnotes_changed |= !block.entry->second.footnotes.empty();
+      links_changed |= !block.entry->second.links.empty();
+    }
+    // A block that came back the same is not part of the patch
+    size_t same = 0;
+    while (same < added.size() && first + same < resume &&
+           added[same].entry == blocks[first + same].entry)
+      ++same;
+
+    for (size_t i = first; i < resume; ++i)
+      release(blocks[i]);
+    for (size_t i = resume; i < blocks.size(); ++i)
+      blocks[i].offset += delta;
+    blocks.erase(blocks.begin() + (ptrdiff_t)first,
+                 blocks.begin() + (ptrdiff_t)resume);
+    blocks.insert(blocks.begin() + (ptrdiff_t)first, added.begin(),
+                  added.end());
+
+    // The blocks that changed, in the new numbering
+    size_t changed_first = first + same;
+    size_t changed_end = first + added.size();
+    if (links_changed) {
+      index_links();
+      std::unordered_set<const Cache::value_type *> rendered;
+      for (auto &entry : cache)
+        if (entry.second.references && rerender(entry))
+          rendered.insert(&entry);
+      for (size_t i = 0; i < blocks.size(); ++i) {
+        if (rendered.count(blocks[i].entry)) {
+          changed_first = std::min(changed_first, i);
+          changed_end = std::max(changed_end, i + 1);
+        }
+      }
+      patch.footnotes_changed = true;
+    }
+
+    patch.first = changed_first;
+    patch.removed =
+        changed_end - changed_first + (resume - first) - added.size();
+    for (size_t i = changed_first; i < changed_end; ++i)
+      patch.inserted.push_back(blocks[i].entry->second.html);
+    if (patch.footnotes_changed)
+      render_footnotes();
+    return patch;
+  }
+
+  const std::string &text() const { return source; }
+
+  size_t block_count() const { return blocks.size(); }
+  std::string_view block_html(size_t index) const {
+    return blocks[index].entry->second.html;
+  }
+  // The footnote section, empty if there are no definitions.
+  const std::string &footnotes_html() const { return footnotes; }
+
+  // The whole document as HTML.
+  std::string html() const {
+    std::string out;
+    for (const auto &block : blocks)
+      out += block.entry->second.html;
+    out += footnotes;
+    return out;
+  }
+
+private:
+  struct Converted {
+    std::string html;
+    std::string footnotes;   // The block's footnote definition lines
+    std::string links;       // and link definition lines
+    bool references = false; // True if it has a reference link
+    size_t uses = 0;         // Blocks holding this entry
+  };
+  using Cache = std::unordered_map<std::string, Converted>;
+
+  struct Block {
+    size_t offset = 0;
+    Cache::value_type *entry = nullptr;
+  };
+
+  // The block holding offset: the last one starting at or before it.
+  size_t block_at(size_t offset) const {
+    auto it = std::upper_bound(
+        blocks.begin(), blocks.end(), offset,
+        [](size_t off, const Block &block) { return off < block.offset; });
+    return it == blocks.begin() ? 0 : (size_t)(it - blocks.begin()) - 1;
+  }
+
+  Block make_block(size_t begin, size_t end) {
+    auto [it, added] =
+        cache.try_emplace(source.substr(begin, end - begin), Converted{});
+    if (added)
+      convert(it->first, it->second);
+    ++it->second.uses;
+    return {.offset = begin, .entry = &*it};
+  }
+
+  void release(const Block &block) {
+    if (--block.entry->second.uses == 0) {
+      std::string key = block.entry->first;
+      cache.erase(key);
+    }
+  }
+
+  void convert(std::string_view text, Converted &converted) {
+    ast.reset(text);
+    MarkdownParser parser(ast, *rules);
+    for_each_line(text, [&](std::string_view line) {
+      FootnoteDefinition def;
+      LinkDefinition link;
+      if (parser.in_code_block()) {
+        // Code, not a definition
+      } else if (match_footnote_definition(line, def)) {
+        converted.footnotes.append(line);
+        converted.footnotes += '\n';
+      } else if (match_link_definition(line, link)) {
+        converted.links.append(line);
+        converted.links += '\n';
+      }
+      parser.add_line(line);
+    });
+    converted.references = std::any_of(
+        ast.nodes.begin(), ast.nodes.end(),
+        [](const AstNode &node) { return node.type == NODE_LINK_REF; });
+    HtmlRenderer(converted.html, &links).render(ast);
+  }
+
+  // Render an entry again with the current link definitions; returns true
+  // if its HTML changed.
+  bool rerender(Cache::value_type &entry) {
+    ast.reset(entry.first);
+    MarkdownParser parser(ast, *rules);
+    for_each_line(entry.first,
+                  [&](std::string_view line) { parser.add_line(line); });
+    std::string html;
+    HtmlRenderer(html, &links).render(ast);
+    if (html == entry.second.html)
+      return false;
+    entry.second.html = std::move(html);
+    return true;
+  }
+
+  // Gather the link definitions of every block, first one first.
+  void index_links() {
+    links.clear();
+    for (const auto &block : blocks)
+      for_each_line(block.entry->second.links, [&](std::string_view line) {
+        LinkDefinition link;
+        if (match_link_definition(line, link))
+          links.insert(DEFINITION_LINK, link.label, link.url, false);
+      });
+  }
+
+  // The definitions were kept as lines; parse them, in document order, as a
+  // document of their own to produce the section.
+  void render_footnotes() {
+    std::string lines;
+    for (const auto &block : blocks)
+      lines += block.entry->second.footnotes;
+    ast.reset(lines);
+    MarkdownParser parser(ast, *rules);
+    for_each_line(lines, [&](std::string_view line) { parser.add_line(line); });
+    parser.finish();
+    footnotes.clear();
+    HtmlRenderer(footnotes, &links).render(ast);
+  }
+
+  const InlineRuleTable *rules;
+  std::string source;
+  std::vector<Block> blocks;
+  Cache cache;
+  std::string footnotes; // HTML of the footnote section
+  DefinitionIndex links; // Of every block, pointing into Converted::links
+  MarkdownAst ast;       // Reused for each conversion
+};
+
+// --- Reusable converter ---
+
+// Everything a conversion needs, kept from one call to the next: the inline
+// rules, scratch memory and the output buffer. After its first few documents
+// a Converter makes no allocations, which suits a service converting one
+// request after another. Not thread safe; give each thread its own.
+//
+// Converter<> understands all the syntax. A converter for less, such as
+// Converter<Features::Headings | Features::Lists | Features::Links>, has the
+// rest compiled out and writes it as plain text.
+template <unsigned F = Features::All> class Converter {
+public:
+  explicit Converter(const ConvertOptions &options = {}) : options(options) {
+    this->options.scratch = &arena;
+  }
+
+  Converter(const Converter &) = delete;
+  Converter &operator=(const Converter &) = delete;
+
+  // Register a custom inline rule, as InlineRuleTable::add_rule. The first
+  // one gives the converter its own copy of the rules it was made with.
+  void add_rule(char trigger, const std::string &pattern,
+                std::function<std::string(const std::cmatch &)> formatter) {
+    if (!own_rules) {
+      own_rules = std::make_unique<InlineRuleTable>(
+          options.rules ? *options.rules : default_inline_rules());
+      options.rules = own_rules.get();
+    }
+    own_rules->add_rule(trigger, pattern, std::move(formatter));
+  }
+
+  // Convert markdown. The view stays valid until the next convert() or
+  // reset().
+  std::string_view convert(std::string_view markdown) {
+    reset();
+    convert_markdown_to_html<F>(markdown, out, options);
+    return out;
+  }
+
+  // Drop the last output and scratch data, keeping the memory for reuse.
+  void reset() {
+    out.clear();
+    arena.reset();
+  }
+
+  // Record timings into stats from now on; nullptr stops recording.
+  void set_stats(ConvertStats *stats) { options.stats = stats; }
+
+private:
+  ConvertOptions options;
+  std::unique_ptr<InlineRuleTable> own_rules;
+  Arena arena;
+  std::string out;
+};
@@ -3,38 +3,853 @@
 //
 #include "libmain.h"
 #include "markdown.h"
+#include "output_cache.h"
+#include "pipeline_io.h"
 #include "read_lines.h"
+#include "serve.h"
+#include "thread_pool.h"
+#include "watch.h"
+#include <atomic>
 #include <complex>
+#include <csignal>
+#include <filesystem>
+#include <cstdlib>
+#include <fcntl.h>
+#include <glob.h>
 #include <map>
+#include <mutex>
+#include <new>
+#include <pthread.h>
+#include <set>
+#include <sstream>
+#include <sys/stat.h>
+
+namespace fs = std::filesystem;
+
+// --- Instrumentation ---
+
+#ifdef MDC_COUNT_ALLOCATIONS
+// Allocations made by each thread, read around each phase for --stats and
+// --trace. Per thread, so counting needs no synchronisation.
+thread_local size_t thread_allocations = 0;
+
+size_t count_allocations() { return thread_allocations; }
+
+void *operator new(size_t size) {
+  ++thread_allocations;
+  if (void *p = std::malloc(size ? size : 1))
+    return p;
+  throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+
+constexpr size_t (*allocation_count)() = count_allocations;
+#else
+// Built without the counting, mdc keeps the standard operator new and the
+// stats leave allocations out.
+constexpr size_t (*allocation_count)() = nullptr;
+#endif
+
+// The stats of every conversion in a run, with the file each came from.
+struct RunStats {
+  std::mutex lock;
+  std::vector<std::pair<std::string, ConvertStats>> files;
+
+  void add(const std::string &file, const ConvertStats &stats) {
+    std::lock_guard<std::mutex> guard(lock);
+    files.emplace_back(file, stats);
+  }
+};
+
+// Totals per phase, the inline rule matches and the largest block.
+void print_stats(const RunStats &run, std::ostream &out) {
+  struct Total {
+    size_t calls = 0;
+    uint64_t ns = 0;
+    size_t bytes_in = 0, bytes_out = 0, allocations = 0;
+  };
+  std::vector<std::pair<std::string, Total>> phases; // In first-seen order
+  ConvertStats all;
+  for (const auto &[file, stats] : run.files) {
+    all.merge(stats);
+    for (const auto &phase : stats.phases) {
+      auto it = std::find_if(phases.begin(), phases.end(),
+                             [&](auto &p) { return p.first == phase.name; });
+      if (it == phases.end())
+        it = phases.insert(phases.end(), {phase.name, {}});
+      it->second.calls++;
+      it->second.ns += phase.duration_ns;
+      it->second.bytes_in += phase.bytes_in;
+      it->second.bytes_out += phase.bytes_out;
+      it->second.allocations += phase.allocations;
+    }
+  }
+  char line[256];
+  std::snprintf(line, sizeof(line), "mdc: %-20s %7s %10s %10s %10s",
+                "phase", "calls", "ms", "MB in", "MB out");
+  out << line << (allocation_count ? "  allocations\n" : "\n");
+  for (const auto &[name, t] : phases) {
+    std::snprintf(line, sizeof(line), "mdc: %-20s %7zu %10.2f %10.2f %10.2f",
+                  name.c_str(), t.calls, t.ns / 1e6, t.bytes_in / 1e6,
+                  t.bytes_out / 1e6);
+    out << line;
+    if (allocation_count) {
+      std::snprintf(line, sizeof(line), " %12zu", t.allocations);
+      out << line;
+    }
+    out << "\n";
+  }
+  out << "mdc: rule matches:";
+  for (const auto &[rule, count] : all.rule_matches)
+    out << " " << rule << " " << count;
+  out << "\nmdc: largest block: " << all.largest_block << " bytes in "
+      << run.files.size() << " files\n";
+}
+
+std::string json_escape(std::string_view text) {
+  std::string out;
+  append_escaped(out, text, ESCAPE_JSON);
+  return out;
+}
+
+// Write every phase as a Chrome trace event ("X", complete events), which
+// chrome://tracing and Perfetto can open.
+bool write_trace(const RunStats &run, const fs::path &path) {
+  std::ofstream out(path);
+  uint64_t epoch = UINT64_MAX;
+  for (const auto &[file, stats] : run.files)
+    for (const auto &phase : stats.phases)
+      epoch = std::min(epoch, phase.start_ns);
+  std::map<size_t, size_t> thread_ids;
+  out << "{\"traceEvents\": [\n";
+  bool first = true;
+  for (const auto &[file, stats] : run.files) {
+    for (const auto &phase : stats.phases) {
+      size_t tid = thread_ids.emplace(phase.thread, thread_ids.size() + 1)
+                       .first->second;
+      char event[512];
+      std::snprintf(event, sizeof(event),
+                    "%s{\"name\": \"%s\", \"cat\": \"mdc\", \"ph\": \"X\", "
+                    "\"ts\": %.3f, \"dur\": %.3f, \"pid\": 1, \"tid\": %zu, "
+                    "\"args\": {\"bytes_in\": %zu, \"bytes_out\": %zu, ",
+                    first ? "" : ",\n", phase.name,
+                    (phase.start_ns - epoch) / 1e3, phase.duration_ns / 1e3,
+                    tid, phase.bytes_in, phase.bytes_out);
+      out << event;
+      if (allocation_count)
+        out << "\"allocations\": " << phase.allocations << ", ";
+      out << "\"file\": \"" << json_escape(file) << "\"}}";
+      first = false;
+    }
+  }
+  out << "\n]}\n";
+  return (bool)out;
+}
 
 void print_help() {
   std::cout << "mdc -i markdown.md > out.html" << std::endl;
+  std::cout << "mdc -o out_dir [-j threads] inputs..." << std::endl;
+  std::cout << "mdc --serve [--socket path] [-j threads]" << std::endl;
+  std::cout << "mdc --watch dir --out out_dir [-j threads] [--debounce ms]"
+            << std::endl;
+  std::cout << "  -i -       read the markdown from stdin" << std::endl;
+  std::cout << "  -o dir     convert every input into dir; inputs may be files,"
+            << std::endl;
+  std::cout << "             directories (searched for .md files) or globs"
+            << std::endl;
+  std::cout << "  -j n       number of worker threads (default: all cores);"
+            << std::endl;
+  std::cout << "             with -i, splits the one file across n threads"
+            << std::endl;
+  std::cout << "  --regex    use the original regex inline engine, which does not "
+               "escape HTML"
+            << std::endl;
+  std::cout << "  --cache-dir dir" << std::endl;
+  std::cout << "             reuse earlier output for unchanged inputs"
+            << std::endl;
+  std::cout << "  --cache-size mb" << std::endl;
+  std::cout << "             cap on the cache, least recently used entries go "
+               "first (default: 1024)"
+            << std::endl;
+  std::cout << "  --stats    print time per phase, inline rule matches and "
+               "cache hits to stderr"
+            << std::endl;
+  std::cout << "  --trace file.json" << std::endl;
+  std::cout << "             write every phase as a Chrome trace event"
+            << std::endl;
+  std::cout << "  --linear   guarantee time linear in the input: scanner "
+               "engine, no custom rules"
+            << std::endl;
+  std::cout << "  --max-input bytes, --max-line bytes, --max-nesting depth, "
+               "--max-footnotes n"
+            << std::endl;
+  std::cout << "             refuse larger input; write longer lines, deeper "
+               "markup and"
+            << std::endl;
+  std::cout << "             further footnotes as plain text" << std::endl;
+  std::cout << "  --index file.json" << std::endl;
+  std::cout << "             with -i, also write the headings, links, images "
+               "and footnote"
+            << std::endl;
+  std::cout << "             references as JSON; - writes it to stdout"
+            << std::endl;
+  std::cout << "  --index-only" << std::endl;
+  std::cout << "             write the index and no HTML" << std::endl;
+  std::cout << "  --to text|ansi" << std::endl;
+  std::cout << "             with -i, write plain text, or text styled for a "
+               "terminal,"
+            << std::endl;
+  std::cout << "             instead of HTML" << std::endl;
+  std::cout << "  --serve    convert length-prefixed requests from stdin to "
+               "stdout, or"
+            << std::endl;
+  std::cout << "             with --socket, from clients of a Unix socket"
+            << std::endl;
+  std::cout << "  --watch dir" << std::endl;
+  std::cout << "             convert the .md files under dir into --out, then "
+               "convert each"
+            << std::endl;
+  std::cout << "             again as it changes, until interrupted. Changes "
+               "within"
+            << std::endl;
+  std::cout << "             --debounce ms (default: 50) of each other are "
+               "taken together"
+            << std::endl;
+}
+
+// Everything besides the input that the output depends on, for cache keys.
+std::string cache_settings(const ConvertOptions &options) {
+  const ConvertLimits &limits = options.limits;
+  std::string settings =
+      "mdc " + std::to_string(markdown_converter_version) +
+      (options.engine == INLINE_REGEX && !limits.active() ? " regex"
+                                                          : " scanner");
+  if (limits.active())
+    settings += " limits " + std::to_string(limits.linear) + " " +
+                std::to_string(limits.max_input) + " " +
+                std::to_string(limits.max_line) + " " +
+                std::to_string(limits.max_nesting) + " " +
+                std::to_string(limits.max_footnotes);
+  return settings;
+}
+
+void print_cache_stats(const OutputCache &cache) {
+  std::cerr << "mdc: cache: " << cache.stats.hits << " hits, "
+            << cache.stats.misses << " misses, " << cache.stats.bytes_saved
+            << " bytes of Markdown not converted, " << cache.stats.evicted
+            << " entries evicted\n";
+}
+
+// The basic HTML boilerplate around the converted Markdown
+constexpr std::string_view page_header = "<!DOCTYPE html>\n"
+                                         "<html>\n"
+                                         "<head>\n"
+                                         "    <title>Converted Markdown</title>\n"
+                                         "</head>\n"
+                                         "<body>\n";
+constexpr std::string_view page_footer = "</body>\n"
+                                         "</html>\n";
+
+// Write a full HTML page for the Markdown text to out. Given a pool, the
+// document is split up and converted on it.
+void write_html_page(std::ostream &out, TextFileParser::MappedFile &markdown,
+                     const ConvertOptions &options,
+                     ThreadPool *pool = nullptr) {
+  std::string_view text = markdown.text();
+  out << page_header;
+
+  // Convert the Markdown content, writing it out as it is produced. The regex
+  // engine only works on whole documents, and the index is gathered as the
+  // document streams through.
+  if (options.engine == INLINE_REGEX) {
+    out << convert_markdown_to_html(std::string(text), options);
+  } else if (pool && !options.index) {
+    convert_markdown_parallel(text, ostream_sink(out), *pool, options);
+  } else {
+    // Feed the mapping a window at a time, letting go of the pages behind.
+    // Batch workers convert one file after another, so each keeps its
+    // scratch memory from one to the next.
+    thread_local Arena arena;
+    arena.reset();
+    ConvertOptions stream_options = options;
+    stream_options.scratch = &arena;
+    MarkdownStream stream(ostream_sink(out), stream_options);
+    constexpr size_t window = 8 << 20;
+    for (size_t pos = 0; pos < text.size(); pos += window) {
+      stream.write(text.substr(pos, window));
+      markdown.release(pos + window);
+    }
+    stream.finish();
+  }
+  out << page_footer;
+}
+
+// Convert the Markdown on in_fd to a page on out_fd with reading, converting
+// and writing each on a thread of their own, overlapped. The writer is
+// flushed whenever the input runs dry, so a slow pipe gets each block as
+// soon as it is converted. Adds the read and write phases to the stats.
+// Exits on an error, as the reader may be blocked on input that never ends.
+void write_html_page_pipelined(int in_fd, int out_fd,
+                               const ConvertOptions &options) {
+  Pipeline::Writer writer(out_fd);
+  Pipeline::Reader reader(in_fd);
+  auto fail = [](const std::string &what) {
+    std::cerr << "mdc: " << what << "\n";
+    std::exit(1);
+  };
+  writer.append(page_header);
+  try {
+    MarkdownStream stream(
+        [&writer](std::string_view html) { writer.append(html); }, options);
+    while (true) {
+      if (!reader.ready())
+        writer.flush();
+      std::string_view chunk = reader.next();
+      if (chunk.empty())
+        break;
+      stream.write(chunk);
+    }
+    stream.finish();
+  } catch (const std::exception &e) {
+    fail(e.what());
+  }
+  if (reader.error())
+    fail(std::string("could not read the input: ") +
+         std::strerror(reader.error()));
+  writer.append(page_footer);
+  if (!writer.finish())
+    fail(std::string("could not write the output: ") +
+         std::strerror(writer.error()));
+
+  if (options.stats) {
+    const Pipeline::IoStats &read = reader.stats(), &write = writer.stats();
+    for (auto [name, io] : {std::pair{"read", read}, std::pair{"write", write}})
+      options.stats->phases.push_back({.name = name,
+                                       .start_ns = io.start_ns,
+                                       .duration_ns = io.busy_ns,
+                                       .bytes_in = io.bytes,
+                                       .bytes_out = io.bytes,
+                                       .thread = io.thread});
+  }
+}
+
+// What single file mode writes besides HTML, from the same parse.
+enum OutputFormat { FORMAT_HTML, FORMAT_TEXT, FORMAT_ANSI };
+
+// Write the Markdown text as plain text or styled for a terminal. The
+// renderers take a whole tree, so the document is parsed before anything is
+// written.
+void write_rendered(std::ostream &out, std::string_view text,
+                    OutputFormat format, const ConvertOptions &options) {
+  Arena arena;
+  ConvertOptions render_options = options;
+  render_options.scratch = &arena;
+  std::string rendered;
+  if (format == FORMAT_TEXT)
+    convert_markdown<PlainTextRenderer>(text, rendered, render_options);
+  else
+    convert_markdown<AnsiRenderer>(text, rendered, render_options);
+  out.write(rendered.data(), (std::streamsize)rendered.size());
+}
+
+// --- Server mode ---
+
+// Converts requests on a pool until stdin ends, or for ever on a socket. Each
+// worker thread keeps a Converter, so requests reuse its memory. With
+// show_stats the latencies are printed at the end, or when SIGINT or SIGTERM
+// stops the server.
+bool run_server(const std::string &socket_path, size_t threads,
+                const ConvertOptions &options, bool show_stats) {
+  // The signals go to a thread of their own, so they are blocked before any
+  // other thread starts
+  sigset_t stop_signals;
+  sigemptyset(&stop_signals);
+  sigaddset(&stop_signals, SIGINT);
+  sigaddset(&stop_signals, SIGTERM);
+  if (show_stats)
+    pthread_sigmask(SIG_BLOCK, &stop_signals, nullptr);
+  ThreadPool pool(threads ? threads : std::thread::hardware_concurrency());
+  Serve::Server server(pool, [&options](std::string_view request,
+                                        std::string &response) {
+    thread_local Converter converter(options);
+    response.assign(converter.convert(request));
+    return true;
+  });
+  auto print_stats = [&server] {
+    std::cerr << "mdc: latency " << server.latency().json() << "\n";
+  };
+  std::atomic<bool> done{false};
+  std::thread stopper;
+  if (show_stats)
+    stopper = std::thread([&] {
+      int signal = 0;
+      sigwait(&stop_signals, &signal);
+      if (done)
+        return;
+      print_stats();
+      std::_Exit(0);
+    });
+  bool ok = true;
+  if (socket_path.empty()) {
+    server.serve(STDIN_FILENO, STDOUT_FILENO);
+  } else {
+    std::string error;
+    ok = server.listen_unix(socket_path, error);
+    std::cerr << "mdc: " << socket_path << ": " << error << "\n";
+  }
+  if (show_stats) {
+    done = true;
+    pthread_kill(stopper.native_handle(), SIGTERM); // Wake it to return
+    stopper.join();
+    print_stats();
+  }
+  return ok;
+}
+
+// --- Batch mode ---
+
+struct BatchJob {
+  fs::path input;
+  fs::path output;
+  uintmax_t size = 0;
+};
+
+bool is_markdown_file(const fs::path &path) {
+  auto ext = path.extension();
+  return ext == ".md" || ext == ".markdown";
+}
+
+// Expand the inputs into jobs. Directories are searched recursively and keep
+// their layout under out_dir; files and glob matches go straight into it.
+std::vector<BatchJob> collect_jobs(const std::vector<std::string> &inputs,
+                                   const fs::path &out_dir,
+                                   std::vector<std::string> &errors) {
+  std::vector<BatchJob> jobs;
+  auto add_file = [&](const fs::path &file, const fs::path &relative) {
+    std::error_code ec;
+    BatchJob job{file, out_dir / relative, fs::file_size(file, ec)};
+    job.output.replace_extension(".html");
+    jobs.push_back(job);
+  };
+
+  for (const auto &input : inputs) {
+    std::error_code ec;
+    if (fs::is_directory(input, ec)) {
+      for (auto it = fs::recursive_directory_iterator(input, ec);
+           !ec && it != fs::recursive_directory_iterator(); it.increment(ec)) {
+        if (it->is_regular_file(ec) && is_markdown_file(it->path()))
+          add_file(it->path(), fs::relative(it->path(), input, ec));
+      }
+      if (ec)
+        errors.push_back(input + ": " + ec.message());
+    } else if (fs::exists(input, ec)) {
+      add_file(input, fs::path(input).filename());
+    } else if (input.find_first_of("*?[") != std::string::npos) {
+      glob_t matches{};
+      if (glob(input.c_str(), 0, nullptr, &matches) == 0) {
+        for (size_t i = 0; i < matches.gl_pathc; ++i) {
+          fs::path match = matches.gl_pathv[i];
+          if (fs::is_regular_file(match, ec))
+            add_file(match, match.filename());
+        }
+      } else {
+        errors.push_back(input + ": no matches");
+      }
+      globfree(&matches);
+    } else {
+      errors.push_back(input + ": no such file or directory");
+    }
+  }
+  return jobs;
+}
+
+// Convert every input into out_dir on a thread pool. Errors are reported per
+// file and do not stop the rest of the batch.
+bool run_batch(const std::vector<std::string> &inputs, const fs::path &out_dir,
+               size_t threads, const ConvertOptions &options,
+               OutputCache *cache, RunStats *run_stats) {
+  std::vector<std::string> errors;
+  std::vector<BatchJob> jobs = collect_jobs(inputs, out_dir, errors);
+
+  // An output named twice would be written by two threads at once
+  std::map<fs::path, size_t> seen;
+  std::erase_if(jobs, [&](const BatchJob &job) {
+    return seen[job.output.lexically_normal()]++ != 0;
+  });
+
+  // Biggest first, so a large file is not left running on its own at the end
+  std::stable_sort(jobs.begin(), jobs.end(),
+                   [](const BatchJob &a, const BatchJob &b) {
+                     return a.size > b.size;
+                   });
+
+  std::mutex errors_lock;
+  size_t failed = 0;
+  auto fail = [&](const BatchJob &job, const std::string &what) {
+    std::lock_guard<std::mutex> guard(errors_lock);
+    errors.push_back(job.input.string() + ": " + what);
+    ++failed;
+  };
+
+  {
+    ThreadPool pool(threads ? threads : std::thread::hardware_concurrency());
+    for (const auto &job : jobs) {
+      pool.submit([&job, &options, &fail, cache, run_stats] {
+        TextFileParser::MappedFile markdown(job.input.string());
+        if (markdown.status != TextFileParser::SUCCESSFUL) {
+          fail(job, "could not be read");
+          return;
+        }
+        ConvertStats stats{.allocation_count = allocation_count};
+        ConvertOptions job_options = options;
+        if (run_stats)
+          job_options.stats = &stats;
+        PhaseTimer timer(job_options.stats, "file", markdown.text().size());
+
+        std::error_code ec;
+        fs::create_directories(job.output.parent_path(), ec);
+        std::string key;
+        if (cache) {
+          key = OutputCache::key(markdown.text(), cache_settings(options));
+          if (cache->fetch(key, job.output, markdown.text().size())) {
+            timer.stop(0);
+            if (run_stats)
+              run_stats->add(job.input.string(), stats);
+            return;
+          }
+        }
+        std::ofstream out(job.output, std::ios::binary);
+        if (!out) {
+          fail(job, "could not write " + job.output.string());
+          return;
+        }
+        try {
+          write_html_page(out, markdown, job_options);
+        } catch (const std::exception &e) {
+          fail(job, e.what());
+          return;
+        }
+        if (!out.flush()) {
+          fail(job, "could not write " + job.output.string());
+          return;
+        }
+        timer.stop((size_t)out.tellp());
+        out.close();
+        if (cache)
+          cache->store(key, job.output);
+        if (run_stats)
+          run_stats->add(job.input.string(), stats);
+      });
+    }
+  }
+
+  for (const auto &error : errors)
+    std::cerr << "mdc: " << error << "\n";
+  std::cerr << "mdc: converted " << jobs.size() - failed << " of "
+            << jobs.size() << " files\n";
+  return errors.empty();
+}
+
+// --- Watch mode ---
+
+// Keeps the outputs of a source tree in step with its Markdown. Each page is
+// kept in memory under the hash of its input, so a file touched without
+// being changed is left alone, and a file moved, renamed or changed back to
+// what another file holds is written from memory instead of being converted.
+class SiteBuilder {
+public:
+  struct Counts {
+    size_t converted = 0, reused = 0, unchanged = 0, removed = 0, failed = 0;
+  };
+
+  SiteBuilder(fs::path source, fs::path out_dir, ThreadPool &pool,
+              const ConvertOptions &options)
+      : source(std::move(source)), out_dir(std::move(out_dir)), pool(pool),
+        options(options), settings(cache_settings(options)) {}
+
+  // Bring the outputs up to date with a batch of changes, the files written
+  // converted on the pool.
+  Counts update(const std::vector<Watch::Change> &changes) {
+    // The last change to each file wins: written (true) or removed
+    std::map<fs::path, bool> latest;
+    for (const auto &change : changes) {
+      if (change.kind == Watch::CHANGE_RESCAN) {
+        rescan(latest);
+      } else if (change.directory) {
+        for (const auto &[path, key] : keys)
+          if (is_under(path, change.path))
+            latest[path] = false;
+      } else if (is_markdown_file(change.path)) {
+        latest[change.path] = change.kind == Watch::CHANGE_WRITTEN;
+      }
+    }
+    // Removed first, as a file moved shows up as one removed and another
+    // written. Its page stays in memory until the end of the batch
+    Counts counts;
+    for (const auto &[path, written] : latest)
+      if (!written)
+        remove(path, counts);
+    for (const auto &[path, written] : latest)
+      if (written)
+        pool.submit([this, &path, &counts] { build(path, counts); });
+    pool.wait();
+
+    // Keep the pages some file still has
+    std::set<std::string_view> live;
+    for (const auto &[path, key] : keys)
+      live.insert(key);
+    std::erase_if(pages, [&](const auto &page) {
+      return !live.count(page.first);
+    });
+    return counts;
+  }
+
+private:
+  static bool is_under(const fs::path &path, const fs::path &dir) {
+    auto [end, rest] = std::mismatch(dir.begin(), dir.end(), path.begin(),
+                                     path.end());
+    return end == dir.end();
+  }
+
+  fs::path output_path(const fs::path &path) const {
+    fs::path output = out_dir / path.lexically_relative(source);
+    output.replace_extension(".html");
+    return output;
+  }
+
+  // Every file there is, written, and every file there was, removed.
+  void rescan(std::map<fs::path, bool> &latest) {
+    for (const auto &[path, key] : keys)
+      latest[path] = false;
+    std::error_code ec;
+    for (auto it = fs::recursive_directory_iterator(source, ec);
+         !ec && it != fs::recursive_directory_iterator(); it.increment(ec)) {
+      if (it->is_regular_file(ec) && is_markdown_file(it->path()))
+        latest[it->path()] = true;
+    }
+  }
+
+  // The output goes, and any directories that leaves empty.
+  void remove(const fs::path &path, Counts &counts) {
+    std::error_code ec;
+    fs::path output = output_path(path);
+    if (keys.erase(path) | fs::remove(output, ec))
+      ++counts.removed;
+    for (fs::path dir = output.parent_path();
+         dir.lexically_relative(out_dir) != "." && fs::is_empty(dir, ec) &&
+         !ec;
+         dir = dir.parent_path())
+      fs::remove(dir, ec);
+  }
+
+  void build(const fs::path &path, Counts &counts) {
+    auto fail = [&](const std::string &what) {
+      std::lock_guard<std::mutex> guard(lock);
+      std::cerr << "mdc: " << path.string() << ": " << what << "\n";
+      ++counts.failed;
+    };
+    fs::path output = output_path(path);
+    TextFileParser::MappedFile markdown(path.string());
+    if (markdown.status != TextFileParser::SUCCESSFUL) {
+      fail("could not be read");
+      return;
+    }
+    std::string key = OutputCache::key(markdown.text(), settings);
+    std::shared_ptr<const std::string> page;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      auto known = keys.find(path);
+      std::error_code ec;
+      if (known != keys.end() && known->second == key &&
+          fs::exists(output, ec)) {
+        ++counts.unchanged;
+        return;
+      }
+      if (auto it = pages.find(key); it != pages.end())
+        page = it->second;
+    }
+    bool reused = page != nullptr;
+    if (!reused) {
+      std::ostringstream html;
+      try {
+        write_html_page(html, markdown, options);
+      } catch (const std::exception &e) {
+        fail(e.what());
+        return;
+      }
+      page = std::make_shared<const std::string>(std::move(html).str());
+    }
+    std::error_code ec;
+    fs::create_directories(output.parent_path(), ec);
+    std::ofstream out(output, std::ios::binary);
+    if (!out.write(page->data(), (std::streamsize)page->size())) {
+      fail("could not write " + output.string());
+      return;
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    keys[path] = key;
+    pages.emplace(key, page);
+    ++(reused ? counts.reused : counts.converted);
+  }
+
+  const fs::path source, out_dir;
+  ThreadPool &pool;
+  const ConvertOptions &options;
+  const std::string settings; // For the keys, as in the output cache
+  std::mutex lock;            // For the maps, while the pool builds
+  std::map<fs::path, std::string> keys; // Of the input each output is from
+  std::map<std::string, std::shared_ptr<const std::string>, std::less<>>
+      pages; // By key
+};
+
+// The watcher run_watch waits on, for SIGINT and SIGTERM to stop.
+Watch::TreeWatcher *running_watcher = nullptr;
+
+void stop_watching(int) {
+  if (running_watcher)
+    running_watcher->interrupt();
+}
+
+// Convert every Markdown file under source into out_dir, keeping its layout,
+// then keep the outputs up to date as the files change. Changes closer
+// together than debounce_ms make one rebuild. Each rebuild is reported with
+// its latency, from the first change it takes in to its last output written.
+// SIGINT or SIGTERM stops it once the rebuild under way is written.
+bool run_watch(const fs::path &source, const fs::path &out_dir,
+               size_t threads, int debounce_ms,
+               const ConvertOptions &options) {
+  using Clock = std::chrono::steady_clock;
+  // Watching from before the first build, so no change is missed
+  Watch::TreeWatcher watcher(source);
+  if (!watcher.error().empty()) {
+    std::cerr << "mdc: " << watcher.error() << "\n";
+    return false;
+  }
+  ThreadPool pool(threads ? threads : std::thread::hardware_concurrency());
+  SiteBuilder site(source, out_dir, pool, options);
+  auto report = [](const SiteBuilder::Counts &counts,
+                   Clock::time_point first, Clock::time_point start) {
+    auto ms = [](Clock::duration d) {
+      return std::chrono::duration<double, std::milli>(d).count();
+    };
+    Clock::time_point end = Clock::now();
+    char line[256];
+    std::snprintf(line, sizeof(line),
+                  "mdc: rebuilt in %.1f ms, %.1f ms after the first change: "
+                  "%zu converted, %zu from memory, %zu unchanged, %zu "
+                  "removed, %zu failed\n",
+                  ms(end - start), ms(end - first), counts.converted,
+                  counts.reused, counts.unchanged, counts.removed,
+                  counts.failed);
+    std::cerr << line;
+  };
+
+  running_watcher = &watcher;
+  std::signal(SIGINT, stop_watching);
+  std::signal(SIGTERM, stop_watching);
+  Clock::time_point start = Clock::now();
+  report(site.update({{Watch::CHANGE_RESCAN, {}}}), start, start);
+  while (!watcher.interrupted()) {
+    Watch::Batch batch = watcher.wait(-1, debounce_ms);
+    start = Clock::now();
+    SiteBuilder::Counts counts = site.update(batch.changes);
+    if (counts.converted || counts.reused || counts.unchanged ||
+        counts.removed || counts.failed)
+      report(counts, batch.first, start);
+  }
+  std::signal(SIGINT, SIG_DFL);
+  std::signal(SIGTERM, SIG_DFL);
+  running_watcher = nullptr;
+  std::cerr << "mdc: stopped watching\n";
+  return true;
 }
 
 void my_main(Arguments &args){
+  // Output goes through std::cout or straight to the file descriptor, never
+  // through stdio, so the two need not be kept in step
+  std::ios::sync_with_stdio(false);
 
   // Show help if there are not enough arguments or help flag requested
   int min_args = 2;
-  bool show_help = (args.help_flag || (args.arguments.size() < min_args));
   auto &s_args = args.arguments;
+  bool serve = std::find(s_args.begin(), s_args.end(), "--serve") != s_args.end();
+  bool show_help =
+      (args.help_flag || (args.arguments.size() < min_args && !serve));
 
   std::string input_arg = "-i";
+  std::string output_dir_arg = "-o";
+  std::string threads_arg = "-j";
+  std::string cache_dir_arg = "--cache-dir";
+  std::string cache_size_arg = "--cache-size";
+  std::string trace_arg = "--trace";
+  std::string socket_arg = "--socket";
+  std::string max_input_arg = "--max-input";
+  std::string max_line_arg = "--max-line";
+  std::string max_nesting_arg = "--max-nesting";
+  std::string max_footnotes_arg = "--max-footnotes";
+  std::string index_arg = "--index";
+  std::string to_arg = "--to";
+  std::string watch_arg = "--watch";
+  std::string out_arg = "--out";
+  std::string debounce_arg = "--debounce";
 
-  std::map<std::string, int> indexes;
-
-  // Here we iterate to check we have all the args
-  std::string must_have_args[] = {input_arg};
-  for (auto &m : must_have_args) {
+  // Flags that take a value, and where they are
+  std::map<std::string, size_t> indexes;
+  for (auto &m : {input_arg, output_dir_arg, threads_arg, cache_dir_arg,
+                  cache_size_arg, trace_arg, socket_arg, max_input_arg,
+                  max_line_arg, max_nesting_arg, max_footnotes_arg,
+                  index_arg, to_arg, watch_arg, out_arg, debounce_arg}) {
     auto pos = std::find(s_args.begin(), s_args.end(), m);
-    auto array_pos = pos - s_args.begin();
-    // Check we are not at the end of the array
-    show_help |= (((array_pos)+1) == min_args);
-    // Check we are there at all
-    show_help |= pos == s_args.end();
-    // save pos
-    indexes[m] = array_pos;
+    if (pos == s_args.end())
+      continue;
+    // Check there is a value after the flag
+    show_help |= (pos + 1) == s_args.end();
+    indexes[m] = pos - s_args.begin();
   }
 
+  bool use_regex =
+      std::find(s_args.begin(), s_args.end(), "--regex") != s_args.end();
+  ConvertOptions options{.engine = use_regex ? INLINE_REGEX : INLINE_SCANNER};
+  auto size_flag = [&](const std::string &flag) -> size_t {
+    if (!indexes.count(flag))
+      return 0;
+    return std::strtoull(s_args[indexes[flag] + 1].c_str(), nullptr, 10);
+  };
+  options.limits = {
+      .linear =
+          std::find(s_args.begin(), s_args.end(), "--linear") != s_args.end(),
+      .max_input = size_flag(max_input_arg),
+      .max_line = size_flag(max_line_arg),
+      .max_nesting = size_flag(max_nesting_arg),
+      .max_footnotes = size_flag(max_footnotes_arg)};
+  bool show_stats =
+      std::find(s_args.begin(), s_args.end(), "--stats") != s_args.end();
+
+  bool index_only =
+      std::find(s_args.begin(), s_args.end(), "--index-only") != s_args.end();
+
+  OutputFormat format = FORMAT_HTML;
+  std::string to;
+  if (indexes.count(to_arg)) {
+    to = s_args[indexes[to_arg] + 1];
+    format = to == "text" ? FORMAT_TEXT : FORMAT_ANSI;
+    show_help |= to != "text" && to != "ansi";
+  }
+
+  bool batch = indexes.count(output_dir_arg) != 0;
+  bool watch = indexes.count(watch_arg) != 0;
+  // Single file mode needs its input, and watch mode somewhere to write
+  show_help |= !batch && !serve && !watch && indexes.count(input_arg) == 0;
+  show_help |= watch && !indexes.count(out_arg);
+  // The index is of one file, and index only runs need somewhere to put it
+  show_help |= (batch || serve || watch) && indexes.count(index_arg);
+  show_help |= index_only && !indexes.count(index_arg);
+  // Only the scanner builds the tree the other formats are written from
+  show_help |=
+      format != FORMAT_HTML && (batch || serve || watch || use_regex);
+
   // Check and return
   if (show_help) {
     print_help();
@@ -43,33 +858,206 @@ void my_main(Arguments &args){
 
   // Main
 
-  // Read in all the lines
-  auto markdown = TextFileParser::read_lines(args.arguments[indexes[input_arg]+1]);
-  if (markdown.status != TextFileParser::SUCCESSFUL) {
+  if (serve) {
+    size_t threads = 0;
+    if (indexes.count(threads_arg))
+      threads = std::strtoul(s_args[indexes[threads_arg] + 1].c_str(),
+                             nullptr, 10);
+    std::string socket_path;
+    if (indexes.count(socket_arg))
+      socket_path = s_args[indexes[socket_arg] + 1];
+    if (!run_server(socket_path, threads, options, show_stats))
+      std::exit(1);
+    return;
+  }
+
+  if (watch) {
+    size_t threads = 0;
+    if (indexes.count(threads_arg))
+      threads = std::strtoul(s_args[indexes[threads_arg] + 1].c_str(),
+                             nullptr, 10);
+    int debounce_ms = 50;
+    if (indexes.count(debounce_arg))
+      debounce_ms = std::atoi(s_args[indexes[debounce_arg] + 1].c_str());
+    if (!run_watch(s_args[indexes[watch_arg] + 1],
+                   s_args[indexes[out_arg] + 1], threads, debounce_ms,
+                   options))
+      std::exit(1);
+    return;
+  }
+
+  std::unique_ptr<OutputCache> cache;
+  if (indexes.count(cache_dir_arg)) {
+    uint64_t megabytes = 1024;
+    if (indexes.count(cache_size_arg))
+      megabytes = std::strtoull(s_args[indexes[cache_size_arg] + 1].c_str(),
+                                nullptr, 10);
+    cache = std::make_unique<OutputCache>(s_args[indexes[cache_dir_arg] + 1],
+                                          megabytes << 20);
+  }
+  // Phase timings, for --stats and --trace
+  std::unique_ptr<RunStats> run_stats;
+  if (show_stats || indexes.count(trace_arg))
+    run_stats = std::make_unique<RunStats>();
+
+  // Keep the cache under its cap and report on the run, however mdc exits
+  auto finish_run = [&] {
+    if (cache)
+      cache->trim();
+    if (show_stats) {
+      print_stats(*run_stats, std::cerr);
+      if (cache)
+        print_cache_stats(*cache);
+    }
+    if (indexes.count(trace_arg)) {
+      std::string trace = s_args[indexes[trace_arg] + 1];
+      if (!write_trace(*run_stats, trace))
+        std::cerr << "mdc: could not write " << trace << "\n";
+    }
+  };
+
+  if (batch) {
+    // Everything that is not a flag or a flag's value is an input
+    std::vector<std::string> inputs;
+    for (size_t i = 0; i < s_args.size(); ++i) {
+      if (indexes.count(s_args[i])) {
+        if (s_args[i] == input_arg)
+          inputs.push_back(s_args[i + 1]);
+        ++i;
+      } else if (s_args[i].rfind("-", 0) != 0) {
+        inputs.push_back(s_args[i]);
+      }
+    }
+    size_t threads = 0;
+    if (indexes.count(threads_arg))
+      threads = std::strtoul(s_args[indexes[threads_arg] + 1].c_str(),
+                             nullptr, 10);
+    bool ok = run_batch(inputs, s_args[indexes[output_dir_arg] + 1], threads,
+                        options, cache.get(), run_stats.get());
+    finish_run();
+    if (!ok)
+      std::exit(1);
+    return;
+  }
+
+  // A page streams from the input through a reader thread, the converter
+  // and a writer thread. Everything else takes the whole input as one view,
+  // the file mapped or a pipe or "-" for stdin read into a buffer: -j splits
+  // it, the cache hashes it, and the regex engine and the other formats
+  // convert it in one go.
+  std::string input = s_args[indexes[input_arg] + 1];
+  bool pipelined = format == FORMAT_HTML && !use_regex && !index_only &&
+                   !cache && !indexes.count(threads_arg);
+  TextFileParser::MappedFile markdown;
+  int in_fd = -1;
+  size_t input_size = 0; // Unknown for a pipe, which is checked as it streams
+  if (pipelined) {
+    in_fd = input == "-" ? STDIN_FILENO : ::open(input.c_str(), O_RDONLY);
+    struct stat info {};
+    if (in_fd >= 0 && fstat(in_fd, &info) == 0 && S_ISREG(info.st_mode))
+      input_size = (size_t)info.st_size;
+  } else if (markdown.open(input)) {
+    input_size = markdown.text().size();
+  }
+  if (pipelined ? in_fd < 0 : markdown.status != TextFileParser::SUCCESSFUL) {
     std::cout << "Markdown file not read successfully." << std::endl;
     return;
   }
 
-  std::string superstring = "";
-  // Print out the file, this will do nothing if the file did not read as output will be empty.
-  for (auto &line : *markdown.output) {
-    superstring += line + '\n';
+  try {
+    check_input_size(input_size, options.limits);
+  } catch (const ConvertLimitError &e) {
+    std::cerr << "mdc: " << e.what() << "\n";
+    std::exit(1);
   }
-  auto out = convert_markdown_to_html(superstring);
-  // Write the basic HTML boilerplate to the output file
-  std::cout << "<!DOCTYPE html>\n";
-  std::cout << "<html>\n";
-  std::cout << "<head>\n";
-  std::cout << "    <title>Converted Markdown</title>\n";
-  std::cout << "</head>\n";
-  std::cout << "<body>\n";
 
-  // Convert the entire Markdown content
-  std::cout << out; // Write the converted content
+  ConvertStats stats{.allocation_count = allocation_count};
+  if (run_stats)
+    options.stats = &stats;
+  PhaseTimer timer(options.stats, "file", input_size);
 
-  // Close the basic HTML boilerplate
-  std::cout << "</body>\n";
-  std::cout << "</html>\n";
+  // The index goes out whatever happens to the HTML: written as the page is
+  // converted, gathered on its own for a cache hit or with no HTML at all
+  DocumentIndex index;
+  auto write_index = [&] {
+    std::string path = s_args[indexes[index_arg] + 1];
+    std::string json = index.json();
+    if (path == "-") {
+      std::cout << json;
+      return;
+    }
+    std::ofstream out(path, std::ios::binary);
+    if (!out.write(json.data(), (std::streamsize)json.size())) {
+      std::cerr << "mdc: could not write " << path << "\n";
+      std::exit(1);
+    }
+  };
+  if (index_only) {
+    index_markdown(markdown.text(), index, options);
+    write_index();
+    timer.stop(0);
+    if (run_stats)
+      run_stats->add(input, stats);
+    finish_run();
+    return;
+  }
+
+  std::string key;
+  if (cache) {
+    std::string settings = cache_settings(options);
+    if (format != FORMAT_HTML)
+      settings += " to " + to;
+    key = OutputCache::key(markdown.text(), settings);
+    if (cache->fetch(key, std::cout, markdown.text().size())) {
+      if (indexes.count(index_arg)) {
+        index_markdown(markdown.text(), index, options);
+        write_index();
+      }
+      timer.stop(0);
+      if (run_stats)
+        run_stats->add(input, stats);
+      finish_run();
+      return;
+    }
+  }
 
+  // With -j, split the document across threads
+  std::unique_ptr<ThreadPool> pool;
+  if (indexes.count(threads_arg)) {
+    size_t threads =
+        std::strtoul(s_args[indexes[threads_arg] + 1].c_str(), nullptr, 10);
+    pool = std::make_unique<ThreadPool>(
+        threads ? threads : std::thread::hardware_concurrency());
+  }
+  if (indexes.count(index_arg))
+    options.index = &index;
 
-}
\ No newline at end of file
+  auto write_output = [&](std::ostream &out) {
+    if (format == FORMAT_HTML)
+      write_html_page(out, markdown, options, pool.get());
+    else
+      write_rendered(out, markdown.text(), format, options);
+  };
+  if (pipelined) {
+    write_html_page_pipelined(in_fd, STDOUT_FILENO, options);
+    if (in_fd != STDIN_FILENO)
+      ::close(in_fd);
+  } else if (!cache) {
+    write_output(std::cout);
+  } else {
+    // Write the page into the cache, then copy it out
+    fs::path temp = cache->temp_path();
+    {
+      std::ofstream out(temp, std::ios::binary);
+      write_output(out);
+    }
+    std::cout << std::ifstream(temp, std::ios::binary).rdbuf();
+    cache->commit(temp, key);
+  }
+  if (options.index)
+    write_index();
+  timer.stop(0);
+  if (run_stats)
+    run_stats->add(input, stats);
+  finish_run();
+}
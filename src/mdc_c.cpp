@@ -0,0 +1,59 @@
+//
+// libmdc: the C interface over Converter. No exception leaves this file; a
+// failed call stores its message in the converter instead.
+//
+#include "mdc_c.h"
+#include "markdown.h"
+#include <new>
+#include <string>
+
+struct mdc_converter {
+  explicit mdc_converter(unsigned flags)
+      : converter(ConvertOptions{
+            .engine = flags & MDC_REGEX ? INLINE_REGEX : INLINE_SCANNER}) {}
+
+  Converter<> converter;
+  std::string error;
+};
+
+mdc_converter *mdc_new(unsigned flags) {
+  try {
+    return new mdc_converter(flags);
+  } catch (...) {
+    return nullptr;
+  }
+}
+
+void mdc_free(mdc_converter *ctx) { delete ctx; }
+
+int mdc_convert(mdc_converter *ctx, const char *in, size_t len,
+                mdc_output_fn out_cb, void *user_data) {
+  if (!ctx)
+    return MDC_ERROR;
+  ctx->error.clear();
+  if ((!in && len) || !out_cb) {
+    ctx->error = "mdc_convert: no input or no callback";
+    return MDC_ERROR;
+  }
+  try {
+    std::string_view html = ctx->converter.convert(std::string_view(in, len));
+    out_cb(user_data, html.data(), html.size());
+    return MDC_OK;
+  } catch (const std::exception &e) {
+    ctx->error = e.what();
+  } catch (...) {
+    ctx->error = "mdc_convert: unknown error";
+  }
+  return MDC_ERROR;
+}
+
+void mdc_reset(mdc_converter *ctx) {
+  if (ctx)
+    ctx->converter.reset();
+}
+
+const char *mdc_last_error(const mdc_converter *ctx) {
+  return ctx ? ctx->error.c_str() : "";
+}
+
+int mdc_version(void) { return markdown_converter_version; }
@@ -0,0 +1,64 @@
+#ifndef BLIBS_MDC_C_H
+#define BLIBS_MDC_C_H
+
+#include <stddef.h>
+
+// The C interface of libmdc, for callers from C and through FFI (Rust,
+// Python ctypes and the like). A converter is created once and reused for
+// every document: it keeps its compiled rules and memory between calls, so
+// a conversion costs no setup and, once warmed up, no allocations.
+//
+// A converter must only be used by one thread at a time. Functions returning
+// int return MDC_OK or MDC_ERROR; mdc_last_error() then says what went wrong.
+
+#if defined(_WIN32)
+#define MDC_API __declspec(dllexport)
+#elif defined(__GNUC__)
+#define MDC_API __attribute__((visibility("default")))
+#else
+#define MDC_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct mdc_converter mdc_converter;
+
+enum {
+    MDC_OK = 0,
+    MDC_ERROR = 1,
+};
+
+// Flags for mdc_new.
+enum {
+    MDC_REGEX = 1, // Use the original regex pipeline for inline markup
+};
+
+// Receives the HTML of a conversion. html points into the converter and is
+// only valid during the call; it is not NUL terminated.
+typedef void (*mdc_output_fn)(void *user_data, const char *html, size_t len);
+
+// A new converter, or NULL if out of memory. flags is 0 or MDC_REGEX.
+MDC_API mdc_converter *mdc_new(unsigned flags);
+
+MDC_API void mdc_free(mdc_converter *ctx);
+
+// Convert len bytes of Markdown at in and pass the HTML to out_cb.
+MDC_API int mdc_convert(mdc_converter *ctx, const char *in, size_t len,
+                        mdc_output_fn out_cb, void *user_data);
+
+// Release the last output and scratch data, keeping the memory for reuse.
+MDC_API void mdc_reset(mdc_converter *ctx);
+
+// The message of the last failed call on ctx, or "" if there was none.
+MDC_API const char *mdc_last_error(const mdc_converter *ctx);
+
+// Changes whenever some input converts to different HTML, for caching.
+MDC_API int mdc_version(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //BLIBS_MDC_C_H
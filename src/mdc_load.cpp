@@ -0,0 +1,199 @@
+//
+// Load generator for mdc --serve. Opens connections to the server's Unix
+// socket, keeps each busy with up to depth pipelined conversion requests and
+// reports throughput and latency as the client saw them, followed by the
+// server's own latency percentiles.
+//
+// mdc_load --socket path [-i doc.md] [-n requests] [-c connections]
+//          [-d depth]
+//
+#include "serve.h"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using Clock = std::chrono::steady_clock;
+
+int connect_unix(const std::string &path) {
+  sockaddr_un address{};
+  address.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(address.sun_path))
+    return -1;
+  std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+  int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd >= 0 && ::connect(fd, (sockaddr *)&address, sizeof(address)) != 0) {
+    ::close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// A document with a bit of everything, for when no input is given.
+std::string sample_document() {
+  std::string doc;
+  for (int i = 0; i < 8; ++i)
+    doc += "## Section " + std::to_string(i) +
+           "\n\nSome text with **bold**, *italic* and a [link](https://"
+           "example.com/" +
+           std::to_string(i) +
+           ") to go with it, plus a footnote[^1].\n\n- first item\n- second "
+           "item with `code`\n\n";
+  return doc + "[^1]: The footnote.\n";
+}
+
+struct Results {
+  std::mutex lock;
+  size_t replies = 0;
+  size_t errors = 0;
+  size_t bytes_out = 0;
+};
+
+// Sends count requests on a connection, never more than depth unanswered.
+bool run_connection(const std::string &socket_path, const std::string &doc,
+                    size_t count, size_t depth,
+                    Serve::LatencyHistogram &latency, Results &results) {
+  int fd = connect_unix(socket_path);
+  if (fd < 0)
+    return false;
+  std::mutex lock;
+  std::condition_variable changed;
+  std::deque<Clock::time_point> sent; // Send times of unanswered requests
+
+  std::thread receiver([&] {
+    Serve::FrameType type;
+    std::string reply;
+    size_t replies = 0, errors = 0, bytes = 0;
+    for (; replies < count; ++replies) {
+      if (!Serve::read_frame(fd, type, reply))
+        break;
+      Clock::time_point start;
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        start = sent.front();
+        sent.pop_front();
+      }
+      changed.notify_one();
+      latency.record((uint64_t)std::chrono::duration_cast<
+                         std::chrono::microseconds>(Clock::now() - start)
+                         .count());
+      errors += type != Serve::FRAME_OK;
+      bytes += reply.size();
+    }
+    std::lock_guard<std::mutex> guard(results.lock);
+    results.replies += replies;
+    results.errors += errors + (count - replies);
+    results.bytes_out += bytes;
+  });
+
+  for (size_t i = 0; i < count; ++i) {
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      changed.wait(guard, [&] { return sent.size() < depth; });
+      sent.push_back(Clock::now());
+    }
+    if (!Serve::write_frame(fd, Serve::FRAME_CONVERT, doc))
+      break;
+  }
+  receiver.join();
+  ::close(fd);
+  return true;
+}
+
+// The server's own percentiles, as JSON.
+std::string server_stats(const std::string &socket_path) {
+  int fd = connect_unix(socket_path);
+  Serve::FrameType type;
+  std::string reply;
+  if (fd < 0 || !Serve::write_frame(fd, Serve::FRAME_STATS, "") ||
+      !Serve::read_frame(fd, type, reply))
+    reply = "unavailable";
+  if (fd >= 0)
+    ::close(fd);
+  return reply;
+}
+
+int main(int argc, char *argv[]) {
+  std::string socket_path;
+  std::string input;
+  size_t requests = 10000;
+  size_t connections = 4;
+  size_t depth = 16;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string flag = argv[i];
+    if (flag == "--socket")
+      socket_path = argv[i + 1];
+    else if (flag == "-i")
+      input = argv[i + 1];
+    else if (flag == "-n")
+      requests = std::strtoull(argv[i + 1], nullptr, 10);
+    else if (flag == "-c")
+      connections = std::max<size_t>(1, std::strtoull(argv[i + 1], nullptr, 10));
+    else if (flag == "-d")
+      depth = std::max<size_t>(1, std::strtoull(argv[i + 1], nullptr, 10));
+  }
+  if (socket_path.empty()) {
+    std::fprintf(stderr, "mdc_load --socket path [-i doc.md] [-n requests] "
+                         "[-c connections] [-d depth]\n");
+    return 2;
+  }
+  std::string doc = sample_document();
+  if (!input.empty()) {
+    std::ifstream in(input, std::ios::binary);
+    if (!in) {
+      std::fprintf(stderr, "mdc_load: could not read %s\n", input.c_str());
+      return 1;
+    }
+    std::ostringstream text;
+    text << in.rdbuf();
+    doc = text.str();
+  }
+
+  Serve::LatencyHistogram latency;
+  Results results;
+  std::vector<std::thread> threads;
+  bool connected = true;
+  std::mutex connected_lock;
+  auto start = Clock::now();
+  for (size_t c = 0; c < connections; ++c) {
+    size_t count = requests / connections + (c < requests % connections);
+    threads.emplace_back([&, count] {
+      if (!run_connection(socket_path, doc, count, depth, latency, results)) {
+        std::lock_guard<std::mutex> guard(connected_lock);
+        connected = false;
+      }
+    });
+  }
+  for (auto &thread : threads)
+    thread.join();
+  double seconds =
+      std::chrono::duration<double>(Clock::now() - start).count();
+  if (!connected) {
+    std::fprintf(stderr, "mdc_load: could not connect to %s\n",
+                 socket_path.c_str());
+    return 1;
+  }
+
+  std::printf("%zu requests of %zu bytes, %zu connections, depth %zu\n",
+              requests, doc.size(), connections, depth);
+  std::printf("%.0f requests/s, %.1f MB/s in, %.1f MB/s out, %zu errors\n",
+              results.replies / seconds,
+              results.replies * doc.size() / seconds / 1e6,
+              results.bytes_out / seconds / 1e6, results.errors);
+  std::printf("client latency %s\n", latency.json().c_str());
+  std::printf("server latency %s\n", server_stats(socket_path).c_str());
+  return results.errors ? 1 : 0;
+}
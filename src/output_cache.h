@@ -0,0 +1,218 @@
+#ifndef BLIBS_OUTPUT_CACHE_H
+#define BLIBS_OUTPUT_CACHE_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#endif
+
+// A directory of converted outputs, each named after a hash of everything
+// that went into it: the input bytes and a settings string holding the
+// converter version and options. An input seen before is served by copying
+// the file (a reflink where the filesystem has them) with no conversion.
+//
+// Entries are written to a temporary file and renamed into place, so a
+// reader never sees half an entry, even with several processes sharing the
+// directory. A hit updates the entry's modification time, and trim() removes
+// the least recently used entries until the directory is under its size cap.
+class OutputCache {
+public:
+    struct Stats {
+        std::atomic<size_t> hits{0};
+        std::atomic<size_t> misses{0};
+        std::atomic<size_t> evicted{0};
+        std::atomic<uint64_t> bytes_saved{0}; // Input not converted on hits
+    };
+
+    OutputCache(std::filesystem::path directory, uint64_t max_bytes)
+        : dir(std::move(directory)), max_bytes(max_bytes) {
+        std::error_code ec;
+        std::filesystem::create_directories(dir, ec);
+    }
+
+    // 128 bits of hash as hex, from two 64 bit lanes fed 8 bytes a step.
+    static std::string key(std::string_view input, std::string_view settings) {
+        uint64_t a = 0x243f6a8885a308d3ull ^ input.size();
+        uint64_t b = 0x13198a2e03707344ull ^ settings.size();
+        for (std::string_view part : {input, settings}) {
+            size_t i = 0;
+            for (; i + 8 <= part.size(); i += 8) {
+                uint64_t word;
+                std::memcpy(&word, part.data() + i, 8);
+                a = mix(a ^ word);
+                b = mix(b + word) ^ (b >> 17);
+            }
+            uint64_t tail = 0;
+            std::memcpy(&tail, part.data() + i, part.size() - i);
+            a = mix(a ^ tail ^ 0x80);
+            b = mix(b + tail + 0x80);
+        }
+        char hex[33];
+        std::snprintf(hex, sizeof(hex), "%016llx%016llx",
+                      (unsigned long long) mix(a ^ b),
+                      (unsigned long long) b);
+        return hex;
+    }
+
+    // Copy key's output to dest. input_size is counted as saved on a hit.
+    bool fetch(const std::string &key, const std::filesystem::path &dest,
+               size_t input_size) {
+        auto entry = find(key);
+        if (entry.empty() || !clone_file(entry, dest))
+            return miss();
+        return hit(input_size);
+    }
+
+    // Write key's output to out.
+    bool fetch(const std::string &key, std::ostream &out, size_t input_size) {
+        auto entry = find(key);
+        if (entry.empty())
+            return miss();
+        std::ifstream in(entry, std::ios::binary);
+        if (!in)
+            return miss();
+        out << in.rdbuf();
+        return hit(input_size);
+    }
+
+    // Add the file at output as key's entry.
+    void store(const std::string &key, const std::filesystem::path &output) {
+        auto temp = temp_path();
+        if (clone_file(output, temp))
+            commit(temp, key);
+    }
+
+    // A new, unique path in the cache directory to write an entry to, before
+    // commit() moves it into place.
+    std::filesystem::path temp_path() {
+        static std::atomic<uint64_t> counter{0};
+        return dir / (".tmp-" + std::to_string(process_id()) + "-" +
+                      std::to_string(counter.fetch_add(1)));
+    }
+
+    void commit(const std::filesystem::path &temp, const std::string &key) {
+        std::error_code ec;
+        std::filesystem::rename(temp, dir / (key + ".html"), ec);
+        if (ec)
+            std::filesystem::remove(temp, ec);
+    }
+
+    // Remove the least recently used entries until the cache fits its cap.
+    void trim() {
+        struct Entry {
+            std::filesystem::path path;
+            std::filesystem::file_time_type used;
+            uint64_t size;
+        };
+        std::vector<Entry> entries;
+        uint64_t total = 0;
+        std::error_code ec;
+        for (auto it = std::filesystem::directory_iterator(dir, ec);
+             !ec && it != std::filesystem::directory_iterator();
+             it.increment(ec)) {
+            if (it->path().extension() != ".html")
+                continue;
+            std::error_code entry_ec;
+            Entry entry{it->path(), it->last_write_time(entry_ec),
+                        it->file_size(entry_ec)};
+            if (entry_ec)
+                continue;
+            total += entry.size;
+            entries.push_back(std::move(entry));
+        }
+        if (total <= max_bytes)
+            return;
+        std::sort(entries.begin(), entries.end(),
+                  [](const Entry &x, const Entry &y) { return x.used < y.used; });
+        for (const auto &entry : entries) {
+            if (total <= max_bytes)
+                break;
+            if (std::filesystem::remove(entry.path, ec)) {
+                total -= entry.size;
+                ++stats.evicted;
+            }
+        }
+    }
+
+    const std::filesystem::path &directory() const { return dir; }
+
+    Stats stats;
+
+private:
+    static uint64_t mix(uint64_t x) {
+        x ^= x >> 30;
+        x *= 0xbf58476d1ce4e5b9ull;
+        x ^= x >> 27;
+        x *= 0x94d049bb133111ebull;
+        return x ^ (x >> 31);
+    }
+
+    static long process_id() {
+#if defined(__linux__)
+        return (long) getpid();
+#else
+        return 0;
+#endif
+    }
+
+    // The entry for key, marked as just used, or an empty path.
+    std::filesystem::path find(const std::string &key) {
+        auto path = dir / (key + ".html");
+        std::error_code ec;
+        std::filesystem::last_write_time(
+            path, std::filesystem::file_time_type::clock::now(), ec);
+        return ec ? std::filesystem::path() : path;
+    }
+
+    bool hit(size_t input_size) {
+        ++stats.hits;
+        stats.bytes_saved += input_size;
+        return true;
+    }
+
+    bool miss() {
+        ++stats.misses;
+        return false;
+    }
+
+    // Share the blocks of from with to if the filesystem can, else copy.
+    static bool clone_file(const std::filesystem::path &from,
+                           const std::filesystem::path &to) {
+#if defined(__linux__) && defined(FICLONE)
+        int in = ::open(from.c_str(), O_RDONLY);
+        if (in >= 0) {
+            int out = ::open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            bool cloned = out >= 0 && ioctl(out, FICLONE, in) == 0;
+            if (out >= 0)
+                ::close(out);
+            ::close(in);
+            if (cloned)
+                return true;
+        }
+#endif
+        std::error_code ec;
+        std::filesystem::copy_file(
+            from, to, std::filesystem::copy_options::overwrite_existing, ec);
+        return !ec;
+    }
+
+    std::filesystem::path dir;
+    uint64_t max_bytes;
+};
+
+#endif //BLIBS_OUTPUT_CACHE_H
@@ -0,0 +1,377 @@
+#ifndef BLIBS_PIPELINE_IO_H
+#define BLIBS_PIPELINE_IO_H
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <sys/uio.h>
+#include <unistd.h>
+
+// Overlapped I/O for a converter that works through a stream front to back.
+// A Reader fills buffers from a file descriptor on a thread of its own while
+// the caller converts the ones before, and a Writer gathers the output into
+// large buffers and writes them out with writev on another thread. Reading,
+// converting and writing then go on at once, so a run takes about as long
+// as its slowest stage rather than the sum of all three, and a slow pipe at
+// either end only holds up the stage next to it.
+//
+// Each side has a fixed number of page aligned buffers going round between
+// its two threads, so memory stays bounded however long the stream is: a
+// producer that gets ahead waits for a buffer to come back. A buffer is
+// handed over before it is full when the other side is waiting for one, so
+// with a fast consumer little is held back, and when the consumer falls
+// behind the buffers fill up and each system call moves more.
+namespace Pipeline {
+
+    constexpr size_t buffer_alignment = 4096;
+
+    inline uint64_t now_ns() {
+        return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+
+    // The system calls of one side, on the steady clock.
+    struct IoStats {
+        uint64_t start_ns = 0; // The first call
+        uint64_t busy_ns = 0;  // In calls, waiting on the file included
+        size_t bytes = 0;
+        size_t calls = 0;
+        size_t thread = 0; // Hash of the thread that made them
+
+        // Account for a call that started at start and moved bytes.
+        void add(uint64_t start, ssize_t moved) {
+            uint64_t end = now_ns();
+            if (!calls++) {
+                start_ns = start;
+                thread = std::hash<std::thread::id>()(
+                    std::this_thread::get_id());
+            }
+            busy_ns += end - start;
+            bytes += moved > 0 ? (size_t)moved : 0;
+        }
+    };
+
+    struct Buffer {
+        char *data = nullptr;
+        size_t size = 0;
+    };
+
+    // Buffers going round between a producer and a consumer thread.
+    class Channel {
+    public:
+        Channel(size_t count, size_t capacity) : capacity(capacity) {
+            size_t size = (capacity + buffer_alignment - 1) /
+                          buffer_alignment * buffer_alignment;
+            for (size_t i = 0; i < count; ++i) {
+                if (void *p = std::aligned_alloc(buffer_alignment, size))
+                    all.push_back(static_cast<char *>(p));
+            }
+            if (all.empty())
+                throw std::bad_alloc();
+            free = all;
+        }
+
+        ~Channel() {
+            for (char *p : all)
+                std::free(p);
+        }
+
+        Channel(const Channel &) = delete;
+        Channel &operator=(const Channel &) = delete;
+
+        const size_t capacity;
+
+        // For the producer: an empty buffer, once one is free. Null once the
+        // consumer has stopped.
+        char *acquire() {
+            std::unique_lock<std::mutex> guard(lock);
+            changed.wait(guard, [&] { return !free.empty() || stopped; });
+            if (stopped)
+                return nullptr;
+            char *data = free.back();
+            free.pop_back();
+            return data;
+        }
+
+        // For the producer: hand over a filled buffer.
+        void send(Buffer buffer) {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                full.push_back(buffer);
+            }
+            changed.notify_all();
+        }
+
+        // For the producer: nothing more is coming.
+        void close() {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                closed = true;
+            }
+            changed.notify_all();
+        }
+
+        // For the consumer: wait for filled buffers and move up to max of
+        // them to out. False once the producer has closed and all are taken.
+        bool receive(std::vector<Buffer> &out, size_t max) {
+            std::unique_lock<std::mutex> guard(lock);
+            waiting.store(true, std::memory_order_relaxed);
+            changed.wait(guard, [&] { return !full.empty() || closed; });
+            waiting.store(false, std::memory_order_relaxed);
+            for (; !full.empty() && max > 0; --max) {
+                out.push_back(full.front());
+                full.pop_front();
+            }
+            return !out.empty();
+        }
+
+        // Whether a filled buffer is waiting to be received.
+        bool ready() {
+            std::lock_guard<std::mutex> guard(lock);
+            return !full.empty() || closed;
+        }
+
+        // Whether the consumer is blocked in receive() for want of buffers.
+        bool consumer_waiting() const {
+            return waiting.load(std::memory_order_relaxed);
+        }
+
+        // For either side: give back a buffer that is done with.
+        void release(char *data) {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                free.push_back(data);
+            }
+            changed.notify_all();
+        }
+
+        // For the consumer: take nothing more, so acquire() returns null.
+        void stop() {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                stopped = true;
+            }
+            changed.notify_all();
+        }
+
+    private:
+        std::mutex lock;
+        std::condition_variable changed;
+        std::vector<char *> all;
+        std::vector<char *> free;
+        std::deque<Buffer> full;
+        std::atomic<bool> waiting{false};
+        bool closed = false;
+        bool stopped = false;
+    };
+
+    // Reads a file descriptor to its end on a thread of its own, up to depth
+    // buffers ahead of the caller.
+    class Reader {
+    public:
+        explicit Reader(int fd, size_t buffer_size = 1 << 20, size_t depth = 4)
+            : channel(depth + 1, buffer_size), thread([this, fd] { run(fd); }) {}
+
+        ~Reader() {
+            channel.stop();
+            thread.join();
+        }
+
+        Reader(const Reader &) = delete;
+        Reader &operator=(const Reader &) = delete;
+
+        // The next piece of the input, valid until the next call. Empty at
+        // the end of the input or after an error.
+        std::string_view next() {
+            if (current.data)
+                channel.release(current.data);
+            current = {};
+            if (pending.empty() && !channel.receive(pending, SIZE_MAX))
+                return {};
+            current = pending.front();
+            pending.erase(pending.begin());
+            return {current.data, current.size};
+        }
+
+        // Whether next() would return without waiting.
+        bool ready() { return !pending.empty() || channel.ready(); }
+
+        // The errno of a failed read, or 0. Final once next() is empty.
+        int error() const { return error_code.load(); }
+
+        // Final once next() is empty.
+        const IoStats &stats() const { return io; }
+
+    private:
+        void run(int fd) {
+            bool end = false;
+            while (!end) {
+                char *data = channel.acquire();
+                if (!data)
+                    break;
+                size_t size = 0;
+                while (size < channel.capacity) {
+                    uint64_t start = now_ns();
+                    ssize_t n =
+                        ::read(fd, data + size, channel.capacity - size);
+                    io.add(start, n);
+                    if (n < 0 && errno == EINTR)
+                        continue;
+                    if (n <= 0) {
+                        if (n < 0)
+                            error_code = errno;
+                        end = true;
+                        break;
+                    }
+                    size += (size_t)n;
+                    // A slow pipe: pass on what there is
+                    if (channel.consumer_waiting())
+                        break;
+                }
+                if (size)
+                    channel.send({data, size});
+                else
+                    channel.release(data);
+            }
+            channel.close();
+        }
+
+        Channel channel;
+        std::vector<Buffer> pending;
+        Buffer current;
+        std::atomic<int> error_code{0};
+        IoStats io;
+        std::thread thread; // Last, to start once the rest is set up
+    };
+
+    // Writes to a file descriptor on a thread of its own. append() copies
+    // into the current buffer, which is handed over when full, when the
+    // writer is idle and at least min_batch is waiting, or on flush(). Each
+    // write takes every buffer handed over since the last, up to IOV_MAX.
+    class Writer {
+    public:
+        static constexpr size_t min_batch = 64 << 10;
+
+        explicit Writer(int fd, size_t buffer_size = 1 << 20, size_t depth = 8)
+            : channel(depth, buffer_size), thread([this, fd] { run(fd); }) {}
+
+        ~Writer() { finish(); }
+
+        Writer(const Writer &) = delete;
+        Writer &operator=(const Writer &) = delete;
+
+        // Queue data to be written. Dropped once a write has failed.
+        void append(std::string_view data) {
+            while (!data.empty()) {
+                if (!current.data && !(current.data = channel.acquire()))
+                    return;
+                size_t n = std::min(data.size(), channel.capacity - current.size);
+                std::memcpy(current.data + current.size, data.data(), n);
+                current.size += n;
+                data.remove_prefix(n);
+                if (current.size == channel.capacity)
+                    hand_over();
+            }
+            if (current.size >= min_batch && channel.consumer_waiting())
+                hand_over();
+        }
+
+        // Hand over whatever has been appended, however little, without
+        // waiting for it to be written. For when no more is coming for a
+        // while, such as while waiting on input.
+        void flush() {
+            if (current.size)
+                hand_over();
+        }
+
+        // Write everything appended and wait for it. False if a write failed.
+        bool finish() {
+            if (thread.joinable()) {
+                flush();
+                if (current.data)
+                    channel.release(current.data);
+                current = {};
+                channel.close();
+                thread.join();
+            }
+            return !error_code;
+        }
+
+        // The errno of a failed write, or 0.
+        int error() const { return error_code.load(); }
+
+        // Final once finish() has returned.
+        const IoStats &stats() const { return io; }
+
+    private:
+        void hand_over() {
+            channel.send(current);
+            current = {};
+        }
+
+        void run(int fd) {
+            std::vector<Buffer> batch;
+            std::vector<iovec> iov;
+            while (channel.receive(batch, IOV_MAX)) {
+                if (!error_code)
+                    write_batch(fd, batch, iov);
+                for (const Buffer &buffer : batch)
+                    channel.release(buffer.data);
+                batch.clear();
+            }
+        }
+
+        void write_batch(int fd, const std::vector<Buffer> &batch,
+                         std::vector<iovec> &iov) {
+            iov.clear();
+            for (const Buffer &buffer : batch)
+                iov.push_back({buffer.data, buffer.size});
+            size_t i = 0;
+            while (i < iov.size()) {
+                uint64_t start = now_ns();
+                ssize_t n = ::writev(fd, iov.data() + i, (int)(iov.size() - i));
+                io.add(start, n);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0) {
+                    error_code = n < 0 ? errno : EIO;
+                    channel.stop(); // The producer drops the rest
+                    return;
+                }
+                // Skip what went out, which may end partway into a buffer
+                for (size_t left = (size_t)n; left > 0;) {
+                    size_t step = std::min(left, iov[i].iov_len);
+                    iov[i].iov_base = static_cast<char *>(iov[i].iov_base) + step;
+                    iov[i].iov_len -= step;
+                    left -= step;
+                    if (!iov[i].iov_len)
+                        ++i;
+                }
+            }
+        }
+
+        Channel channel;
+        Buffer current;
+        std::atomic<int> error_code{0};
+        IoStats io;
+        std::thread thread; // Last, to start once the rest is set up
+    };
+
+} // namespace Pipeline
+
+#endif //BLIBS_PIPELINE_IO_H
@@ -8,6 +8,18 @@
 #include <vector>
 #include <iostream>
 #include <fstream>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#if !defined(_WIN32)
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 namespace TextFileParser {
 
@@ -45,6 +57,136 @@ namespace TextFileParser {
         return out;
     }
 
+    // The whole of a file as one read-only view, without splitting it into
+    // lines. Regular files are memory-mapped; pipes, terminals and stdin
+    // (given as "-") can't be, so they are read into a buffer instead.
+    class MappedFile {
+    public:
+        MappedFile() = default;
+        explicit MappedFile(const std::string &filename) { open(filename); }
+        ~MappedFile() { close(); }
+
+        MappedFile(const MappedFile &) = delete;
+        MappedFile &operator=(const MappedFile &) = delete;
+        MappedFile(MappedFile &&other) noexcept { *this = std::move(other); }
+        MappedFile &operator=(MappedFile &&other) noexcept {
+            if (this != &other) {
+                close();
+                status = other.status;
+                mapping = other.mapping;
+                size = other.size;
+                released = other.released;
+                buffer = std::move(other.buffer);
+                other.mapping = nullptr;
+                other.size = 0;
+                other.status = NO_PARSER_STATUS;
+            }
+            return *this;
+        }
+
+        ParserStatus status = NO_PARSER_STATUS;
+
+        std::string_view text() const {
+            if (mapping)
+                return {static_cast<const char *>(mapping), size};
+            return buffer;
+        }
+
+        bool is_mapped() const { return mapping != nullptr; }
+
+        // Tell the kernel the text before end won't be read again, so its
+        // pages can be dropped. Keeps the resident size flat while a large
+        // mapping is consumed front to back.
+        void release(size_t end) {
+#if !defined(_WIN32)
+            if (!mapping)
+                return;
+            size_t page = (size_t) sysconf(_SC_PAGESIZE);
+            // Never touch whatever is mapped after the file
+            end = std::min(end, size);
+            end -= end % page;
+            if (end > released) {
+                madvise(static_cast<char *>(mapping) + released, end - released,
+                        MADV_DONTNEED);
+                released = end;
+            }
+#endif
+        }
+
+        bool open(const std::string &filename) {
+            close();
+            status = FILE_NOT_READ_CORRECTLY;
+#if !defined(_WIN32)
+            int fd = filename == "-" ? STDIN_FILENO
+                                     : ::open(filename.c_str(), O_RDONLY);
+            if (fd < 0)
+                return false;
+            struct stat info {};
+            bool ok = fstat(fd, &info) == 0;
+            if (ok && S_ISREG(info.st_mode) && info.st_size > 0) {
+                void *p = mmap(nullptr, (size_t) info.st_size, PROT_READ,
+                               MAP_PRIVATE, fd, 0);
+                if (p != MAP_FAILED) {
+                    mapping = p;
+                    size = (size_t) info.st_size;
+                    madvise(mapping, size, MADV_SEQUENTIAL);
+                }
+            }
+            if (ok && !mapping)
+                ok = read_all(fd);
+            if (fd != STDIN_FILENO)
+                ::close(fd);
+            if (!ok)
+                return false;
+#else
+            std::ifstream file(filename, std::ios::binary);
+            if (!file)
+                return false;
+            buffer.assign(std::istreambuf_iterator<char>(file), {});
+#endif
+            status = SUCCESSFUL;
+            return true;
+        }
+
+    private:
+#if !defined(_WIN32)
+        bool read_all(int fd) {
+            size_t used = 0;
+            buffer.resize(64 * 1024);
+            while (true) {
+                if (used == buffer.size())
+                    buffer.resize(buffer.size() * 2);
+                ssize_t n = ::read(fd, buffer.data() + used, buffer.size() - used);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n < 0)
+                    return false;
+                if (n == 0)
+                    break;
+                used += (size_t) n;
+            }
+            buffer.resize(used);
+            return true;
+        }
+#endif
+
+        void close() {
+#if !defined(_WIN32)
+            if (mapping)
+                munmap(mapping, size);
+#endif
+            mapping = nullptr;
+            size = 0;
+            released = 0;
+            buffer.clear();
+        }
+
+        void *mapping = nullptr;
+        size_t size = 0;
+        size_t released = 0;
+        std::string buffer;
+    };
+
     const char* ws = " \t\n\r\f\v";
     // trim from end of string (right)
     inline std::string& rtrim(std::string& s, const char* t = ws)
@@ -0,0 +1,401 @@
+#ifndef BLIBS_SERVE_H
+#define BLIBS_SERVE_H
+
+#include "thread_pool.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// A request/response server over byte streams: stdin/stdout or the
+// connections of a Unix domain socket. Each message is a frame:
+//
+//     4 bytes   payload length, little endian
+//     1 byte    type
+//     length    payload
+//
+// Requests are FRAME_CONVERT, whose payload is handed to the handler, and
+// FRAME_STATS, answered with the latency percentiles as JSON. Responses are
+// FRAME_OK with the handler's output, FRAME_ERROR with a message, or
+// FRAME_STATS.
+//
+// A client may send any number of requests without waiting for replies. They
+// run concurrently on the pool and the replies come back in request order.
+// At most max_in_flight requests per connection are read ahead; past that
+// the server stops reading, and the client's writes block once the pipe or
+// socket buffer is full.
+namespace Serve {
+
+    enum FrameType : unsigned char {
+        FRAME_CONVERT = 'C',
+        FRAME_STATS = 'S',
+        FRAME_OK = 'H',
+        FRAME_ERROR = 'E',
+    };
+
+    constexpr size_t frame_header_size = 5;
+
+    // --- Blocking I/O on file descriptors ---
+
+    // Read exactly size bytes. False at end of input or on an error.
+    inline bool read_all(int fd, void *data, size_t size) {
+        auto *p = static_cast<char *>(data);
+        while (size > 0) {
+            ssize_t n = ::read(fd, p, size);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            p += n;
+            size -= (size_t)n;
+        }
+        return true;
+    }
+
+    inline bool write_all(int fd, const void *data, size_t size) {
+        auto *p = static_cast<const char *>(data);
+        while (size > 0) {
+            ssize_t n = ::write(fd, p, size);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            p += n;
+            size -= (size_t)n;
+        }
+        return true;
+    }
+
+    inline void encode_header(char *header, FrameType type, size_t length) {
+        for (int i = 0; i < 4; ++i)
+            header[i] = (char)((length >> (8 * i)) & 0xff);
+        header[4] = (char)type;
+    }
+
+    inline bool write_frame(int fd, FrameType type, std::string_view payload) {
+        char header[frame_header_size];
+        encode_header(header, type, payload.size());
+        return write_all(fd, header, sizeof(header)) &&
+               write_all(fd, payload.data(), payload.size());
+    }
+
+    // Read the next frame into type and payload. False at the end of the
+    // stream, on an error or for a frame over max_size.
+    inline bool read_frame(int fd, FrameType &type, std::string &payload,
+                           size_t max_size = SIZE_MAX) {
+        unsigned char header[frame_header_size];
+        if (!read_all(fd, header, sizeof(header)))
+            return false;
+        size_t length = (size_t)header[0] | (size_t)header[1] << 8 |
+                        (size_t)header[2] << 16 | (size_t)header[3] << 24;
+        if (length > max_size)
+            return false;
+        type = (FrameType)header[4];
+        payload.resize(length);
+        return read_all(fd, payload.data(), length);
+    }
+
+    // --- Latency ---
+
+    // Counts of latencies in microseconds, in buckets 1/16th of a power of
+    // two wide, so a percentile is within about 6% of the true value.
+    // Recording is lock free and may happen from any thread.
+    class LatencyHistogram {
+    public:
+        void record(uint64_t micros) {
+            ++counts[bucket(micros)];
+            ++total;
+            uint64_t seen = max_seen.load(std::memory_order_relaxed);
+            while (micros > seen &&
+                   !max_seen.compare_exchange_weak(seen, micros))
+                ;
+        }
+
+        uint64_t count() const { return total.load(); }
+        uint64_t max() const { return max_seen.load(); }
+
+        // The latency that fraction (0 to 1) of the requests were within:
+        // the upper edge of the bucket it falls in.
+        uint64_t percentile(double fraction) const {
+            uint64_t n = total.load();
+            if (n == 0)
+                return 0;
+            auto rank = (uint64_t)(fraction * (double)n);
+            if (rank >= n)
+                rank = n - 1;
+            uint64_t seen = 0;
+            for (size_t i = 0; i < bucket_count; ++i) {
+                seen += counts[i].load(std::memory_order_relaxed);
+                if (seen > rank)
+                    return std::min(upper_edge(i), max());
+            }
+            return max();
+        }
+
+        // count, p50, p90, p99, p999 and max as a JSON object.
+        std::string json() const {
+            char text[256];
+            std::snprintf(text, sizeof(text),
+                          "{\"requests\": %llu, \"p50_us\": %llu, "
+                          "\"p90_us\": %llu, \"p99_us\": %llu, "
+                          "\"p999_us\": %llu, \"max_us\": %llu}",
+                          (unsigned long long)count(),
+                          (unsigned long long)percentile(0.5),
+                          (unsigned long long)percentile(0.9),
+                          (unsigned long long)percentile(0.99),
+                          (unsigned long long)percentile(0.999),
+                          (unsigned long long)max());
+            return text;
+        }
+
+    private:
+        static constexpr size_t sub_buckets = 16;
+        static constexpr size_t bucket_count = 64 * sub_buckets;
+
+        // Values below 16 each have a bucket; above, the top bit picks a
+        // group of 16 and the next four bits the bucket in it.
+        static size_t bucket(uint64_t v) {
+            if (v < sub_buckets)
+                return (size_t)v;
+            int top = 63 - __builtin_clzll(v);
+            size_t sub = (size_t)(v >> (top - 4)) & (sub_buckets - 1);
+            return (size_t)(top - 3) * sub_buckets + sub;
+        }
+
+        static uint64_t upper_edge(size_t index) {
+            if (index < sub_buckets)
+                return index;
+            int top = (int)(index / sub_buckets) + 3;
+            uint64_t sub = index % sub_buckets;
+            return ((sub_buckets + sub + 1) << (top - 4)) - 1;
+        }
+
+        std::atomic<uint64_t> counts[bucket_count] = {};
+        std::atomic<uint64_t> total{0};
+        std::atomic<uint64_t> max_seen{0};
+    };
+
+    // --- Server ---
+
+    // Turns a request payload into a response payload. Returning false
+    // sends the output as an error message instead. Called on the pool's
+    // threads, several at once.
+    using Handler = std::function<bool(std::string_view request,
+                                       std::string &response)>;
+
+    class Server {
+    public:
+        Server(ThreadPool &pool, Handler handler, size_t max_in_flight = 64,
+               size_t max_request = 256u << 20)
+            : pool(pool), handler(std::move(handler)),
+              max_in_flight(max_in_flight ? max_in_flight : 1),
+              max_request(max_request) {
+            // A client going away shows up as a failed write
+            signal(SIGPIPE, SIG_IGN);
+        }
+
+        // Serve one connection, reading requests from in and writing the
+        // replies to out, until in ends or out fails.
+        void serve(int in, int out) {
+            Connection connection(out);
+            std::thread writer([&] { write_replies(connection); });
+            read_requests(connection, in);
+            {
+                std::lock_guard<std::mutex> guard(connection.lock);
+                connection.reading = false;
+            }
+            connection.changed.notify_all();
+            writer.join();
+        }
+
+        // Accept connections on a Unix socket at path, each served on its
+        // own thread, until accepting fails. Returns false if the socket
+        // could not be set up; a stale socket file is replaced.
+        bool listen_unix(const std::string &path, std::string &error) {
+            int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+            sockaddr_un address{};
+            address.sun_family = AF_UNIX;
+            if (fd < 0 || path.size() >= sizeof(address.sun_path)) {
+                error = fd < 0 ? std::strerror(errno) : "socket path too long";
+                return false;
+            }
+            std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+            ::unlink(path.c_str());
+            if (::bind(fd, (sockaddr *)&address, sizeof(address)) != 0 ||
+                ::listen(fd, 128) != 0) {
+                error = std::strerror(errno);
+                ::close(fd);
+                return false;
+            }
+            while (true) {
+                int client = ::accept(fd, nullptr, nullptr);
+                if (client < 0 && errno == EINTR)
+                    continue;
+                if (client < 0)
+                    break;
+                std::thread([this, client] {
+                    serve(client, client);
+                    ::close(client);
+                }).detach();
+            }
+            error = std::strerror(errno);
+            ::close(fd);
+            return false;
+        }
+
+        // Time from a request being read to its reply being written.
+        const LatencyHistogram &latency() const { return histogram; }
+
+    private:
+        using Clock = std::chrono::steady_clock;
+
+        struct Reply {
+            FrameType type = FRAME_OK;
+            std::string payload;
+            bool ready = false;
+            Clock::time_point received;
+        };
+
+        struct Connection {
+            explicit Connection(int out) : out(out) {}
+
+            int out;
+            std::mutex lock;
+            std::condition_variable changed;
+            std::deque<std::shared_ptr<Reply>> replies; // In request order
+            bool reading = true;
+            bool broken = false; // out failed; stop reading too
+        };
+
+        void read_requests(Connection &connection, int in) {
+            FrameType type;
+            std::string request;
+            while (read_frame(in, type, request, max_request)) {
+                auto reply = std::make_shared<Reply>();
+                reply->received = Clock::now();
+                {
+                    // Backpressure: wait for room before taking more
+                    std::unique_lock<std::mutex> guard(connection.lock);
+                    connection.changed.wait(guard, [&] {
+                        return connection.broken ||
+                               connection.replies.size() < max_in_flight;
+                    });
+                    if (connection.broken)
+                        return;
+                    connection.replies.push_back(reply);
+                }
+                if (type == FRAME_CONVERT) {
+                    pool.submit([this, &connection, reply,
+                                 request = std::move(request)] {
+                        bool ok = false;
+                        try {
+                            ok = handler(request, reply->payload);
+                        } catch (const std::exception &e) {
+                            reply->payload = e.what();
+                        } catch (...) {
+                            reply->payload = "request failed";
+                        }
+                        reply->type = ok ? FRAME_OK : FRAME_ERROR;
+                        finish(connection, *reply);
+                    });
+                    request = std::string();
+                } else if (type == FRAME_STATS) {
+                    // Filled in when written, to count the replies before it
+                    reply->type = FRAME_STATS;
+                    finish(connection, *reply);
+                } else {
+                    reply->type = FRAME_ERROR;
+                    reply->payload = "unknown request type";
+                    finish(connection, *reply);
+                }
+            }
+        }
+
+        static void finish(Connection &connection, Reply &reply) {
+            {
+                std::lock_guard<std::mutex> guard(connection.lock);
+                reply.ready = true;
+            }
+            connection.changed.notify_all();
+        }
+
+        // Write the replies in order as each becomes ready. Returns once the
+        // reader is done and every reply is out, or out fails.
+        void write_replies(Connection &connection) {
+            while (true) {
+                std::shared_ptr<Reply> reply;
+                {
+                    std::unique_lock<std::mutex> guard(connection.lock);
+                    connection.changed.wait(guard, [&] {
+                        return (!connection.replies.empty() &&
+                                connection.replies.front()->ready) ||
+                               (!connection.reading &&
+                                connection.replies.empty());
+                    });
+                    if (connection.replies.empty())
+                        return;
+                    reply = connection.replies.front();
+                }
+                if (reply->type == FRAME_STATS)
+                    reply->payload = histogram.json();
+                bool ok = write_frame(connection.out, reply->type,
+                                      reply->payload);
+                if (reply->type != FRAME_STATS)
+                    histogram.record(
+                        (uint64_t)std::chrono::duration_cast<
+                            std::chrono::microseconds>(Clock::now() -
+                                                       reply->received)
+                            .count());
+                {
+                    std::lock_guard<std::mutex> guard(connection.lock);
+                    connection.replies.pop_front();
+                    connection.broken |= !ok;
+                }
+                connection.changed.notify_all();
+                if (!ok) {
+                    wait_for_tasks(connection);
+                    return;
+                }
+            }
+        }
+
+        // The pool's tasks refer to the connection, so it has to outlive
+        // them even when nobody is reading the replies any more.
+        static void wait_for_tasks(Connection &connection) {
+            std::unique_lock<std::mutex> guard(connection.lock);
+            while (true) {
+                while (!connection.replies.empty() &&
+                       connection.replies.front()->ready)
+                    connection.replies.pop_front();
+                if (connection.replies.empty() && !connection.reading)
+                    return;
+                connection.changed.wait(guard);
+            }
+        }
+
+        ThreadPool &pool;
+        Handler handler;
+        size_t max_in_flight;
+        size_t max_request;
+        LatencyHistogram histogram;
+    };
+
+} // namespace Serve
+
+#endif //BLIBS_SERVE_H
@@ -0,0 +1,190 @@
+#ifndef BLIBS_SIMD_SCAN_H
+#define BLIBS_SIMD_SCAN_H
+
+#include <cstddef>
+#include <string_view>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define BLIBS_SIMD_SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+// Finding the next byte of interest in a run of text. Most of a Markdown
+// document is plain text that the parsers only have to skip over, so instead
+// of testing one byte at a time the scan compares 16 (SSE2) or 32 (AVX2)
+// bytes per step. SSE2 is always there on x86-64 and compares against each
+// byte of the set in turn; AVX2, picked at run time when the CPU has it,
+// classifies every byte with two nibble table lookups whatever the size of
+// the set. Other targets get the portable table lookup.
+namespace SimdScan {
+
+    class ByteSet;
+
+    // Index of the first byte of data[0, size) in set, or size if none is.
+    using FindFunction = size_t (*)(const char *data, size_t size,
+                                    const ByteSet &set);
+
+    // A set of bytes to search for.
+    class ByteSet {
+    public:
+        // More distinct bytes than this and the scan is done by table lookup.
+        static constexpr size_t max_vector_bytes = 16;
+
+        ByteSet() { choose_find(); }
+        explicit ByteSet(std::string_view bytes) {
+            for (char c : bytes)
+                add(c);
+            choose_find();
+        }
+
+        void add(char c) {
+            auto b = (unsigned char)c;
+            if (member[b])
+                return;
+            member[b] = true;
+            if (count < max_vector_bytes)
+                list[count] = b;
+            ++count;
+            if (b < 0x80)
+                nibbles[b & 0x0f] |= (unsigned char)(1u << (b >> 4));
+            else
+                ascii = false;
+            choose_find();
+        }
+
+        bool contains(char c) const { return member[(unsigned char)c]; }
+
+        // Position of the first byte in the set at or after pos and before
+        // end, or npos.
+        size_t find(std::string_view text, size_t pos = 0,
+                    size_t end = std::string_view::npos) const {
+            end = end < text.size() ? end : text.size();
+            if (pos >= end)
+                return std::string_view::npos;
+            size_t i = find_fn(text.data() + pos, end - pos, *this);
+            return i == end - pos ? std::string_view::npos : pos + i;
+        }
+
+        // The bytes, for the vector scans; valid when vector_bytes() is.
+        const unsigned char *bytes() const { return list; }
+        size_t size() const { return count; }
+        bool vector_bytes() const {
+            return count > 0 && count <= max_vector_bytes;
+        }
+        // For the nibble lookup, valid when every byte is below 0x80: bit h
+        // of nibbles()[l] is set if the byte 0xhl is in the set.
+        const unsigned char *nibbles_table() const { return nibbles; }
+        bool ascii_only() const { return ascii; }
+
+    private:
+        void choose_find();
+
+        bool member[256] = {};
+        unsigned char list[max_vector_bytes] = {};
+        size_t count = 0;
+        unsigned char nibbles[16] = {};
+        bool ascii = true;
+        FindFunction find_fn = nullptr;
+    };
+
+    inline size_t find_scalar(const char *data, size_t size,
+                              const ByteSet &set) {
+        for (size_t i = 0; i < size; ++i)
+            if (set.contains(data[i]))
+                return i;
+        return size;
+    }
+
+#ifdef BLIBS_SIMD_SCAN_X86
+    // Markup is dense, so the next hit is often close by. The vector scans
+    // look at this many bytes one at a time before setting up.
+    constexpr size_t scalar_prefix = 16;
+
+    // Compares each block against every byte of the set.
+    inline size_t find_sse2_blocks(const char *data, size_t size,
+                                   const ByteSet &set) {
+        __m128i needles[ByteSet::max_vector_bytes];
+        size_t count = set.size();
+        for (size_t n = 0; n < count; ++n)
+            needles[n] = _mm_set1_epi8((char)set.bytes()[n]);
+        size_t i = 0;
+        for (; i + 16 <= size; i += 16) {
+            __m128i block = _mm_loadu_si128((const __m128i *)(data + i));
+            __m128i hits = _mm_cmpeq_epi8(block, needles[0]);
+            for (size_t n = 1; n < count; ++n)
+                hits = _mm_or_si128(hits, _mm_cmpeq_epi8(block, needles[n]));
+            if (int mask = _mm_movemask_epi8(hits))
+                return i + (size_t)__builtin_ctz((unsigned)mask);
+        }
+        return i + find_scalar(data + i, size - i, set);
+    }
+
+    inline size_t find_sse2(const char *data, size_t size, const ByteSet &set) {
+        size_t head = size < scalar_prefix ? size : scalar_prefix;
+        size_t hit = find_scalar(data, head, set);
+        if (hit < head || head == size)
+            return hit;
+        if (!set.vector_bytes())
+            return head + find_scalar(data + head, size - head, set);
+        return head + find_sse2_blocks(data + head, size - head, set);
+    }
+
+    // Looks up the low nibble of each byte to get the high nibbles that go
+    // with it, then checks the byte's own high nibble against those.
+    __attribute__((target("avx2"))) inline size_t
+    find_avx2_blocks(const char *data, size_t size, const ByteSet &set) {
+        const __m256i low_table = _mm256_broadcastsi128_si256(
+            _mm_loadu_si128((const __m128i *)set.nibbles_table()));
+        const __m256i high_bits = _mm256_setr_epi8(
+            1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0, //
+            1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0);
+        const __m256i low_mask = _mm256_set1_epi8(0x0f);
+        const __m256i zero = _mm256_setzero_si256();
+        size_t i = 0;
+        for (; i + 32 <= size; i += 32) {
+            __m256i block = _mm256_loadu_si256((const __m256i *)(data + i));
+            __m256i low = _mm256_and_si256(block, low_mask);
+            __m256i high =
+                _mm256_and_si256(_mm256_srli_epi16(block, 4), low_mask);
+            __m256i matched =
+                _mm256_and_si256(_mm256_shuffle_epi8(low_table, low),
+                                 _mm256_shuffle_epi8(high_bits, high));
+            auto misses =
+                (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(matched, zero));
+            if (misses != 0xffffffffu)
+                return i + (size_t)__builtin_ctz(~misses);
+        }
+        return i + find_sse2(data + i, size - i, set);
+    }
+
+    __attribute__((target("avx2"))) inline size_t
+    find_avx2(const char *data, size_t size, const ByteSet &set) {
+        size_t head = size < scalar_prefix ? size : scalar_prefix;
+        size_t hit = find_scalar(data, head, set);
+        if (hit < head || head == size)
+            return hit;
+        if (!set.ascii_only())
+            return head + find_sse2(data + head, size - head, set);
+        return head + find_avx2_blocks(data + head, size - head, set);
+    }
+
+    inline bool has_avx2() {
+        static const bool avx2 = __builtin_cpu_supports("avx2");
+        return avx2;
+    }
+#endif
+
+    // The fastest scan this CPU can run.
+    inline FindFunction best_find() {
+#ifdef BLIBS_SIMD_SCAN_X86
+        return has_avx2() ? find_avx2 : find_sse2;
+#else
+        return find_scalar;
+#endif
+    }
+
+    inline void ByteSet::choose_find() { find_fn = best_find(); }
+
+} // namespace SimdScan
+
+#endif //BLIBS_SIMD_SCAN_H
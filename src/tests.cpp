@@ -2,9 +2,19 @@
 // Created by Bradley Pearce on 08/07/2025.
 //
 #include "markdown.h"
+#include "mdc_c.h"
+#include "output_cache.h"
+#include "pipeline_io.h"
+#include "read_lines.h"
+#include "serve.h"
+#include "thread_pool.h"
+#include "watch.h"
+#include <filesystem>
 #include <functional> // For std::function
 #include <iostream>
 #include <iostream> // For std::cout
+#include <set>
+#include <sstream>
 #include <map> // Potentially useful for internal parsing in your converter, but not directly used by tests
 #include <string> // For std::string
 #include <vector> // For std::vector
@@ -221,7 +231,1116 @@ void test_LinkAndFootnoteInteraction() {
   ASSERT_EQ(actual_html, expected_html, "Link and Footnote Interaction Test");
 }
 
+// --- INLINE SCANNER TESTS ---
+
+// Test case for nested emphasis and an image inside link text
+void test_NestedInline() {
+  std::string markdown_input =
+      "*a **b** c* ***d*** [![x](y.png) **z**](http://e.com)";
+  std::string expected_html =
+      "<p><em>a <strong>b</strong> c</em> <em><strong>d</strong></em> "
+      "<a href=\"http://e.com\"><img src=\"y.png\" alt=\"x\"> "
+      "<strong>z</strong></a></p>\n";
+  std::string actual_html = convert_markdown_to_html(markdown_input);
+  ASSERT_EQ(actual_html, expected_html, "Nested Inline Test");
+}
+
+// The single pass scanner must agree with the regex pipeline it replaced
+void test_ScannerMatchesRegex() {
+  std::string inputs[] = {
+      "**a*",
+      "*a**b*",
+      "**a***b**",
+      "***a**",
+      "[](a](b)",
+      "[a [b](c) d](e)",
+      "[a [^1](u)",
+      "![a]b](c) [^2](x)",
+      "![^1](u) ![](u) [x](())",
+      "[[[[[a](b) ![![![c](d)",
+      "# Title\n\n- *one*\n- **two**\n1. [three](3)\n\n[^1]: **note**",
+  };
+  for (auto &markdown_input : inputs) {
+    ASSERT_EQ(convert_markdown_to_html(markdown_input, INLINE_SCANNER),
+              convert_markdown_to_html(markdown_input, INLINE_REGEX),
+              "Scanner Matches Regex: " + markdown_input);
+  }
+  // Over a whole text, emphasis pairs across lines in both engines
+  std::string multi_line = "a * b\nc * d";
+  ASSERT_EQ(process_inline_markdown(multi_line, INLINE_SCANNER),
+            process_inline_markdown(multi_line, INLINE_REGEX),
+            "Scanner Matches Regex: multi-line text");
+}
+
+// A converted document pairs emphasis within each block, never across lines
+void test_EmphasisStaysInBlock() {
+  std::string markdown_input = "a * b\nc * d\n- *x\n- y*";
+  std::string expected_html = "<p>a * b</p>\n<p>c * d</p>\n"
+                              "<ul>\n<li>*x</li>\n<li>y*</li>\n</ul>\n";
+  std::string actual_html = convert_markdown_to_html(markdown_input);
+  ASSERT_EQ(actual_html, expected_html, "Emphasis Stays In Block Test");
+}
+
+// --- SYNTAX TREE TESTS ---
+
+// The tree can be inspected and rendered again without another parse
+void test_AstStructure() {
+  std::string markdown_input = "# Hi\n- a **b**\n- [c](d)\n\n[^1]: n";
+  MarkdownAst ast = parse_markdown(markdown_input);
+  std::string types;
+  for (const auto &node : ast.nodes)
+    types += std::to_string(node.type) + " ";
+  // document, heading, text, list, item, text, strong, text, item, link,
+  // text, footnotes, footnote def, text
+  ASSERT_EQ(types, std::string("0 1 8 3 5 8 9 8 5 11 8 6 7 8 "),
+            "AST Structure Test");
+  ASSERT_EQ(ast.url(ast.nodes[9]), std::string_view("d"), "AST Span Test");
+  ASSERT_EQ(render_html(ast), convert_markdown_to_html(markdown_input),
+            "AST Render Test");
+}
+
+// Test case for a custom rule registered on a shared rule table
+void test_CustomInlineRule() {
+  InlineRuleTable rules;
+  rules.add_rule('~', R"(~~([^~]+)~~)", [](const std::cmatch &match) {
+    return "<del>" + match[1].str() + "</del>";
+  });
+  std::string markdown_input = "Some ~~old~~ **new** text";
+  std::string expected_html =
+      "<p>Some <del>old</del> <strong>new</strong> text</p>\n";
+  for (auto engine : {INLINE_SCANNER, INLINE_REGEX}) {
+    std::string actual_html = convert_markdown_to_html(
+        markdown_input, ConvertOptions{.engine = engine, .rules = &rules});
+    ASSERT_EQ(actual_html, expected_html, "Custom Inline Rule Test");
+  }
+}
+
+// Test case for an ordered list, closed by a paragraph
+void test_OrderedList() {
+  std::string markdown_input = "1. One\n2. Two\nAfter";
+  std::string expected_html =
+      "<ol>\n<li>One</li>\n<li>Two</li>\n</ol>\n<p>After</p>\n";
+  std::string actual_html = convert_markdown_to_html(markdown_input);
+  ASSERT_EQ(actual_html, expected_html, "Ordered List Test");
+}
+
+// A footnote definition between two items does not split the list
+void test_FootnoteInsideList() {
+  std::string markdown_input = "- a[^1]\n[^1]: Note\n- b";
+  std::string expected_html =
+      "<ul>\n<li>a<sup><a href=\"#fn1\" id=\"fnref1\">1</a></sup></li>\n"
+      "<li>b</li>\n</ul>\n<div class=\"footnotes\">\n<hr>\n<ol>\n"
+      "<li id=\"fn1\">Note <a href=\"#fnref1\" "
+      "class=\"footnote-backref\">&#8617;</a></li>\n</ol>\n</div>\n";
+  std::string actual_html = convert_markdown_to_html(markdown_input);
+  ASSERT_EQ(actual_html, expected_html, "Footnote Inside List Test");
+}
+
+// --- STREAMING TESTS ---
+
+// Feeding the stream in chunks of any size gives the same HTML as a batch
+// conversion
+void test_StreamMatchesBatch() {
+  std::string markdown_input =
+      "# Title\n\nSome **bold** and [a link](http://x.com)[^2].\n"
+      "- one\n- *two*\n1. three\n\n[^2]: The *note*.\n"
+      "[^1]: First.\nLast line without newline";
+  std::string expected_html = convert_markdown_to_html(markdown_input);
+  for (size_t chunk : {1, 3, 7, 64}) {
+    std::string actual_html;
+    MarkdownStream stream(output_iterator_sink(std::back_inserter(actual_html)));
+    for (size_t i = 0; i < markdown_input.size(); i += chunk)
+      stream.write(std::string_view(markdown_input).substr(i, chunk));
+    stream.finish();
+    ASSERT_EQ(actual_html, expected_html,
+              "Stream Matches Batch, chunk " + std::to_string(chunk));
+  }
+}
+
+// Pull conversion from an istream into an ostream
+void test_StreamFromIstream() {
+  std::istringstream in("## Heading\r\ntext\n");
+  std::ostringstream out;
+  convert_markdown_stream(in, out);
+  ASSERT_EQ(out.str(), std::string("<h2>Heading\r</h2>\n<p>text</p>\n"),
+            "Stream From Istream Test");
+}
+
+// --- INPUT TESTS ---
+
+// A mapped file converts the same as the string it holds
+void test_MappedFile() {
+  std::string markdown_input = "# Mapped\n- item\n";
+  auto path = std::filesystem::temp_directory_path() / "mdc_mapped_test.md";
+  std::ofstream(path, std::ios::binary) << markdown_input;
+  TextFileParser::MappedFile file(path.string());
+  ASSERT_EQ(file.status == TextFileParser::SUCCESSFUL, true,
+            "Mapped File Opened Test");
+  ASSERT_EQ(file.text(), std::string_view(markdown_input),
+            "Mapped File Text Test");
+  file.release(file.text().size());
+  ASSERT_EQ(convert_markdown_to_html(std::string(file.text())),
+            convert_markdown_to_html(markdown_input),
+            "Mapped File After Release Test");
+  std::filesystem::remove(path);
+  TextFileParser::MappedFile missing("/nonexistent/mdc.md");
+  ASSERT_EQ(missing.status == TextFileParser::FILE_NOT_READ_CORRECTLY, true,
+            "Mapped File Missing Test");
+}
+
+// --- THREAD POOL TESTS ---
+
+// Every task runs once, including tasks submitted by other tasks, and the
+// first exception is passed on by wait()
+void test_ThreadPool() {
+  std::atomic<int> count{0};
+  {
+    ThreadPool pool(4);
+    for (int i = 0; i < 1000; ++i)
+      pool.submit([&, i] {
+        count.fetch_add(1);
+        if (i % 100 == 0)
+          pool.submit([&] { count.fetch_add(1); });
+      });
+    pool.wait();
+    ASSERT_EQ(count.load(), 1010, "Thread Pool Runs Every Task Test");
+    pool.submit([] { throw std::runtime_error("task failed"); });
+    bool thrown = false;
+    try {
+      pool.wait();
+    } catch (const std::runtime_error &) {
+      thrown = true;
+    }
+    ASSERT_EQ(thrown, true, "Thread Pool Exception Test");
+  }
+}
+
+// --- PARALLEL CONVERSION TESTS ---
+
+// Pieces end before a heading or paragraph or after a blank line, never
+// inside a list
+void test_SplitMarkdownBlocks() {
+  std::string_view markdown_input =
+      "# A\n- one\n[^1]: x\n- two\n\n\ntext\n## B\nend";
+  std::string joined;
+  for (auto piece : split_markdown_blocks(markdown_input, 1))
+    joined += "[" + std::string(piece) + "]";
+  ASSERT_EQ(joined,
+            std::string("[# A\n- one\n[^1]: x\n- two\n\n][\n][text\n][## B\n]"
+                        "[end]"),
+            "Split Markdown Blocks Test");
+}
+
+// Any piece size gives the same HTML as a serial conversion, footnotes
+// included
+void test_ParallelMatchesSerial() {
+  std::string markdown_input =
+      "# Title\n\nSome **bold** and [a link](http://x.com)[^2].\n"
+      "- one\n- *two*\n[^3]: Early.\n- three\n\n## Next\n1. first\n"
+      "2. second\n\n[^2]: The *note*.\n\n[^3]: Replaced.\n"
+      "[^1]: First.\nLast line without newline";
+  std::string expected_html = convert_markdown_to_html(markdown_input);
+  ThreadPool pool(3);
+  for (size_t piece : {1, 5, 17, 4096}) {
+    ASSERT_EQ(convert_markdown_parallel(markdown_input, pool, {}, piece),
+              expected_html,
+              "Parallel Matches Serial, piece " + std::to_string(piece));
+  }
+}
+
+// --- SIMD SCAN TESTS ---
+
+// Every vector scan finds the same byte as the scalar one, from every offset
+// and for small, large and non-ASCII sets
+void test_SimdScanMatchesScalar() {
+  std::string text;
+  unsigned seed = 7;
+  for (int i = 0; i < 700; ++i) {
+    seed = seed * 1103515245 + 12345;
+    // Mostly letters, with the odd special character or high byte
+    unsigned r = (seed >> 16) % 64;
+    text += r < 52 ? (char)('a' + r % 26) : "*[]!()\n<&\xe9\x80 #"[r - 52];
+  }
+  std::vector<SimdScan::FindFunction> finds = {SimdScan::best_find()};
+#ifdef BLIBS_SIMD_SCAN_X86
+  finds.push_back(SimdScan::find_sse2);
+  if (SimdScan::has_avx2())
+    finds.push_back(SimdScan::find_avx2);
+#endif
+  for (std::string_view bytes :
+       {"*[]!()\n<&", "!", "\xe9&", "0123456789abcdefz*", ""}) {
+    SimdScan::ByteSet set(bytes);
+    bool same = true;
+    for (size_t pos = 0; pos < text.size(); ++pos) {
+      for (size_t end : {text.size(), pos + 5, pos + 40}) {
+        size_t length = std::min(end, text.size()) - pos;
+        size_t expected = SimdScan::find_scalar(text.data() + pos, length, set);
+        for (auto find : finds)
+          same &= find(text.data() + pos, length, set) == expected;
+      }
+    }
+    ASSERT_EQ(same, true, "Simd Scan Matches Scalar, set \"" +
+                              std::string(bytes) + "\"");
+  }
+  SimdScan::ByteSet stars("*");
+  ASSERT_EQ(stars.find("abc*", 0), (size_t)3, "Simd Scan Find Test");
+  ASSERT_EQ(stars.find("abc*", 0, 3), std::string_view::npos,
+            "Simd Scan Find End Test");
+}
+
+// --- INCREMENTAL CONVERSION TESTS ---
+
+// After every edit the document converts the same as its whole text, and the
+// patch applied to the old blocks gives the new ones
+void test_DocumentEdits() {
+  Document doc("# Title\n\nSome *text*[^1].\n- one\n- two\n\n[^1]: Note.\n");
+  struct Edit {
+    size_t offset, length;
+    std::string_view text;
+  };
+  for (Edit edit : std::initializer_list<Edit>{
+           {9, 0, "More "},          // Inside a paragraph
+           {0, 0, "Intro\n"},        // Before everything
+           {30, 0, "\n"},            // Splits the list with a blank line
+           {30, 1, ""},              // and joins it again
+           {0, 200, "- a\n- b"},     // Replaces the whole text
+           {7, 0, "\n\n[^2]: Two\n"}, // Appends a footnote
+           {7, 2, ""},               // that now ends the list
+           {0, 0, "x[^2] **b"},      // Emphasis stays in its block
+           {3, 3, "**"}}) {
+    std::vector<std::string> blocks;
+    for (size_t i = 0; i < doc.block_count(); ++i)
+      blocks.emplace_back(doc.block_html(i));
+    DocumentPatch patch = doc.edit(edit.offset, edit.length, edit.text);
+    blocks.erase(blocks.begin() + (ptrdiff_t)patch.first,
+                 blocks.begin() + (ptrdiff_t)(patch.first + patch.removed));
+    blocks.insert(blocks.begin() + (ptrdiff_t)patch.first,
+                  patch.inserted.begin(), patch.inserted.end());
+    std::string patched;
+    for (auto &block : blocks)
+      patched += block;
+    std::string expected_html = convert_markdown_to_html(doc.text());
+    ASSERT_EQ(doc.html(), expected_html,
+              "Document Edit Test, text \"" + doc.text() + "\"");
+    ASSERT_EQ(patched + doc.footnotes_html(), expected_html,
+              "Document Patch Test, text \"" + doc.text() + "\"");
+  }
+}
+
+// An edit inside one paragraph of many only touches that paragraph
+void test_DocumentPatchIsLocal() {
+  std::string markdown_input;
+  for (int i = 0; i < 100; ++i)
+    markdown_input += "Paragraph " + std::to_string(i) + "\n\n";
+  Document doc(markdown_input);
+  size_t offset = markdown_input.find("Paragraph 50");
+  DocumentPatch patch = doc.edit(offset, 0, "*");
+  ASSERT_EQ(patch.first, (size_t)50, "Document Patch Is Local, first");
+  ASSERT_EQ(patch.removed, (size_t)1, "Document Patch Is Local, removed");
+  ASSERT_EQ(patch.inserted.size() == 1 &&
+                patch.inserted[0] == "<p>*Paragraph 50</p>\n",
+            true, "Document Patch Is Local, inserted");
+}
+
+// --- OUTPUT CACHE TESTS ---
+
+// Entries round trip, keys depend on input and settings, and trimming drops
+// the least recently used entry first
+void test_OutputCache() {
+  namespace fs = std::filesystem;
+  fs::path dir = fs::temp_directory_path() / "mdc_cache_test";
+  fs::remove_all(dir);
+  OutputCache cache(dir, 10);
+  std::string key = OutputCache::key("# a", "mdc 1");
+  ASSERT_EQ(key == OutputCache::key("# a", "mdc 1"), true,
+            "Output Cache Key Stable Test");
+  ASSERT_EQ(key == OutputCache::key("# b", "mdc 1"), false,
+            "Output Cache Key Input Test");
+  ASSERT_EQ(key == OutputCache::key("# a", "mdc 2"), false,
+            "Output Cache Key Settings Test");
+
+  std::ostringstream out;
+  ASSERT_EQ(cache.fetch("k1", out, 3), false, "Output Cache Miss Test");
+  for (std::string key : {"k1", "k2"}) {
+    fs::path temp = cache.temp_path();
+    std::ofstream(temp, std::ios::binary) << "page " << key;
+    cache.commit(temp, key);
+  }
+  ASSERT_EQ(cache.fetch("k1", out, 3), true, "Output Cache Hit Test");
+  ASSERT_EQ(out.str(), std::string("page k1"), "Output Cache Content Test");
+  ASSERT_EQ(cache.stats.bytes_saved.load(), (uint64_t)3,
+            "Output Cache Bytes Saved Test");
+
+  // k2 was used longest ago, and the two entries are over the 10 byte cap
+  fs::last_write_time(dir / "k2.html", fs::file_time_type::clock::now() -
+                                           std::chrono::hours(1));
+  cache.trim();
+  ASSERT_EQ(fs::exists(dir / "k1.html") && !fs::exists(dir / "k2.html"), true,
+            "Output Cache Evicts Least Recently Used Test");
+  fs::remove_all(dir);
+}
+
+// --- INSTRUMENTATION TESTS ---
+
+// Both engines record their phases and count the same rule matches
+void test_ConvertStats() {
+  std::string input = "# Title\n\nA [link](u) and **bold** text.\n\n"
+                      "Short *one*.\n";
+  ConvertStats scanner;
+  convert_markdown_to_html(
+      input, ConvertOptions{.engine = INLINE_SCANNER, .stats = &scanner});
+  std::string phases;
+  for (const auto &phase : scanner.phases)
+    phases += std::string(phase.name) + ";";
+  ASSERT_EQ(phases, std::string("parse;render;"), "Stats Phases Test");
+  ASSERT_EQ(scanner.rule_matches["link"], (size_t)1, "Stats Link Match Test");
+  ASSERT_EQ(scanner.rule_matches["strong"], (size_t)1,
+            "Stats Strong Match Test");
+  ASSERT_EQ(scanner.largest_block, (size_t)32, "Stats Largest Block Test");
+
+  ConvertStats regex;
+  convert_markdown_to_html(
+      input, ConvertOptions{.engine = INLINE_REGEX, .stats = &regex});
+  ASSERT_EQ(regex.rule_matches == scanner.rule_matches, true,
+            "Stats Engines Agree Test");
+  ASSERT_EQ(regex.largest_block, scanner.largest_block,
+            "Stats Engines Largest Block Test");
+}
+
+// --- SCRATCH MEMORY TESTS ---
+
+// Once the arena and the output have grown, converting again reuses them
+void test_ArenaReuse() {
+  std::string input;
+  for (int i = 0; i < 200; ++i)
+    input += "# Part " + std::to_string(i) +
+             "\n\nSome *text* with [a link](u)[^1] and **bold**.\n- one\n"
+             "- two\n1. three\n[^1]: A note\n";
+  std::string expected = convert_markdown_to_html(input);
+
+  Arena arena(256);
+  std::string html;
+  size_t chunks = 0;
+  const char *data = nullptr;
+  for (int run = 0; run < 3; ++run) {
+    arena.reset();
+    convert_markdown_to_html(input, html, {.scratch = &arena});
+    ASSERT_EQ(html, expected, "Arena Conversion Output Test");
+    if (run == 2) {
+      ASSERT_EQ(arena.chunk_allocations(), chunks, "Arena Steady State Test");
+      ASSERT_EQ(html.data() == data, true, "Arena Output Reused Test");
+    }
+    chunks = arena.chunk_allocations();
+    data = html.data();
+  }
+}
+
+// Allocations are aligned as asked and reset() hands the memory back
+void test_ArenaAllocate() {
+  Arena arena(64);
+  void *a = arena.allocate(3, 1);
+  void *b = arena.allocate(24, 16);
+  void *c = arena.allocate(1000, 8);
+  ASSERT_EQ((uintptr_t)b % 16, (uintptr_t)0, "Arena Alignment Test");
+  ASSERT_EQ(a != b && b != c, true, "Arena Distinct Test");
+  size_t capacity = arena.capacity();
+  arena.reset();
+  ASSERT_EQ(arena.capacity(), capacity, "Arena Reset Keeps Memory Test");
+  void *d = arena.allocate(1000, 8);
+  ASSERT_EQ(d != nullptr && arena.capacity() == capacity, true,
+            "Arena Reuse After Reset Test");
+}
+
+// --- EMBEDDING TESTS ---
+
+// A reused converter gives the same output as a fresh conversion, and custom
+// rules stay with the converter that added them
+void test_Converter() {
+  Converter converter;
+  std::string doc = "# Hi\n\nSome **bold** [link](u)[^1].\n[^1]: Note\n";
+  for (int run = 0; run < 3; ++run)
+    ASSERT_EQ(std::string(converter.convert(doc)),
+              convert_markdown_to_html(doc), "Converter Reuse Test");
+
+  Converter custom;
+  custom.add_rule('~', R"(~~([^~]+)~~)", [](const std::cmatch &match) {
+    return "<del>" + match[1].str() + "</del>";
+  });
+  ASSERT_EQ(std::string(custom.convert("a ~~b~~\n")),
+            std::string("<p>a <del>b</del></p>\n"), "Converter Rule Test");
+  ASSERT_EQ(std::string(converter.convert("a ~~b~~\n")),
+            std::string("<p>a ~~b~~</p>\n"), "Converter Rule Kept Apart Test");
+}
+
+// The C interface passes the HTML to the callback
+void test_CInterface() {
+  mdc_converter *ctx = mdc_new(0);
+  std::string html;
+  auto append = [](void *user_data, const char *data, size_t len) {
+    static_cast<std::string *>(user_data)->append(data, len);
+  };
+  std::string doc = "- one\n- *two*\n";
+  ASSERT_EQ(mdc_convert(ctx, doc.data(), doc.size(), append, &html), MDC_OK,
+            "C Interface Status Test");
+  ASSERT_EQ(html, convert_markdown_to_html(doc), "C Interface Output Test");
+  ASSERT_EQ(mdc_convert(ctx, doc.data(), doc.size(), nullptr, nullptr),
+            MDC_ERROR, "C Interface Error Test");
+  ASSERT_EQ(std::string(mdc_last_error(ctx)).empty(), false,
+            "C Interface Error Message Test");
+  mdc_free(ctx);
+}
+
+// --- SERVER TESTS ---
+
+// Percentiles land within a bucket's width of the true value
+void test_LatencyHistogram() {
+  Serve::LatencyHistogram histogram;
+  for (uint64_t micros = 1; micros <= 1000; ++micros)
+    histogram.record(micros);
+  uint64_t p50 = histogram.percentile(0.5);
+  uint64_t p99 = histogram.percentile(0.99);
+  ASSERT_EQ(p50 >= 500 && p50 <= 532, true, "Histogram p50 Test");
+  ASSERT_EQ(p99 >= 990 && p99 <= 1000, true, "Histogram p99 Test");
+  ASSERT_EQ(histogram.max(), (uint64_t)1000, "Histogram Max Test");
+  ASSERT_EQ(histogram.count(), (uint64_t)1000, "Histogram Count Test");
+}
+
+// Pipelined requests are answered in order, whatever order they finish in
+void test_ServerPipelining() {
+  int fds[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0, "Socket Pair Test");
+  ThreadPool pool(3);
+  Serve::Server server(pool, [](std::string_view request,
+                                std::string &response) {
+    // Later requests finish first
+    std::this_thread::sleep_for(std::chrono::milliseconds(
+        request.size() > 3 ? 0 : 20));
+    response = convert_markdown_to_html(std::string(request));
+    return request != "bad";
+  });
+  std::thread serving([&] { server.serve(fds[0], fds[0]); });
+
+  std::vector<std::string> requests = {"# a", "bad", "*b* and more"};
+  for (const auto &request : requests)
+    Serve::write_frame(fds[1], Serve::FRAME_CONVERT, request);
+  Serve::write_frame(fds[1], Serve::FRAME_STATS, "");
+  shutdown(fds[1], SHUT_WR);
+
+  std::string replies;
+  Serve::FrameType type;
+  std::string reply;
+  for (int i = 0; i < 4 && Serve::read_frame(fds[1], type, reply); ++i)
+    replies += std::string(1, (char)type) + ":" + reply.substr(0, 14) + ";";
+  serving.join();
+  close(fds[0]);
+  close(fds[1]);
+  ASSERT_EQ(replies,
+            std::string("H:<h1>a</h1>\n;E:<p>bad</p>\n;H:<p><em>b</em> ;"
+                        "S:{\"requests\": 3;"),
+            "Server Reply Order Test");
+  ASSERT_EQ(server.latency().count(), (uint64_t)3, "Server Latency Test");
+}
+
+// --- LIMITS TESTS ---
+
+// Lines, nesting and footnotes past the limits come out as escaped text
+void test_ConvertLimits() {
+  ConvertOptions options{
+      .limits = {.max_line = 20, .max_nesting = 1, .max_footnotes = 1}};
+  ASSERT_EQ(convert_markdown_to_html("*a **b** c*\n", options),
+            std::string("<p><em>a **b** c</em></p>\n"),
+            "Limits Nesting Test");
+  ASSERT_EQ(convert_markdown_to_html("A line that is <far> too long\n",
+                                     options),
+            std::string("<p>A line that is &lt;far&gt; too long</p>\n"),
+            "Limits Line Test");
+  ASSERT_EQ(convert_markdown_to_html("x[^1].\n[^1]: one\n[^2]: two\n",
+                                     options),
+            std::string("<p>x<sup><a href=\"#fn1\" id=\"fnref1\">1</a></sup>."
+                        "</p>\n<p>[^2]: two</p>\n<div class=\"footnotes\">\n"
+                        "<hr>\n<ol>\n<li id=\"fn1\">one <a href=\"#fnref1\" "
+                        "class=\"footnote-backref\">&#8617;</a></li>\n</ol>\n"
+                        "</div>\n"),
+            "Limits Footnotes Test");
+
+  std::string error;
+  try {
+    convert_markdown_to_html("# Too big\n", {.limits = {.max_input = 4}});
+  } catch (const ConvertLimitError &e) {
+    error = e.what();
+  }
+  ASSERT_EQ(error.empty(), false, "Limits Input Test");
+}
+
+// Streaming and parallel conversion degrade the same way as the batch one
+void test_LimitsStreamAndParallel() {
+  ConvertOptions options{
+      .limits = {.max_line = 24, .max_nesting = 2, .max_footnotes = 2}};
+  std::string doc;
+  for (int i = 1; i <= 4; ++i)
+    doc += "Para *one **two [three *four*](u)** x* y[^" + std::to_string(i) +
+           "].\n\n- an item that is <much> too long for the limit\n\n[^" +
+           std::to_string(i) + "]: note\n";
+  std::string expected = convert_markdown_to_html(doc, options);
+  for (size_t chunk : {1, 5, 64}) {
+    std::string actual;
+    MarkdownStream stream(output_iterator_sink(std::back_inserter(actual)),
+                          options);
+    for (size_t i = 0; i < doc.size(); i += chunk)
+      stream.write(std::string_view(doc).substr(i, chunk));
+    stream.finish();
+    ASSERT_EQ(actual, expected,
+              "Limits Stream Test, chunk " + std::to_string(chunk));
+  }
+  ThreadPool pool(3);
+  ASSERT_EQ(convert_markdown_parallel(doc, pool, options, 64), expected,
+            "Limits Parallel Test");
+
+  // A fence past max_line is text, so the next one opens a code block
+  std::string fenced = "```" + std::string(100, 'a') + "\nb\n```\n# c\n\nd\n";
+  ConvertOptions short_lines{.limits = {.max_line = 50}};
+  for (size_t piece : {1, 8})
+    ASSERT_EQ(convert_markdown_parallel(fenced, pool, short_lines, piece),
+              convert_markdown_to_html(fenced, short_lines),
+              "Limits Parallel Long Fence Test, piece " +
+                  std::to_string(piece));
+}
+
+// Linear mode leaves custom rules out, as they may backtrack
+void test_LinearSkipsCustomRules() {
+  Converter converter({.limits = {.linear = true}});
+  converter.add_rule('~', R"(~~([^~]+)~~)", [](const std::cmatch &match) {
+    return "<del>" + match[1].str() + "</del>";
+  });
+  ASSERT_EQ(std::string(converter.convert("a ~~b~~ **c**\n")),
+            std::string("<p>a ~~b~~ <strong>c</strong></p>\n"),
+            "Linear Custom Rule Test");
+}
+
+// A link search that matched but lost to a reference link, or the other way
+// round, is reused by the '[' after it. A quarter megabyte line converts in
+// well under a second; searching again at every '[' took minutes.
+void test_LinearMixedLinks() {
+  ConvertOptions linear{.limits = {.linear = true}};
+  ASSERT_EQ(convert_markdown_to_html("[a][b] [c][d] [x](y)\n", linear),
+            std::string("<p>[a][b] [c][d] <a href=\"y\">x</a></p>\n"),
+            "Linear Mixed Links Test");
+  ASSERT_EQ(convert_markdown_to_html("[!^]() [!^]() [x][y]\n\n[y]: u\n",
+                                     linear),
+            std::string("<p><a href=\") [!^](\">!^</a> <a href=\"u\">x</a>"
+                        "</p>\n"),
+            "Linear Mixed Links Reference Test");
+
+  const std::pair<const char *, const char *> lines[] = {
+      {"[a][b] ", "[x](y)"},
+      {"[a]]", "[x](y)"},
+      {"[!^]()", "[x][y]"},
+      {"[a][b](", ")"},
+  };
+  for (const auto &[pattern, tail] : lines) {
+    std::string text;
+    while (text.size() < (256 << 10))
+      text += pattern;
+    text += std::string(tail) + "\n";
+    auto start = std::chrono::steady_clock::now();
+    convert_markdown_to_html(text, linear);
+    std::chrono::duration<double> took =
+        std::chrono::steady_clock::now() - start;
+    ASSERT_EQ(took.count() < 1.0, true,
+              std::string("Linear Mixed Links Time Test, ") + pattern + tail);
+  }
+}
+
+// --- FEATURES TESTS ---
+
+// Syntax left out of a converter's features comes out as plain text
+void test_FeatureConverter() {
+  Converter<Features::Headings | Features::Lists | Features::Links> minimal;
+  ASSERT_EQ(std::string(minimal.convert("# T *a*\n- [l](u)[^1]\n[^1]: n\n")),
+            std::string("<h1>T *a*</h1>\n<ul>\n<li><a href=\"u\">l</a>[^1]"
+                        "</li>\n</ul>\n<p>[^1]: n</p>\n"),
+            "Feature Converter Test");
+
+  // On a document using only its features, it matches the full converter
+  std::string doc = "# Title\n\nSome [link](u) text.\n- one\n1. [two](v)\n";
+  ASSERT_EQ(std::string(minimal.convert(doc)), convert_markdown_to_html(doc),
+            "Feature Converter Matches Full Test");
+
+  Converter<Features::Emphasis> emphasis;
+  ASSERT_EQ(std::string(emphasis.convert("# *a* [b](u)\n")),
+            std::string("<p># <em>a</em> [b](u)</p>\n"),
+            "Feature Converter Emphasis Test");
+}
+
+// --- ESCAPING TESTS ---
+
+// Text, URLs and alt text are escaped for where they land; rule output is not
+void test_HtmlEscaping() {
+  ASSERT_EQ(convert_markdown_to_html("# <script> & 'x'\n"),
+            std::string("<h1>&lt;script&gt; &amp; 'x'</h1>\n"),
+            "Escape Heading Test");
+  ASSERT_EQ(convert_markdown_to_html("[a<b](x\"onclick=\"y') "
+                                     "![\"alt\"](i.png?a=1&b=2)\n"),
+            std::string("<p><a href=\"x&quot;onclick=&quot;y&#39;\">a&lt;b</a> "
+                        "<img src=\"i.png?a=1&amp;b=2\" alt=\"&quot;alt&quot;\">"
+                        "</p>\n"),
+            "Escape Attribute Test");
+  ASSERT_EQ(convert_markdown_to_html("<h1>raw</h1>\n"),
+            std::string("<p>&lt;h1&gt;raw&lt;/h1&gt;</p>\n"),
+            "Escape Raw HTML Line Test");
+
+  InlineRuleTable rules;
+  rules.add_rule('~', R"(~~([^~]+)~~)", [](const std::cmatch &match) {
+    return "<del>" + match[1].str() + "</del>";
+  });
+  ASSERT_EQ(convert_markdown_to_html("~~a~~ <b>\n", {.rules = &rules}),
+            std::string("<p><del>a</del> &lt;b&gt;</p>\n"),
+            "Escape Custom Rule Test");
+}
+
+// The vector scan finds special bytes wherever they fall in a block
+void test_AppendEscaped() {
+  std::string text;
+  for (int i = 0; i < 300; ++i)
+    text += i % 37 == 0 ? '<' : i % 53 == 0 ? '"' : (char)('a' + i % 7);
+  auto escape = [](std::string_view text) {
+    std::string out;
+    for (char c : text)
+      out += c == '<' ? "&lt;" : c == '"' ? "&quot;" : std::string(1, c);
+    return out;
+  };
+  for (size_t start = 0; start < 40; ++start) {
+    std::string out;
+    append_escaped(out, std::string_view(text).substr(start), ESCAPE_ATTRIBUTE);
+    ASSERT_EQ(out, escape(std::string_view(text).substr(start)),
+              "Append Escaped Offset " + std::to_string(start));
+  }
+  std::string out;
+  append_escaped(out, "\"<a>\"", ESCAPE_TEXT);
+  ASSERT_EQ(out, std::string("\"&lt;a&gt;\""), "Append Escaped Text Test");
+}
+
+// --- REFERENCES TESTS ---
+
+// A reference resolves through a definition anywhere in the document; labels
+// ignore case, the first definition wins and an unknown label stays text
+void test_ReferenceLinks() {
+  ASSERT_EQ(convert_markdown_to_html(
+                "See [the docs][Docs] and [x][missing].\n\n"
+                "[docs]: http://d.com/?a=1&b \"title\"\n[DOCS]: http://2\n"),
+            std::string("<p>See <a href=\"http://d.com/?a=1&amp;b\">the docs"
+                        "</a> and [x][missing].</p>\n"),
+            "Reference Link Test");
+  ASSERT_EQ(convert_markdown_to_html("[b]: u\n[a][b] x [c](d)\n"),
+            std::string("<p><a href=\"u\">a</a> x <a href=\"d\">c</a></p>\n"),
+            "Reference Link Before Use Test");
+  ASSERT_EQ(convert_markdown_to_html("- one [l][r]\n[r]: /r\n- two\n"),
+            std::string("<ul>\n<li>one <a href=\"/r\">l</a></li>\n"
+                        "<li>two</li>\n</ul>\n"),
+            "Reference Definition In List Test");
+}
+
+// Footnotes are numbered in numeric order, not as strings, by both engines
+void test_FootnoteNumericOrder() {
+  std::string doc = "A[^10] B[^2]\n[^10]: ten\n[^2]: two\n";
+  for (InlineEngine engine : {INLINE_SCANNER, INLINE_REGEX}) {
+    std::string html = convert_markdown_to_html(doc, {.engine = engine});
+    ASSERT_EQ(html.find("<li id=\"fn2\">") < html.find("<li id=\"fn10\">"),
+              true, "Footnote Numeric Order Test");
+  }
+}
+
+// Streaming, parallel and incremental conversion resolve references the same
+// as batch, wherever the definition lands
+void test_ReferencesStreamParallelDocument() {
+  std::string doc = "# [Title][t]\n\n- [one][a] and [two][B]\n- three\n\n";
+  for (int i = 0; i < 20; ++i)
+    doc += "Paragraph " + std::to_string(i) + " with [a ref][a].\n\n";
+  doc += "[a]: /a\n\n[b]: /b\n[t]: /t\n";
+  std::string expected = convert_markdown_to_html(doc);
+  for (size_t chunk : {1, 7, 64}) {
+    std::string actual;
+    MarkdownStream stream(output_iterator_sink(std::back_inserter(actual)));
+    for (size_t i = 0; i < doc.size(); i += chunk)
+      stream.write(std::string_view(doc).substr(i, chunk));
+    stream.finish();
+    ASSERT_EQ(actual, expected,
+              "References Stream Test, chunk " + std::to_string(chunk));
+  }
+  ThreadPool pool(3);
+  for (size_t piece : {1, 40, 4096})
+    ASSERT_EQ(convert_markdown_parallel(doc, pool, {}, piece), expected,
+              "References Parallel Test, piece " + std::to_string(piece));
+
+  // Each edit replaces the first occurrence of a piece of text
+  Document document(doc);
+  struct Edit {
+    std::string_view at, text;
+  };
+  for (Edit edit : std::initializer_list<Edit>{
+           {"/a\n", "/changed\n"},             // Changes a definition
+           {"", "[t]: /first\n\n"},             // Adds one that wins
+           {"[t]: /first\n\n", ""},             // and removes it
+           {"[t]: /t\n", ""},                   // Leaves [t] undefined
+           {"[b]: /b\n", "[b]: /b\n[t]: /t\n"}}) { // and defines it again
+    size_t offset = document.text().find(edit.at);
+    std::vector<std::string> blocks;
+    for (size_t i = 0; i < document.block_count(); ++i)
+      blocks.emplace_back(document.block_html(i));
+    DocumentPatch patch = document.edit(offset, edit.at.size(), edit.text);
+    blocks.erase(blocks.begin() + (ptrdiff_t)patch.first,
+                 blocks.begin() + (ptrdiff_t)(patch.first + patch.removed));
+    blocks.insert(blocks.begin() + (ptrdiff_t)patch.first,
+                  patch.inserted.begin(), patch.inserted.end());
+    std::string patched;
+    for (auto &block : blocks)
+      patched += block;
+    std::string expected_html = convert_markdown_to_html(document.text());
+    ASSERT_EQ(document.html(), expected_html,
+              "References Document Test, text \"" + document.text() + "\"");
+    ASSERT_EQ(patched + document.footnotes_html(), expected_html,
+              "References Document Patch Test, text \"" + document.text() +
+                  "\"");
+  }
+}
+
+// --- INDEX TESTS ---
+
+// Headings get unique anchors, and every target is found at its offset
+void test_DocumentIndex() {
+  std::string doc = "# Intro *to* it\n\nSee [a \"b\"](/x?q=1) and ![pic](p.png)"
+                    "[^1] [c][ref].\n## Intro to it\n# intro-to-it\n"
+                    "- [d][none]\n[ref]: /r\n[^1]: note\n";
+  DocumentIndex index;
+  std::string html;
+  convert_markdown_to_html(doc, html, {.index = &index});
+  ASSERT_EQ(html, convert_markdown_to_html(doc), "Index Leaves HTML Test");
+
+  std::string anchors;
+  for (const auto &heading : index.headings)
+    anchors += std::string(heading.anchor) + " ";
+  ASSERT_EQ(anchors, std::string("intro-to-it intro-to-it-1 intro-to-it-2 "),
+            "Index Anchors Test");
+  ASSERT_EQ(std::string(index.headings[0].text), std::string("Intro to it"),
+            "Index Heading Text Test");
+  ASSERT_EQ(index.links.size(), (size_t)4, "Index Links Test");
+  for (const auto &link : index.links) {
+    std::string_view target =
+        link.type == NODE_LINK_REF ? link.label : link.url;
+    ASSERT_EQ(doc.compare(link.offset, target.size(), target), 0,
+              "Index Link Offset Test, " + std::string(target));
+  }
+  ASSERT_EQ(std::string(index.links[2].url), std::string("/r"),
+            "Index Reference Test");
+  ASSERT_EQ(index.links[3].url.empty(), true, "Index Undefined Reference Test");
+  ASSERT_EQ(index.footnotes.size() == 1 && index.footnotes[0].defined &&
+                doc.compare(index.footnotes[0].offset, 1, "1") == 0,
+            true, "Index Footnote Test");
+  std::string json = index.json();
+  ASSERT_EQ(json.find("{\"type\": \"link\", \"url\": \"/x?q=1\", "
+                      "\"text\": \"a \\\"b\\\"\", \"offset\": 29}") !=
+                std::string::npos,
+            true, "Index JSON Test");
+}
+
+// Streaming, index only and regex conversion gather the same index as a
+// whole document, wherever lines and definitions fall
+void test_IndexStreamMatchesBatch() {
+  std::string doc = "# Title [home](/)\n\n- one [a][r] *b*\n[r]: /r\n"
+                    "- two ![img](i.png)[^1]\n[^1]: see [n](/note) and [^2]\n"
+                    "# Title\nText [x](y)\r\n1. [z][R]\n[^2]: two\n"
+                    "last [q](/q)";
+  DocumentIndex expected, index;
+  std::string html;
+  convert_markdown_to_html(doc, html, {.index = &expected});
+  for (size_t chunk : {1, 7, 64}) {
+    std::string actual;
+    MarkdownStream stream(output_iterator_sink(std::back_inserter(actual)),
+                          {.index = &index});
+    for (size_t i = 0; i < doc.size(); i += chunk)
+      stream.write(std::string_view(doc).substr(i, chunk));
+    stream.finish();
+    ASSERT_EQ(index.json(), expected.json(),
+              "Index Stream Test, chunk " + std::to_string(chunk));
+    ASSERT_EQ(actual, html, "Index Stream HTML Test");
+  }
+  index_markdown(doc, index);
+  ASSERT_EQ(index.json(), expected.json(), "Index Only Test");
+  convert_markdown_to_html(doc, {.engine = INLINE_REGEX, .index = &index});
+  ASSERT_EQ(index.json(), expected.json(), "Index Regex Test");
+}
+
+// Index only leaves the text and emphasis around links out of the tree, but
+// finds the same links, with the same text, as a full parse, including those
+// a nesting limit keeps as text
+void test_IndexOnlyEmphasis() {
+  std::string doc = "*a [b **c**](/1) d* **e *[f][r] g* h**\n\n"
+                    "| *x* | **[y](/2)** |\n|---|---|\n| ![i](j) | *[^1]* |\n"
+                    "[r]: /r\n[^1]: *see **[n](/n)***\n";
+  for (size_t nesting : {0, 1}) {
+    ConvertOptions options{.limits = {.max_nesting = nesting}};
+    DocumentIndex expected, index;
+    std::string html;
+    convert_markdown_to_html(doc, html,
+                             {.limits = options.limits, .index = &expected});
+    index_markdown(doc, index, options);
+    ASSERT_EQ(index.json(), expected.json(),
+              "Index Only Emphasis Test, nesting " + std::to_string(nesting));
+  }
+}
+
+// --- BLOCK TESTS ---
+
+// Code blocks are copied as they are, quotes nest and tables take their
+// alignment from the delimiter row
+void test_BlockExtensions() {
+  ASSERT_EQ(convert_markdown_to_html("```c++ main\nif (a < b) *p = [x](y);\n"
+                                     "[x]: /not-a-definition\n\n````\n"
+                                     "[x][x]\n"),
+            std::string("<pre><code class=\"language-c++\">if (a &lt; b) *p = "
+                        "[x](y);\n[x]: /not-a-definition\n\n</code></pre>\n"
+                        "<p>[x][x]</p>\n"),
+            "Code Block Test");
+  ASSERT_EQ(convert_markdown_to_html("~~~\n# not closed by ```\n"),
+            std::string("<pre><code># not closed by ```\n</code></pre>\n"),
+            "Unclosed Code Block Test");
+  ASSERT_EQ(convert_markdown_to_html("> # Q\n> - *a*\n>> b\n> c\n\n> d\n"),
+            std::string("<blockquote>\n<h1>Q</h1>\n<ul>\n<li><em>a</em></li>\n"
+                        "</ul>\n<blockquote>\n<p>b</p>\n</blockquote>\n"
+                        "<p>c</p>\n</blockquote>\n<blockquote>\n<p>d</p>\n"
+                        "</blockquote>\n"),
+            "Blockquote Test");
+  ASSERT_EQ(convert_markdown_to_html("| a | *b* | c |\n|:--|:-:|--:|\n"
+                                     "| 1 | [l](u) |\n4|5|6|7\nafter\n"),
+            std::string("<table>\n<thead>\n<tr>\n<th align=\"left\">a</th>\n"
+                        "<th align=\"center\"><em>b</em></th>\n"
+                        "<th align=\"right\">c</th>\n</tr>\n</thead>\n"
+                        "<tbody>\n<tr>\n<td align=\"left\">1</td>\n"
+                        "<td align=\"center\"><a href=\"u\">l</a></td>\n"
+                        "<td align=\"right\"></td>\n</tr>\n<tr>\n"
+                        "<td align=\"left\">4</td>\n"
+                        "<td align=\"center\">5</td>\n"
+                        "<td align=\"right\">6</td>\n</tr>\n</tbody>\n"
+                        "</table>\n<p>after</p>\n"),
+            "Table Test");
+  ASSERT_EQ(convert_markdown_to_html("a | b\n--|--|--\n"),
+            std::string("<p>a | b</p>\n<p>--|--|--</p>\n"),
+            "Table Needs Matching Delimiter Test");
+}
+
+// Streaming, parallel and incremental conversion agree with a whole
+// document, however the code blocks, quotes and tables are cut up
+void test_BlocksStreamParallelDocument() {
+  std::string doc = "# T\n```\n# code\n[r]: /code\n\n- x\n```\n"
+                    "> q [a][r]\n> | h | i |\n> |---|---|\n> | 1 | 2 |\n"
+                    "| a | b |\n[r]: /r\n|---|---|\n| [c][r] | d |\n"
+                    "[^1]: n\n| e |\ntext[^1]\n~~~~\n~~~\n";
+  std::string expected = convert_markdown_to_html(doc);
+  for (size_t chunk : {1, 7, 64}) {
+    std::string actual;
+    MarkdownStream stream(output_iterator_sink(std::back_inserter(actual)));
+    for (size_t i = 0; i < doc.size(); i += chunk)
+      stream.write(std::string_view(doc).substr(i, chunk));
+    stream.finish();
+    ASSERT_EQ(actual, expected,
+              "Blocks Stream Test, chunk " + std::to_string(chunk));
+  }
+  ThreadPool pool(3);
+  for (size_t piece : {1, 16, 1 << 20})
+    ASSERT_EQ(convert_markdown_parallel(doc, pool, {}, piece), expected,
+              "Blocks Parallel Test, piece " + std::to_string(piece));
+
+  // Opening a code block turns the rest of the document into code, and
+  // closing it again restores it
+  Document document(doc);
+  document.edit(0, 0, "```\n");
+  ASSERT_EQ(document.html(), convert_markdown_to_html(document.text()),
+            "Blocks Document Open Fence Test");
+  document.edit(0, 4, "");
+  ASSERT_EQ(document.html(), expected, "Blocks Document Close Fence Test");
+}
+
+// A long table or code block goes to the sink as it is read rather than
+// when it ends
+void test_LongBlocksStream() {
+  for (std::string start : {"| n | x |\n|--:|---|\n", "```\n"}) {
+    std::string doc = start;
+    for (int i = 0; i < 20000; ++i)
+      doc += "| " + std::to_string(i) + " | <x> |\n";
+    std::string expected = convert_markdown_to_html(doc + "\nend\n");
+    std::string actual;
+    MarkdownStream stream(output_iterator_sink(std::back_inserter(actual)));
+    stream.write(doc);
+    ASSERT_EQ(actual.size() > expected.size() * 9 / 10, true,
+              "Long Block Streams Test");
+    stream.write("\nend\n");
+    stream.finish();
+    ASSERT_EQ(actual, expected, "Long Block Stream Output Test");
+  }
+}
+
+// Quotes nest no deeper than the default limit, so a document of nothing but
+// markers is written without running out of stack, in every back-end
+void test_DeepQuotes() {
+  std::string doc, opened, closed, text;
+  for (int i = 0; i < 20000; ++i)
+    doc += "> ";
+  for (size_t i = 0; i < default_max_quote_depth; ++i) {
+    opened += "<blockquote>\n";
+    closed += "</blockquote>\n";
+  }
+  for (size_t i = default_max_quote_depth; i < 20000; ++i)
+    text += "&gt; ";
+  std::string expected = opened + "<p>" + text + "x</p>\n" + closed;
+  ASSERT_EQ(convert_markdown_to_html(doc + "x\n"), expected,
+            "Deep Quotes Test");
+  std::string linear;
+  convert_markdown_to_html(doc + "x\n", linear, {.limits = {.linear = true}});
+  ASSERT_EQ(linear, expected, "Deep Quotes Linear Test");
+  std::string ansi;
+  convert_markdown<AnsiRenderer>(doc + "x\n", ansi);
+  ASSERT_EQ(ansi.find("> x\n") != std::string::npos, true,
+            "Deep Quotes ANSI Test");
+}
+
 // Function to register all tests. Call this from your main test runner.
+// --- RENDERER TESTS ---
+
+// One parse written out by each back-end. HTML through the generic entry
+// point is the same as convert_markdown_to_html
+void test_RenderBackends() {
+  std::string md = "# T\n\nA **b** [l](u) [r][x] ![i](p.png)[^1]\n\n- x\n\n"
+                   "> q\n\n```\n1 < 2\n```\n\n| a | b |\n|--|--:|\n"
+                   "| c | dd |\n\n[x]: /r\n[^1]: N\n";
+  MarkdownAst ast = parse_markdown(md);
+  ASSERT_EQ(render_text(ast),
+            std::string("T\nA b l r i[1]\nx\nq\n1 < 2\na\tb\nc\tdd\n[1] N\n"),
+            "Plain Text Test");
+  ASSERT_EQ(render_ansi(ast),
+            std::string("\x1b[1;4mT\x1b[22;24m\n\nA \x1b[1mb\x1b[22m "
+                        "\x1b[4ml\x1b[24m \x1b[34m(u)\x1b[39m \x1b[4mr\x1b[24m "
+                        "\x1b[34m(/r)\x1b[39m [image: i] \x1b[34m(p.png)"
+                        "\x1b[39m\x1b[2m[1]\x1b[22m\n\n  • x\n\n"
+                        "\x1b[2m│\x1b[22m q\n\n    \x1b[36m1 < 2\x1b[39m\n\n"
+                        "\x1b[1ma\x1b[22m   \x1b[1mb\x1b[22m\n─  ──\n"
+                        "c  dd\n\n\x1b[2m────\x1b[22m\n[1] N\n"),
+            "ANSI Test");
+  std::string html;
+  convert_markdown<HtmlRenderer>(md, html);
+  ASSERT_EQ(html, convert_markdown_to_html(md), "HTML Back-end Test");
+}
+
+// A document cannot send the terminal escape sequences of its own, C0 or C1
+void test_AnsiControlCharacters() {
+  std::string text;
+  convert_markdown<AnsiRenderer>("a\x1b[2Jb\x7f \xc2\x9b" "31m \xc2\xa9\t.",
+                                 text);
+  ASSERT_EQ(text, std::string("a?[2Jb? ?31m \xc2\xa9\t.\n"),
+            "ANSI Control Characters Test");
+}
+
+// --- PIPELINE TESTS ---
+
+// Markdown through a pipe into a Reader, converted, and the HTML out through
+// a Writer into another pipe, with buffers small enough to go round many
+// times, comes out as in one go
+void test_PipelineReaderWriter() {
+  std::string markdown;
+  for (int i = 0; i < 4000; ++i)
+    markdown += "## H" + std::to_string(i) + "\n\n*a* [b](c) d\n\n";
+  std::string expected = convert_markdown_to_html(markdown);
+  int in[2], out[2];
+  ASSERT_EQ(pipe(in) == 0 && pipe(out) == 0, true, "Pipes Test");
+  std::thread feeding([&] {
+    for (size_t pos = 0; pos < markdown.size(); pos += 1000)
+      Serve::write_all(in[1], markdown.data() + pos,
+                       std::min<size_t>(1000, markdown.size() - pos));
+    close(in[1]);
+  });
+  std::string html;
+  std::thread draining([&] {
+    char buffer[3000];
+    ssize_t n;
+    while ((n = read(out[0], buffer, sizeof(buffer))) > 0)
+      html.append(buffer, (size_t)n);
+  });
+  {
+    Pipeline::Reader reader(in[0], 4096, 2);
+    Pipeline::Writer writer(out[1], 8192, 2);
+    MarkdownStream stream(
+        [&](std::string_view piece) { writer.append(piece); });
+    for (std::string_view chunk; !(chunk = reader.next()).empty();) {
+      if (!reader.ready())
+        writer.flush();
+      stream.write(chunk);
+    }
+    stream.finish();
+    ASSERT_EQ(writer.finish(), true, "Pipeline Writer Finish Test");
+    ASSERT_EQ(reader.stats().bytes, markdown.size(), "Pipeline Read Test");
+  }
+  close(out[1]);
+  feeding.join();
+  draining.join();
+  close(in[0]);
+  close(out[0]);
+  ASSERT_EQ(html, expected, "Pipeline Output Test");
+}
+
+// A failed write is reported and the rest of the output dropped
+void test_PipelineWriteError() {
+  int fd = open("/dev/full", O_WRONLY);
+  if (fd < 0)
+    return;
+  Pipeline::Writer writer(fd, 4096, 2);
+  for (int i = 0; i < 100; ++i)
+    writer.append(std::string(1000, 'x'));
+  ASSERT_EQ(writer.finish(), false, "Pipeline Write Error Test");
+  ASSERT_EQ(writer.error(), ENOSPC, "Pipeline Write Errno Test");
+  close(fd);
+}
+
+// --- WATCH TESTS ---
+
+// Files written, moved in with a directory and removed come back as
+// changes, a burst of writes in one batch
+void test_TreeWatcher() {
+  namespace fs = std::filesystem;
+  fs::path root = fs::temp_directory_path() / "mdc_watch_test";
+  fs::remove_all(root);
+  fs::create_directories(root / "a");
+  fs::create_directories(root.string() + "_new/b");
+  std::ofstream(root.string() + "_new/b/in.md") << "# b";
+  Watch::TreeWatcher watcher(root);
+  ASSERT_EQ(watcher.error(), std::string(), "Watcher Start Test");
+
+  auto describe = [](const Watch::Batch &batch, const fs::path &root) {
+    std::set<std::string> seen; // Repeats and order vary with the kernel
+    for (const auto &change : batch.changes)
+      seen.insert(std::to_string(change.kind) + " " +
+                  change.path.lexically_relative(root).string());
+    std::string text;
+    for (const auto &change : seen)
+      text += change + ";";
+    return text;
+  };
+  for (int i = 0; i < 5; ++i)
+    std::ofstream(root / "a" / "doc.md") << "# " << i;
+  ASSERT_EQ(describe(watcher.wait(2000, 50), root), std::string("0 a/doc.md;"),
+            "Watcher Write Test");
+  fs::rename(root.string() + "_new/b", root / "a" / "b");
+  ASSERT_EQ(describe(watcher.wait(2000, 50), root),
+            std::string("0 a/b/in.md;"), "Watcher Directory Test");
+  fs::remove(root / "a" / "b" / "in.md");
+  ASSERT_EQ(describe(watcher.wait(2000, 50), root),
+            std::string("1 a/b/in.md;"), "Watcher Remove Test");
+  watcher.interrupt();
+  ASSERT_EQ(watcher.wait(2000, 50).changes.size(), (size_t)0,
+            "Watcher Interrupt Test");
+  ASSERT_EQ(watcher.interrupted(), true, "Watcher Interrupted Test");
+  fs::remove_all(root);
+  fs::remove_all(root.string() + "_new");
+}
+
 void register_all_markdown_tests() {
   // Existing tests
   register_test("BasicParagraph", test_BasicParagraph);
@@ -239,6 +1358,95 @@ void register_all_markdown_tests() {
   register_test("Footnote", test_Footnote);
   register_test("MultipleFootnotes", test_MultipleFootnotes);
   register_test("LinkAndFootnoteInteraction", test_LinkAndFootnoteInteraction);
+
+  // Inline scanner
+  register_test("NestedInline", test_NestedInline);
+  register_test("ScannerMatchesRegex", test_ScannerMatchesRegex);
+  register_test("CustomInlineRule", test_CustomInlineRule);
+  register_test("OrderedList", test_OrderedList);
+  register_test("EmphasisStaysInBlock", test_EmphasisStaysInBlock);
+  register_test("FootnoteInsideList", test_FootnoteInsideList);
+
+  // Syntax tree
+  register_test("AstStructure", test_AstStructure);
+
+  // Streaming
+  register_test("StreamMatchesBatch", test_StreamMatchesBatch);
+  register_test("StreamFromIstream", test_StreamFromIstream);
+
+  // Input
+  register_test("MappedFile", test_MappedFile);
+
+  // Thread pool
+  register_test("ThreadPool", test_ThreadPool);
+
+  // Parallel conversion
+  register_test("SplitMarkdownBlocks", test_SplitMarkdownBlocks);
+  register_test("ParallelMatchesSerial", test_ParallelMatchesSerial);
+
+  // SIMD scan
+  register_test("SimdScanMatchesScalar", test_SimdScanMatchesScalar);
+
+  // Incremental conversion
+  register_test("DocumentEdits", test_DocumentEdits);
+  register_test("DocumentPatchIsLocal", test_DocumentPatchIsLocal);
+
+  // Output cache
+  register_test("OutputCache", test_OutputCache);
+
+  // Instrumentation
+  register_test("ConvertStats", test_ConvertStats);
+
+  // Scratch memory
+  register_test("ArenaReuse", test_ArenaReuse);
+  register_test("ArenaAllocate", test_ArenaAllocate);
+
+  // Embedding
+  register_test("Converter", test_Converter);
+  register_test("CInterface", test_CInterface);
+
+  // Server
+  register_test("LatencyHistogram", test_LatencyHistogram);
+  register_test("ServerPipelining", test_ServerPipelining);
+
+  // Limits
+  register_test("ConvertLimits", test_ConvertLimits);
+  register_test("LimitsStreamAndParallel", test_LimitsStreamAndParallel);
+  register_test("LinearSkipsCustomRules", test_LinearSkipsCustomRules);
+  register_test("LinearMixedLinks", test_LinearMixedLinks);
+
+  // Features
+  register_test("FeatureConverter", test_FeatureConverter);
+
+  // Escaping
+  register_test("HtmlEscaping", test_HtmlEscaping);
+  register_test("AppendEscaped", test_AppendEscaped);
+
+  // References
+  register_test("ReferenceLinks", test_ReferenceLinks);
+  register_test("FootnoteNumericOrder", test_FootnoteNumericOrder);
+  register_test("ReferencesStreamParallelDocument",
+                test_ReferencesStreamParallelDocument);
+
+  // Index
+  register_test("DocumentIndex", test_DocumentIndex);
+  register_test("IndexStreamMatchesBatch", test_IndexStreamMatchesBatch);
+  register_test("IndexOnlyEmphasis", test_IndexOnlyEmphasis);
+
+  // Blocks
+  register_test("BlockExtensions", test_BlockExtensions);
+  register_test("BlocksStreamParallelDocument",
+                test_BlocksStreamParallelDocument);
+  register_test("LongBlocksStream", test_LongBlocksStream);
+  register_test("DeepQuotes", test_DeepQuotes);
+  // Renderers
+  register_test("RenderBackends", test_RenderBackends);
+  register_test("AnsiControlCharacters", test_AnsiControlCharacters);
+  // Pipeline
+  register_test("PipelineReaderWriter", test_PipelineReaderWriter);
+  register_test("PipelineWriteError", test_PipelineWriteError);
+  // Watch
+  register_test("TreeWatcher", test_TreeWatcher);
 }
 
 int main() {
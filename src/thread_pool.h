@@ -0,0 +1,147 @@
+#ifndef BLIBS_THREAD_POOL_H
+#define BLIBS_THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads, each with its own queue of tasks. A worker
+// runs its own tasks oldest first and, once it runs dry, steals the newest
+// task from another worker's queue. Tasks submitted from outside are dealt
+// out round robin, so submitting the biggest jobs first gets them started
+// first on every worker.
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t thread_count = std::thread::hardware_concurrency()) {
+        if (thread_count == 0)
+            thread_count = 1;
+        for (size_t i = 0; i < thread_count; ++i)
+            queues.push_back(std::make_unique<Queue>());
+        for (size_t i = 0; i < thread_count; ++i)
+            threads.emplace_back([this, i] { worker(i); });
+    }
+
+    // Finishes every queued task, then stops the workers.
+    ~ThreadPool() {
+        wait_quietly();
+        {
+            std::lock_guard<std::mutex> guard(state_lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto &thread : threads)
+            thread.join();
+    }
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    size_t size() const { return threads.size(); }
+
+    // Queue a task. May be called from any thread, including from a task.
+    void submit(std::function<void()> task) {
+        size_t index =
+            next_queue.fetch_add(1, std::memory_order_relaxed) % queues.size();
+        unfinished.fetch_add(1);
+        {
+            std::lock_guard<std::mutex> guard(queues[index]->lock);
+            queues[index]->tasks.push_back(std::move(task));
+        }
+        {
+            std::lock_guard<std::mutex> guard(state_lock);
+            ++queued;
+        }
+        wake.notify_one();
+    }
+
+    // Block until every submitted task has finished. If a task threw, the
+    // first exception is rethrown here.
+    void wait() {
+        wait_quietly();
+        std::exception_ptr error;
+        {
+            std::lock_guard<std::mutex> guard(state_lock);
+            std::swap(error, first_error);
+        }
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+private:
+    struct Queue {
+        std::mutex lock;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    void wait_quietly() {
+        std::unique_lock<std::mutex> guard(state_lock);
+        idle.wait(guard, [this] { return unfinished.load() == 0; });
+    }
+
+    // Own queue from the front, then the back of everybody else's.
+    bool pop(size_t self, std::function<void()> &task) {
+        for (size_t n = 0; n < queues.size(); ++n) {
+            Queue &queue = *queues[(self + n) % queues.size()];
+            std::lock_guard<std::mutex> guard(queue.lock);
+            if (queue.tasks.empty())
+                continue;
+            if (n == 0) {
+                task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+            } else {
+                task = std::move(queue.tasks.back());
+                queue.tasks.pop_back();
+            }
+            return true;
+        }
+        return false;
+    }
+
+    void worker(size_t self) {
+        std::function<void()> task;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> guard(state_lock);
+                wake.wait(guard, [this] { return stopping || queued > 0; });
+                if (queued == 0)
+                    return; // stopping, and nothing left to do
+                --queued;
+            }
+            // A task is reserved for us, though maybe in another queue
+            while (!pop(self, task))
+                std::this_thread::yield();
+            try {
+                task();
+            } catch (...) {
+                std::lock_guard<std::mutex> guard(state_lock);
+                if (!first_error)
+                    first_error = std::current_exception();
+            }
+            task = nullptr;
+            if (unfinished.fetch_sub(1) == 1) {
+                std::lock_guard<std::mutex> guard(state_lock);
+                idle.notify_all();
+            }
+        }
+    }
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> threads;
+    std::atomic<size_t> next_queue{0};
+    std::atomic<size_t> unfinished{0};
+
+    std::mutex state_lock;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    size_t queued = 0; // Tasks in the queues not yet claimed by a worker
+    bool stopping = false;
+    std::exception_ptr first_error;
+};
+
+#endif //BLIBS_THREAD_POOL_H
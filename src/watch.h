@@ -0,0 +1,226 @@
+#ifndef BLIBS_WATCH_H
+#define BLIBS_WATCH_H
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__linux__)
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+// Watches a directory tree for changed files with inotify, for rebuilding
+// outputs as their inputs are edited. Subdirectories are watched as they
+// appear, and one moved or created with files already in it has those
+// reported too. Changes come back in batches: after the first, wait() goes
+// on collecting until none has come for a quiet period, so the burst of
+// events from one editor save, or from a checkout, makes one batch.
+namespace Watch {
+
+    enum ChangeKind {
+        CHANGE_WRITTEN, // Created, written and closed, moved in or touched
+        CHANGE_REMOVED, // Deleted or moved away; a directory takes its files
+        CHANGE_RESCAN,  // Events were lost: compare the whole tree again
+    };
+
+    struct Change {
+        ChangeKind kind;
+        std::filesystem::path path;
+        bool directory = false;
+    };
+
+    struct Batch {
+        std::vector<Change> changes;
+        std::chrono::steady_clock::time_point first; // When the first came
+    };
+
+    class TreeWatcher {
+    public:
+        explicit TreeWatcher(const std::filesystem::path &root) {
+#if defined(__linux__)
+            fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+            wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (fd < 0 || wake_fd < 0) {
+                failure = std::strerror(errno);
+                return;
+            }
+            std::vector<Change> ignored;
+            if (!add_tree(root, ignored))
+                failure = root.string() + ": " + std::strerror(errno);
+#else
+            (void)root;
+            failure = "watching needs inotify, which only Linux has";
+#endif
+        }
+
+        ~TreeWatcher() {
+#if defined(__linux__)
+            if (fd >= 0)
+                ::close(fd);
+            if (wake_fd >= 0)
+                ::close(wake_fd);
+#endif
+        }
+
+        TreeWatcher(const TreeWatcher &) = delete;
+        TreeWatcher &operator=(const TreeWatcher &) = delete;
+
+        // Empty if the tree is being watched, else what went wrong.
+        const std::string &error() const { return failure; }
+
+        // Wait for changes, then collect more until none has come for
+        // quiet_ms or max_ms have passed since the first. Empty if
+        // timeout_ms (-1 for ever) passed with none, or after interrupt().
+        Batch wait(int timeout_ms, int quiet_ms, int max_ms = 1000) {
+            Batch batch;
+#if defined(__linux__)
+            using Clock = std::chrono::steady_clock;
+            if (!failure.empty() || !poll_events(timeout_ms))
+                return batch;
+            batch.first = Clock::now();
+            auto deadline = batch.first + std::chrono::milliseconds(max_ms);
+            while (true) {
+                read_events(batch.changes);
+                auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    deadline - Clock::now());
+                if (left.count() <= 0 ||
+                    !poll_events((int)std::min<long long>(quiet_ms, left.count())))
+                    break;
+            }
+#else
+            (void)timeout_ms, (void)quiet_ms, (void)max_ms;
+#endif
+            return batch;
+        }
+
+        // Make a wait() in progress, or the next one, return empty. Safe to
+        // call from another thread or a signal handler.
+        void interrupt() {
+#if defined(__linux__)
+            uint64_t one = 1;
+            [[maybe_unused]] ssize_t n = ::write(wake_fd, &one, sizeof(one));
+#endif
+        }
+
+        bool interrupted() const { return stopped; }
+
+    private:
+#if defined(__linux__)
+        static constexpr uint32_t file_events =
+            IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVED_TO | IN_MOVED_FROM |
+            IN_DELETE | IN_CREATE | IN_DELETE_SELF | IN_ONLYDIR;
+
+        // Whether events are waiting, waiting up to timeout_ms for them.
+        bool poll_events(int timeout_ms) {
+            pollfd fds[2] = {{fd, POLLIN, 0}, {wake_fd, POLLIN, 0}};
+            while (true) {
+                int n = ::poll(fds, 2, timeout_ms);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (fds[1].revents & POLLIN) {
+                    uint64_t count;
+                    [[maybe_unused]] ssize_t r =
+                        ::read(wake_fd, &count, sizeof(count));
+                    stopped = true;
+                    return false;
+                }
+                return n > 0;
+            }
+        }
+
+        // Watch dir and every directory under it. The files already there
+        // are added to changes, as they may be new to the caller.
+        bool add_tree(const std::filesystem::path &dir,
+                      std::vector<Change> &changes) {
+            int wd = inotify_add_watch(fd, dir.c_str(), file_events);
+            if (wd < 0)
+                return false;
+            directories[wd] = dir;
+            std::error_code ec;
+            for (auto it = std::filesystem::directory_iterator(dir, ec);
+                 !ec && it != std::filesystem::directory_iterator();
+                 it.increment(ec)) {
+                if (it->is_directory(ec))
+                    add_tree(it->path(), changes);
+                else
+                    changes.push_back({CHANGE_WRITTEN, it->path()});
+            }
+            return true;
+        }
+
+        // Stop watching dir and the directories under it.
+        void remove_tree(const std::filesystem::path &dir) {
+            std::string prefix = dir.string() + "/";
+            std::erase_if(directories, [&](const auto &entry) {
+                const std::string path = entry.second.string();
+                if (path != dir.string() && path.rfind(prefix, 0) != 0)
+                    return false;
+                inotify_rm_watch(fd, entry.first);
+                return true;
+            });
+        }
+
+        void read_events(std::vector<Change> &changes) {
+            alignas(inotify_event) char buffer[64 * 1024];
+            while (true) {
+                ssize_t n = ::read(fd, buffer, sizeof(buffer));
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0)
+                    return;
+                for (ssize_t pos = 0; pos < n;) {
+                    auto *event = reinterpret_cast<inotify_event *>(buffer + pos);
+                    pos += (ssize_t)(sizeof(inotify_event) + event->len);
+                    add_change(*event, changes);
+                }
+            }
+        }
+
+        void add_change(const inotify_event &event, std::vector<Change> &changes) {
+            if (event.mask & IN_Q_OVERFLOW) {
+                changes.push_back({CHANGE_RESCAN, {}});
+                return;
+            }
+            auto dir = directories.find(event.wd);
+            if (dir == directories.end())
+                return;
+            if (event.mask & (IN_IGNORED | IN_DELETE_SELF)) {
+                if (event.mask & IN_IGNORED)
+                    directories.erase(dir);
+                return;
+            }
+            if (!event.len)
+                return;
+            std::filesystem::path path = dir->second / event.name;
+            bool is_dir = event.mask & IN_ISDIR;
+            if (event.mask & (IN_DELETE | IN_MOVED_FROM)) {
+                if (is_dir)
+                    remove_tree(path);
+                changes.push_back({CHANGE_REMOVED, path, is_dir});
+            } else if (is_dir) {
+                if (event.mask & (IN_CREATE | IN_MOVED_TO))
+                    add_tree(path, changes);
+            } else if (event.mask & (IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVED_TO)) {
+                changes.push_back({CHANGE_WRITTEN, path});
+            }
+        }
+
+        int fd = -1;
+        int wake_fd = -1;
+        std::unordered_map<int, std::filesystem::path> directories;
+#endif
+        std::string failure;
+        bool stopped = false;
+    };
+
+} // namespace Watch
+
+#endif //BLIBS_WATCH_H